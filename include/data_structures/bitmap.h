@@ -0,0 +1,57 @@
+/**
+ * @file bitmap.h
+ * @brief Prototypes of a growable bitmap data structure.
+ */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+
+/* -------------------------------- INCLUDE --------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------- DEFINE --------------------------------- */
+
+/* Un indice vient parfois du reseau : la croissance s'arrete a 8 Mio */
+#define BITMAP_BITS_MAX ((size_t) 1 << 26)
+
+/* -------------------------------- STRUCTURE ------------------------------- */
+
+/**
+ * @brief A set of indexes stored one bit each, with the number of bits set.
+ *
+ * The bitmap grows by doubling when an index past its capacity is set, up
+ * to BITMAP_BITS_MAX bits.
+ */
+typedef struct bitmap
+{
+	uint64_t *words;
+	size_t capacity;   /* En bits, multiple de 64 */
+	size_t count;      /* Bits a 1 */
+
+	int (*set) (struct bitmap *bitmap, size_t i);
+	uint8_t (*test) (struct bitmap *bitmap, size_t i);
+} Bitmap;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes an empty bitmap able to hold capacity bits.
+ *
+ * set returns 1 if the bit was not set yet, 0 if it already was and -1
+ * if the bitmap could not grow, or i is not below BITMAP_BITS_MAX.
+ *
+ * @return 0 on success, 1 if the allocation failed.
+ */
+uint8_t bitmap_new(Bitmap *bitmap, size_t capacity);
+
+/**
+ * @brief Frees the memory used by a bitmap.
+ */
+void bitmap_free(Bitmap *bitmap);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* BITMAP_H */
@@ -0,0 +1,84 @@
+/**
+ * @file reassembly.h
+ * @brief Prototypes of a block reassembly buffer data structure.
+ */
+
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+
+/* -------------------------------- INCLUDE --------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data_structures/bitmap.h"
+
+/* --------------------------------- DEFINE --------------------------------- */
+
+/* Blocs par page de donnees, une page n'est jamais deplacee */
+#define REASSEMBLY_PAGE_BLOCKS 64
+
+/* Taille reconstituee au plus : un bloc numerote au-dela est refuse */
+#define REASSEMBLY_SIZE_MAX    ((size_t) 1 << 32)
+
+/* -------------------------------- STRUCTURE ------------------------------- */
+
+/**
+ * @brief Gathers the numbered blocks of a transfer, in any order.
+ *
+ * The blocks received are tracked in a bitmap. When 'store' is set their
+ * data is copied in fixed size pages allocated on demand, otherwise the
+ * caller keeps the data itself (on disk for instance). Only the table of
+ * pages grows, by doubling, the blocks already stored never move.
+ */
+typedef struct reassembly
+{
+	size_t block_size;
+	uint8_t store;
+	size_t limit;      /* Nombre de blocs au plus */
+
+	char **pages;      /* REASSEMBLY_PAGE_BLOCKS blocs par page */
+	size_t npages;
+
+	Bitmap received;
+	size_t contiguous; /* Blocs recus sans trou depuis le debut */
+	size_t highest;    /* Indice du plus grand bloc recu + 1 */
+	size_t last;       /* Nombre total de blocs, 0 tant qu'inconnu */
+	size_t size;       /* Taille totale, connue avec le dernier bloc */
+
+	int (*insert) (struct reassembly *r, size_t i, const char *data,
+		       size_t len, uint8_t is_last);
+	uint8_t (*expect) (struct reassembly *r, size_t count);
+	size_t (*missing) (struct reassembly *r);
+	uint8_t (*complete) (struct reassembly *r);
+	char * (*block) (struct reassembly *r, size_t i);
+} Reassembly;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes an empty reassembly buffer.
+ *
+ * insert returns 1 if the block is new, 0 if it is a duplicate, does
+ * not fit the blocks already received or lies past REASSEMBLY_SIZE_MAX
+ * bytes, -1 if the memory ran out.
+ * expect sets the number of blocks announced by the sender, it returns 1
+ * if it contradicts the blocks already received or is too large.
+ * missing counts the holes below the highest block received, or below
+ * the last block once it is known. block returns the data of a stored
+ * block, NULL if it was not received.
+ *
+ * @param store 1 to keep the data of the blocks, 0 to only track them.
+ * @return 0 on success, 1 if the allocation failed.
+ */
+uint8_t reassembly_new(Reassembly *r, size_t block_size, uint8_t store);
+
+/**
+ * @brief Frees the memory used by a reassembly buffer.
+ */
+void reassembly_free(Reassembly *r);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* REASSEMBLY_H */
@@ -0,0 +1,76 @@
+/**
+ * @file record_log.h
+ * @brief Prototypes of an append-only log of variable-length records.
+ */
+
+#ifndef RECORD_LOG_H
+#define RECORD_LOG_H
+
+/* -------------------------------- INCLUDE --------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data_structures/array.h"
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/*
+ * Les pages doublent de LOG_PAGE_MIN a LOG_PAGE_MAX octets : un petit log
+ * reste petit et un gros n'a que peu de pages. Une position tient sur 32
+ * bits, page << 16 | decalage.
+ */
+#define LOG_PAGE_MIN     256
+#define LOG_PAGE_MAX     65536
+#define LOG_RECORD_MAX   LOG_PAGE_MAX
+
+/* Debut de chaque enregistrement, pour qu'il puisse contenir des entiers */
+#define LOG_RECORD_ALIGN 4
+
+/* -------------------------------- STRUCTURE ------------------------------- */
+
+/**
+ * @brief An append-only log of variable-length records, stored back to
+ * back in arena pages.
+ *
+ * A page is never moved nor freed before the log, so a record keeps its
+ * address and an append never copies the previous ones. Only the index,
+ * one 32-bit position per record, grows by reallocation.
+ */
+typedef struct record_log
+{
+	Array pages;          /* char *, dans l'ordre d'allocation */
+	size_t page_size;     /* Taille de la derniere page */
+	size_t page_used;     /* Octets occupes dans la derniere page */
+
+	Array index;          /* uint32_t, position de chaque enregistrement */
+	size_t length;
+
+	void * (*append) (struct record_log *log, size_t size);
+	void * (*get) (struct record_log *log, size_t i);
+	void (*drop) (struct record_log *log);
+} RecordLog;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Creates an empty log, no page is allocated before the first
+ * append.
+ *
+ * append reserves 'size' bytes for a new record at the end of the log and
+ * returns them to be filled, or NULL on failure. get returns record 'i',
+ * or NULL if it does not exist. drop removes the last record, to undo an
+ * append that could not be completed.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t record_log_new(RecordLog *log);
+
+/**
+ * @brief Frees the pages and the index of a log.
+ */
+void record_log_free(RecordLog *log);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* RECORD_LOG_H */
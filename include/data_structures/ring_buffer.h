@@ -0,0 +1,60 @@
+/**
+ * @file ring_buffer.h
+ * @brief Prototypes of a mirrored ring buffer data structure.
+ */
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+/* -------------------------------- INCLUDE --------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -------------------------------- STRUCTURE ------------------------------- */
+
+/**
+ * @brief A byte ring buffer whose memory is mapped twice in a row.
+ *
+ * Since buf[i] and buf[i + size] are the same byte, the readable bytes and
+ * the free space are always contiguous: data can be received and parsed in
+ * place even when it wraps around the end of the ring.
+ */
+typedef struct ring_buffer
+{
+	char *buf;
+	size_t size;
+
+	/* Positions absolues, modulo 'size' dans 'buf' */
+	size_t head;
+	size_t tail;
+
+	char * (*readable) (struct ring_buffer *ring, size_t *len);
+	void (*consume) (struct ring_buffer *ring, size_t len);
+	char * (*writable) (struct ring_buffer *ring, size_t *len);
+	void (*produce) (struct ring_buffer *ring, size_t len);
+} RingBuffer;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Creates an empty ring buffer.
+ *
+ * @param size The capacity, rounded up to a multiple of the page size.
+ * @return 0 on success, 1 on failure.
+ */
+uint8_t ring_buffer_new(RingBuffer *ring, size_t size);
+
+/**
+ * @brief Drops every byte of a ring buffer.
+ */
+void ring_buffer_clear(RingBuffer *ring);
+
+/**
+ * @brief Unmaps the memory used by a ring buffer.
+ */
+void ring_buffer_free(RingBuffer *ring);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* RING_BUFFER_H */
@@ -0,0 +1,112 @@
+/**
+ * @file timer_wheel.h
+ * @brief Prototypes of a hierarchical timer wheel data structure.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+
+/* -------------------------------- INCLUDE --------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/*
+ * Des ticks d'une milliseconde, TW_LEVELS niveaux de TW_SLOTS cases : le
+ * niveau l couvre les echeances a moins de TW_SLOTS^(l + 1) ms, soit plus
+ * de 4 heures pour le dernier. Au-dela, le timer attend dans le dernier
+ * niveau et y est replace.
+ */
+#define TW_BITS      6
+#define TW_SLOTS     (1 << TW_BITS)
+#define TW_LEVELS    4
+
+/* -------------------------------- STRUCTURE ------------------------------- */
+
+/**
+ * @brief A timer, embedded in the structure it watches.
+ *
+ * It is linked in a slot of its wheel while pending, which makes adding
+ * and cancelling it O(1).
+ */
+typedef struct timer
+{
+	struct timer *next;           /* NULL hors de la roue */
+	struct timer *prev;
+	struct timer_wheel *wheel;
+	uint8_t level;                /* TW_LEVELS : echu, pas encore traite */
+	uint8_t slot;
+
+	uint64_t expires;             /* Echeance, en ms */
+	void (*callback) (void *data);
+	void *data;
+} Timer;
+
+/**
+ * @brief A hierarchical timer wheel.
+ *
+ * A slot of level l > 0 is cascaded to the lower levels when the wheel
+ * reaches its first tick. A bitmap of the non empty slots of each level
+ * gives the next deadline without walking the empty ones.
+ */
+typedef struct timer_wheel
+{
+	uint64_t now;                         /* Prochain tick a traiter */
+	uint64_t occupied[TW_LEVELS];         /* Cases non vides */
+	Timer slots[TW_LEVELS][TW_SLOTS];     /* Tetes des listes circulaires */
+	Timer expired;                        /* Timers echus a rendre */
+
+	void (*add) (struct timer_wheel *wheel, Timer *timer,
+		     uint64_t expires);
+	Timer * (*expire) (struct timer_wheel *wheel, uint64_t now);
+	uint64_t (*next) (struct timer_wheel *wheel);
+} TimerWheel;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes an empty wheel whose clock starts at now, in ms.
+ *
+ * add (re)schedules a timer at expires, in ms, a pending timer is moved.
+ * expire unlinks and returns a timer whose deadline is at most now, NULL
+ * once there is none left. next returns the earliest deadline, UINT64_MAX
+ * if the wheel is empty.
+ */
+void timer_wheel_new(TimerWheel *wheel, uint64_t now);
+
+/**
+ * @brief Runs the callback of every timer whose deadline is at most now.
+ * A callback may add or cancel timers, including its own.
+ */
+void timer_wheel_run(TimerWheel *wheel, uint64_t now);
+
+/**
+ * @brief Returns the number of ms before the next deadline of the wheel,
+ * to sleep in poll or epoll_wait: -1 if the wheel is empty, 0 if a timer
+ * is already due.
+ */
+int timer_wheel_timeout(TimerWheel *wheel, uint64_t now);
+
+/**
+ * @brief Initializes a timer that is not pending.
+ */
+void timer_init(Timer *timer, void (*callback) (void *data), void *data);
+
+/**
+ * @brief Removes a timer from its wheel, if it is pending.
+ */
+void timer_cancel(Timer *timer);
+
+uint8_t timer_pending(const Timer *timer);
+
+/**
+ * @brief Returns the monotonic clock in ms, the time base of the wheels.
+ */
+uint64_t timer_clock_ms(void);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* TIMER_WHEEL_H */
@@ -7,9 +7,16 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#if defined(__APPLE__)
+#include <limits.h>
+#else
+#include <linux/limits.h>
+#endif
+
 #include "network/network_macros.h"
 
 #include "network/file_transfer.h"
+#include "network/send_window.h"
 
 #include "user/user.h"
 #include "network/request.h"
@@ -35,17 +42,100 @@ typedef struct
 	Notif *notif;
 } Sb;
 
+/*
+ * Un transfert en cours, envoi ou telechargement. Chacun a son id negocie
+ * avec le serveur, sa socket et son delai d'expiration.
+ */
+typedef struct
+{
+	uint16_t id;
+	uint8_t upload;
+	int sfd;
+	SA_IN6 addr;                  /* Serveur UDP d'un envoi */
+
+	FileTransferInfos infos;      /* Telechargement : blocs recus */
+	DgramStats stats;             /* Telechargement : receptions */
+
+	FileMap file;                 /* Envoi : fichier projete */
+	SendWindow window;
+
+	/* Point de reprise, garde si le transfert n'aboutit pas */
+	char checkpoint[PATH_MAX];
+} Transfer;
+
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
 void data_init(void);
 void data_free(void);
 
-uint8_t transfer_new(const char *file_name);
-void set_tranfer_address(int sfd, SA_IN6 *addr);
-int get_transfer_socket(void);
-void reset_transfer_socket(void);
-char *get_tranfer_file_path(void);
-int8_t add_packet(uint16_t numblock, char *data, size_t nbytes);
+/**
+ * @brief Prepares the transfer of a request, before the answer of the
+ * server. A transfer prepared and never started is cancelled.
+ */
+uint8_t transfer_new(const char *file_name, uint16_t feed_number);
+void set_transfer_socket(int sfd);
+void transfer_cancel(void);
+
+/**
+ * @brief Proposes in the request of the prepared transfer the resume token
+ * left by an earlier attempt, with its block size. The resume fields are
+ * cleared if there is none.
+ */
+void transfer_resume_request(ClientRQ_Cl *cl, uint8_t upload);
+
+/**
+ * @brief Starts the prepared download under the transfer id granted by the
+ * server, in blocks of chunk bytes, and hands it to the UDP thread.
+ *
+ * The file is written in a partial file next to its final place. If the
+ * download is interrupted, the blocks received are saved with token and
+ * a later request proposes to resume it.
+ *
+ * @param token Resume token of the file, given by the server.
+ * @param first First block the server sends, after the blocks the
+ *        checkpoint of the download already holds.
+ */
+uint8_t transfer_start_download(uint16_t id, size_t chunk, uint32_t token,
+				uint32_t first);
+
+/**
+ * @brief Starts the prepared upload under the transfer id granted by the
+ * server, in blocks of chunk bytes, and hands it to the UDP thread.
+ *
+ * @param sfd Socket of the upload, owned by the transfer on success.
+ * @param addr UDP address of the server.
+ * @param token Resume token of the upload, kept until it succeeds.
+ * @param first First block missing on the server.
+ * @param held Bitmap of the FT_ACK_BITS blocks from first that the server
+ *        already holds, they are not sent.
+ */
+uint8_t transfer_start_upload(uint16_t id, size_t chunk, int sfd,
+			      SA_IN6 *addr, uint32_t token, uint32_t first,
+			      const uint8_t *held);
+
+/**
+ * @brief Returns the next transfer started since the last call, NULL if
+ * none. The caller owns it and frees it with transfer_close().
+ */
+Transfer *transfer_take(void);
+
+/**
+ * @brief Returns the descriptor that becomes readable when a transfer is
+ * started. transfer_take() empties it.
+ */
+int transfer_wakeup_fd(void);
+
+void transfer_close(Transfer *transfer);
+
+/**
+ * @brief Stores a block of a download and acknowledges it when due.
+ *
+ * @return 0 once the file is written, 1 while the download goes on, -1 on
+ *         error.
+ */
+int8_t add_packet(Transfer *transfer, uint32_t numblock, char *data,
+		  size_t nbytes, SA_IN6 *from);
+int8_t end_transfer(Transfer *transfer, uint32_t count, SA_IN6 *from);
 int subscription_add(const char *addr, uint16_t port, int sfd, uint16_t feed_nb);
 int add_notif(int fd, char *message, char *pseudo);
 size_t get_notification_count(void);
@@ -54,10 +144,6 @@ size_t get_subscribe_count(void);
 Sb *get_sb(size_t i);
 void wait_notif(void);
 uint8_t refresh_fds(Array *fds);
-uint8_t check_transfer_timeout(void);
-int wait_transfer(void);
-void signal_transfer(void);
-void clear_current_transfer(void);
 
 /* -------------------------------------------------------------------------- */
 
@@ -5,15 +5,30 @@
 /* -------------------------------- INCLUDES -------------------------------- */
 
 #include "network/request.h"
+#include "network/datagram.h"
 #include "network/client/client.h"
 
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
-uint8_t send_client_request(Client *client, ClientRQ *clientrq);
-uint8_t send_ftransfer_requests(Client *client, Array *a_ftrq, size_t f_size);
-uint8_t recv_server_request(int sfd, ServerRQ **s_rq);
+uint8_t send_client_request(Client *client, ClientRQ *clientrq, uint8_t framed);
+uint8_t recv_server_request(int sfd, RingBuffer *ring, uint8_t framed,
+			    ServerRQ **s_rq);
 ssize_t recv_notif(int fd, ServerRQ *rq);
-ssize_t recv_datagrams(int sfd, ServerRQ *serverrq);
+
+/**
+ * @brief Receives transfer packets in buf, several of segment bytes if the
+ * kernel coalesced them.
+ */
+ssize_t recv_datagrams(int sfd, char *buf, size_t cap, size_t *segment,
+		       SA_IN6 *from);
+
+/**
+ * @brief Decodes a transfer packet. The data of a block are not copied,
+ * serverrq->ft.data points in the packet.
+ *
+ * @return 0 on success, 1 if the packet is invalid.
+ */
+uint8_t decode_datagram(char *packet, size_t size, ServerRQ *serverrq);
 
 /* -------------------------------------------------------------------------- */
 
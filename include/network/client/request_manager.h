@@ -4,13 +4,19 @@
 /* -------------------------------- INCLUDE --------------------------------- */
 
 #include "network/request.h"
+#include "network/client/data.h"
 
 /* -------------------------------- FUNCTION -------------------------------- */
 
 uint8_t create_request(ClientRQ *clientrq, uint16_t id);
-uint8_t create_ftransfer_requests(Array *a_ftrq, size_t *f_size, uint16_t id);
 
-int8_t handle_download_packet(ServerRQ *serverrq, size_t nbytes);
+/**
+ * @brief Handles a packet of the download 'transfer'.
+ *
+ * @return 0 once the download is complete, 1 while it goes on, -1 on error.
+ */
+int8_t handle_download_packet(Transfer *transfer, ServerRQ *serverrq,
+			      size_t nbytes, SA_IN6 *from);
 
 /* -------------------------------------------------------------------------- */
 
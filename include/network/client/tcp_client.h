@@ -8,7 +8,7 @@
 
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
-uint8_t tcp_client_init(const char *port);
+uint8_t tcp_client_init(const char *port, uint8_t keep_alive);
 void *tcp_client_loop(__attribute__((unused)) void *arg);
 
 /* -------------------------------------------------------------------------- */
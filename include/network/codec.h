@@ -0,0 +1,115 @@
+/**
+ * @file codec.h
+ * @brief Wire encoding of the requests, shared by the client and the server.
+ *
+ * Each message layout is described once in a table of field descriptors.
+ * Messages are encoded straight into a buffer given by the caller and
+ * decoded from a borrowed slice, every access being bounds checked.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network/request.h"
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/* Taille du plus grand message du tableau, CRLF compris */
+#define CODEC_MSG_MAX       512
+
+/* En-tete d'un datagramme de transfert : header puis numero de bloc */
+#define CODEC_FT_HEADER_LEN (sizeof(header_t) + sizeof(uint32_t))
+
+/* -------------------------------- STRUCTURES ------------------------------ */
+
+typedef enum
+{
+	FIELD_U8,
+	FIELD_U16,       /* Ordre reseau sur le fil */
+	FIELD_U32,       /* Ordre reseau sur le fil */
+	FIELD_BYTES,     /* Taille fixe 'len' */
+	FIELD_VARBYTES,  /* Taille lue dans le champ u8 a 'len_offset', <= 'len' */
+} FieldKind;
+
+typedef struct
+{
+	FieldKind kind;
+	size_t offset;
+	size_t len;
+	size_t len_offset;
+} FieldDesc;
+
+typedef struct
+{
+	const char *name;
+	const FieldDesc *fields;
+	size_t nfields;
+} MessageDesc;
+
+typedef enum
+{
+	MSG_CLIENT_RG,   /* ClientRQ_Rg */
+	MSG_CLIENT_CL,   /* ClientRQ_Cl */
+	MSG_CLIENT_FT,   /* ClientRQ_Cl d'UPLOAD et DOWNLOAD, avec chunk */
+	MSG_CLIENT_RS,   /* Idem, suivi de la reprise : jeton, blocs recus */
+	MSG_SERVER_CL,   /* ServerRQ_Cl */
+	MSG_SERVER_FT,   /* ServerRQ_Cl d'UPLOAD/DOWNLOAD, chunk et transfer */
+	MSG_SERVER_RS,   /* Idem, suivi de la reprise : jeton, blocs recus */
+	MSG_SERVER_LP,   /* ServerRQ_Lp */
+	MSG_SERVER_SB,   /* ServerRQ_Sb */
+	MSG_SERVER_NT,   /* ServerRQ_Nt */
+	MSG_FT_HEADER,   /* FTransferRQ, sans les donnees */
+	MSG_FT_ACK,      /* FTransferAck */
+	MSG_FT_FIN,      /* FTransferFin */
+	MSG_KIND_COUNT
+} MessageKind;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Returns the number of bytes of a message once encoded.
+ */
+size_t codec_size(MessageKind kind, const void *msg);
+
+/**
+ * @brief Encodes a message at dst.
+ *
+ * @return The number of bytes written, 0 if cap is too small.
+ */
+size_t codec_encode(MessageKind kind, const void *msg, char *dst, size_t cap);
+
+/**
+ * @brief Decodes a message from the len bytes at src.
+ *
+ * @return The number of bytes read, 0 if the message is truncated or
+ *         one of its lengths is out of bounds.
+ */
+size_t codec_decode(MessageKind kind, const char *src, size_t len, void *msg);
+
+/**
+ * @brief Returns the number of bytes of a message once encoded and framed,
+ * with its length prefix if framed is true, followed by CRLF otherwise.
+ */
+size_t codec_frame_size(MessageKind kind, const void *msg, uint8_t framed);
+
+/**
+ * @brief Encodes a message at dst with the framing of the connection.
+ *
+ * @return The number of bytes written, 0 if cap is too small.
+ */
+size_t codec_encode_frame(MessageKind kind, const void *msg, char *dst,
+			  size_t cap, uint8_t framed);
+
+/**
+ * @brief Reads the header of an encoded message, 0 if len is too short.
+ */
+header_t codec_header(const char *src, size_t len);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* CODEC_H */
@@ -0,0 +1,192 @@
+/**
+ * @file datagram.h
+ * @brief Batched UDP sends and receives, shared by the client and the server.
+ *
+ * Datagrams are grouped in 'mmsghdr' entries and handed to the kernel with
+ * sendmmsg, at most 'dgram_batch()' of them per system call. They are
+ * received the same way with recvmmsg, into preallocated slots.
+ *
+ * With the offload enabled, the blocks of a file leave as super-datagrams
+ * that the kernel cuts in packets of one block (UDP_SEGMENT), and the
+ * receive sockets accept packets coalesced by the kernel (UDP_GRO). If
+ * the kernel or the path refuses the segmentation, the sends fall back to
+ * one datagram per block.
+ */
+
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "network/codec.h"
+#include "network/file_transfer.h"
+#include "network/network_macros.h"
+#include "network/request.h"
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/* Datagrammes par appel a sendmmsg */
+#define DGRAM_BATCH_DEFAULT 64
+
+/* Limite du noyau pour sendmmsg (UIO_MAXIOV) */
+#define DGRAM_BATCH_MAX     1024
+
+/* Taille d'un paquet de transfert portant un bloc de chunk octets */
+#define DGRAM_PACKET_SIZE(chunk) (CODEC_FT_HEADER_LEN + (chunk))
+
+/* En-tetes IPv6 et UDP d'un datagramme sur le reseau */
+#define DGRAM_IP_OVERHEAD   (40 + 8)
+
+/* Plus grand datagramme UDP, un super-datagramme GSO ou GRO compris */
+#define DGRAM_RECV_MAX      65507
+
+/* Segments par super-datagramme acceptes par tous les noyaux */
+#define DGRAM_GSO_SEGMENTS  64
+
+/* -------------------------------- STRUCTURES ------------------------------ */
+
+typedef struct
+{
+	size_t packets;    /* Datagrammes sur le reseau, segments compris */
+	size_t messages;   /* Datagrammes remis au noyau ou recus de lui */
+	size_t syscalls;   /* Appels a sendmmsg ou recvmmsg */
+} DgramStats;
+
+/* Emplacements de reception, reutilises d'un appel a recvmmsg a l'autre */
+typedef struct
+{
+	size_t count;
+	size_t size;               /* Taille d'un emplacement */
+	char *bufs;                /* count * size octets */
+	char *control;             /* Donnees annexes de chaque emplacement */
+	SA_IN6 *addrs;             /* Adresse d'origine de chaque datagramme */
+	size_t *segments;          /* Taille des paquets coalesces par GRO */
+	struct iovec *iov;
+	struct mmsghdr *msgs;
+
+	uint32_t drops;            /* Dernier compteur SO_RXQ_OVFL lu */
+	DgramStats stats;          /* Receptions depuis l'allocation */
+} DgramSlots;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Sets the number of datagrams sent per system call.
+ *
+ * Must be called before the sending threads start, the value is clamped
+ * to [1, DGRAM_BATCH_MAX].
+ */
+void dgram_set_batch(size_t batch);
+
+size_t dgram_batch(void);
+
+/**
+ * @brief Enables (1) or disables (0) the UDP segmentation offload of the
+ * file transfers. Must be called before the threads start.
+ */
+void dgram_set_offload(uint8_t offload);
+
+/**
+ * @brief Lets the kernel coalesce the packets received on sfd (UDP_GRO),
+ * when the offload is enabled. Without kernel support, the packets are
+ * simply received one by one.
+ *
+ * @return 0 on success or if the offload is disabled, 1 otherwise.
+ */
+uint8_t dgram_enable_gro(int sfd);
+
+/**
+ * @brief Returns the average number of packets per system call.
+ */
+double dgram_segments_per_call(const DgramStats *stats);
+
+/**
+ * @brief Sends count prepared messages, dgram_batch() at a time.
+ *
+ * @param stats Updated with the datagrams and calls made, may be NULL.
+ * @return 0 on success, 1 if a send failed.
+ */
+uint8_t dgram_send(int sfd, struct mmsghdr *msgs, size_t count,
+		   DgramStats *stats);
+
+/**
+ * @brief Sends the packets of a mapped file whose indexes are listed in
+ * blocks, in that order.
+ *
+ * The header of each packet is encoded on the stack, its data is pointed
+ * to in the mapping: the payload is only read by the kernel. With the
+ * offload, consecutive full blocks of the list share a super-datagram.
+ *
+ * @param header Header of the packets, the block numbers start at 1.
+ * @param chunk Size of the blocks the file is cut in.
+ * @param stats Updated with the datagrams and calls made, may be NULL.
+ * @return 0 on success, 1 if a send failed.
+ */
+uint8_t dgram_send_blocks(int sfd, SA_IN6 *addr, header_t header,
+			  FileMap *file, size_t chunk, const size_t *blocks,
+			  size_t count, DgramStats *stats);
+
+/**
+ * @brief Sends copies of the acknowledgement of a transfer to addr.
+ *
+ * @return 0 on success, 1 if a send failed.
+ */
+uint8_t dgram_send_ack(int sfd, SA_IN6 *addr, FTransferAck *ack,
+		       uint8_t copies);
+
+/**
+ * @brief Allocates count receive slots of size bytes, DGRAM_RECV_MAX with
+ * the offload to hold the coalesced packets.
+ *
+ * @return 0 on success, 1 if the allocation failed.
+ */
+uint8_t dgram_slots_new(DgramSlots *slots, size_t count, size_t size);
+
+void dgram_slots_free(DgramSlots *slots);
+
+/**
+ * @brief Asks the kernel to report the datagrams dropped because the
+ * receive queue of the socket was full (SO_RXQ_OVFL).
+ */
+uint8_t dgram_enable_drop_count(int sfd);
+
+/**
+ * @brief Waits for at least one datagram and receives as many as are
+ * queued, up to the number of slots.
+ *
+ * @param dropped Set to the datagrams dropped by the kernel since the
+ *        previous call, when the counter is enabled.
+ * @return The number of filled slots, -1 on error.
+ */
+int dgram_recv(int sfd, DgramSlots *slots, uint32_t *dropped);
+
+/**
+ * @brief Returns the datagram received in the slot i, NULL if it was
+ * truncated.
+ *
+ * @param len Set to the length of the datagram.
+ * @param segment Set to the size of the packets coalesced in the slot, the
+ *        last one may be shorter. Equal to len without coalescing.
+ * @param from Set to the address of the sender, may be NULL.
+ */
+char *dgram_slot(DgramSlots *slots, size_t i, size_t *len, size_t *segment,
+		 SA_IN6 **from);
+
+/**
+ * @brief Receives a single datagram, possibly coalesced, without blocking
+ * if sfd does not block.
+ *
+ * @param segment Set as by dgram_slot.
+ * @return The length received, -1 on error.
+ */
+ssize_t dgram_recv_one(int sfd, char *buf, size_t cap, size_t *segment,
+		       SA_IN6 *from);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* DATAGRAM_H */
@@ -5,7 +5,8 @@
 #include <limits.h>
 #include <time.h>
 
-#include "data_structures/array.h"
+#include "data_structures/reassembly.h"
+#include "network/request.h"
 #include "network/request_macros.h"
 #include "network/network_macros.h"
 
@@ -14,32 +15,170 @@
 
 #define FT_TIMEOUT_SEC    5
 
+/* Le receveur refuse les blocs au-dela, l'envoyeur les fichiers plus gros */
+#define FT_FILE_MAX       REASSEMBLY_SIZE_MAX
+
+/* Le receveur acquitte tous les FT_ACK_EVERY paquets de FT_CHUNK_MIN octets */
+#define FT_ACK_EVERY      32
+
+/* L'acquittement final est repete, puis renvoye a chaque FIN en retard */
+#define FT_ACK_REPEAT     3
+
+/* Suffixes du fichier partiel d'un transfert et de son point de reprise */
+#define FT_PARTIAL_EXT    ".part"
+#define FT_CHECKPOINT_EXT ".map"
+
 /* -------------------------------- STRUCTURES ------------------------------ */
 
 typedef struct
 {
 	uint8_t active;               /* Transfer encours */
+	uint16_t owner;               /* Utilisateur qui l'a demande */
+	uint8_t sending;              /* Telechargement confie au moteur */
 	time_t begin;                 /* Heure du debut du transfer */
+	time_t activity;              /* Dernier paquet recu */
 
 	int sfd;
 	SA_IN6 addr;
 
 	char file_path[MAX_DATALEN];
 	uint16_t feed_number;
+	uint32_t token;               /* Jeton de reprise, 0 sans reprise */
+
+	Reassembly blocks;            /* Paquets recus */
+	uint8_t fin;                  /* L'envoyeur a annonce le nombre de blocs */
+	size_t unacked;               /* Paquets recus depuis le dernier ACK */
 
-	Array file_data;              /* Fichier en cours de téléchargement */
-	uint16_t last_packet;         /* Numero du dernier paquet */
-	off_t file_size;
+	/* Ecrit au fil de l'eau dans un fichier partiel, garde en reprise */
+	int fd;
+	char tmp_path[MAX_DATALEN];
 } FileTransferInfos;
 
+/* Fichier a envoyer, projete en memoire et lu directement par le noyau */
+typedef struct
+{
+	char *data;                   /* NULL pour un fichier vide */
+	size_t size;
+} FileMap;
+
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
-FileTransferInfos transfer_init(const char *file_name, uint16_t feed_number);
+/**
+ * @brief Starts a transfer.
+ *
+ * @param chunk Size of the blocks negotiated for this transfer.
+ * @param store 1 to keep the received blocks in memory, 0 if they are
+ *        written to disk as they arrive.
+ */
+FileTransferInfos transfer_init(const char *file_name, uint16_t feed_number,
+				size_t chunk, uint8_t store);
 
 void transfer_clear(FileTransferInfos *infos);
 
+/**
+ * @brief Returns 1 once the sender has announced the number of blocks
+ * and all of them were received.
+ */
+uint8_t transfer_done(FileTransferInfos *infos);
+
+/**
+ * @brief Counts a received datagram and tells how many times the
+ * acknowledgement must be sent back.
+ *
+ * An ACK is due every FT_ACK_EVERY * FT_CHUNK_MIN bytes of blocks, at
+ * least every datagram, and for each FIN, so that the sender learns about
+ * the holes. The final ACK is sent FT_ACK_REPEAT
+ * times, then once for each late FIN while the receiver keeps it.
+ *
+ * @param fin 1 if the datagram is the FIN of the sender.
+ * @return 0 if no ACK is due, the number of copies to send otherwise.
+ */
+uint8_t transfer_ack_due(FileTransferInfos *infos, uint8_t fin);
+
+/**
+ * @brief Fills the acknowledgement of the blocks received so far: the
+ * first missing block and the state of the FT_ACK_BITS following ones.
+ */
+void transfer_ack_new(FileTransferInfos *infos, header_t header,
+		      FTransferAck *ack);
+
 uint8_t file_exist(char *file_name, uint16_t feed_number);
 
+/* --------------------------------------------- */
+
+/**
+ * @brief Returns a new random resume token, never 0.
+ */
+uint32_t transfer_token_new(void);
+
+/**
+ * @brief Returns the resume token of the file at path, derived from its
+ * inode, size and modification time: it changes with the content of the
+ * file, so that a download is not resumed over another version.
+ *
+ * @return The token, 0 if the file cannot be read.
+ */
+uint32_t file_token(const char *path);
+
+/**
+ * @brief Saves the state of the receiver of a transfer at path: its
+ * token, owner, feed, file name, block size and the bitmap of the blocks
+ * already written in the partial file.
+ *
+ * @return 0 on success, 1 if the checkpoint could not be written.
+ */
+uint8_t transfer_checkpoint_save(FileTransferInfos *infos, const char *path);
+
+/**
+ * @brief Keeps the partial file of an interrupted transfer, with its
+ * checkpoint saved at path: transfer_clear() then leaves both on disk.
+ *
+ * @return 0 on success, 1 if there is nothing to keep or the checkpoint
+ *         could not be written.
+ */
+uint8_t transfer_suspend(FileTransferInfos *infos, const char *path);
+
+/**
+ * @brief Restores in infos the checkpoint saved at path. The blocks it
+ * lists are tracked again, the partial file itself is not opened.
+ *
+ * @return 0 on success, 1 if there is no valid checkpoint at path.
+ */
+uint8_t transfer_checkpoint_load(FileTransferInfos *infos, const char *path);
+
+/* --------------------------------------------- */
+
+/**
+ * @brief Sets the largest block size proposed or accepted by this side,
+ * clamped to [FT_CHUNK_MIN, FT_CHUNK_MAX] and rounded down to a multiple
+ * of FT_CHUNK_ALIGN. Must be called before the threads start.
+ */
+void file_set_chunk_max(size_t chunk);
+
+size_t file_chunk_max(void);
+
+/**
+ * @brief Returns the block size retained for a transfer proposed with
+ * chunk by the peer.
+ */
+uint16_t file_chunk_negotiate(uint16_t chunk);
+
+/**
+ * @brief Maps the file at path read only, for a sequential read.
+ *
+ * @return 0 on success, 1 if the file cannot be opened or is larger than
+ *         FT_FILE_MAX.
+ */
+uint8_t file_map(FileMap *map, const char *path);
+
+void file_unmap(FileMap *map);
+
+/**
+ * @brief Returns the number of packets of a file of size bytes cut in
+ * blocks of chunk bytes, the last one being shorter, possibly empty.
+ */
+size_t file_block_count(size_t size, size_t chunk);
+
 /* -------------------------------------------------------------------------- */
 
 #endif /* FILE_TRANSFER_H */
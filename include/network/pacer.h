@@ -0,0 +1,108 @@
+/**
+ * @file pacer.h
+ * @brief Token bucket pacing of the outbound file transfers.
+ *
+ * Each transfer spends tokens, in bytes, that refill at its current rate.
+ * In adaptive mode the rate starts at PACER_RATE_INIT, is halved when the
+ * receiver reports a loss and grows by a fraction of itself with each clean
+ * acknowledgement, so that it probes above its start. It never exceeds the
+ * cap set at startup, if any.
+ */
+
+#ifndef PACER_H
+#define PACER_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/* Debit de depart du mode adaptatif, en Mbit/s, sous le plafond */
+#define PACER_RATE_INIT     1000
+
+/* Limite des options -r, en Mbit/s */
+#define PACER_RATE_MAX      100000
+
+/* Le seau contient PACER_BURST_US de debit, au moins PACER_BURST_MIN paquets */
+#define PACER_BURST_US      2000
+#define PACER_BURST_MIN     8
+
+/* Plancher du mode adaptatif, 1 Mbit/s et au moins PACER_PACKETS_MIN paquets/s */
+#define PACER_RATE_MIN      125000
+#define PACER_PACKETS_MIN   64
+
+/* Hausse a chaque acquittement sans perte : 1/PACER_GROWTH du debit, au
+ * moins PACER_RATE_STEP (1 Mbit/s) */
+#define PACER_GROWTH        16
+#define PACER_RATE_STEP     125000
+
+/* -------------------------------- STRUCTURES ------------------------------ */
+
+typedef struct
+{
+	uint64_t rate;             /* Octets par seconde, 0 sans limite */
+	uint64_t tokens;           /* Octets disponibles */
+	uint64_t burst;            /* Capacite du seau */
+	uint64_t floor;            /* Debit minimal du mode adaptatif */
+	size_t packet;             /* Taille d'un paquet plein */
+	struct timespec refill;    /* Dernier remplissage */
+
+	size_t recover;            /* Numero d'envoi du dernier ralentissement */
+} Pacer;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Caps the rate of every transfer, in Mbit/s, 0 for no cap (the
+ * default). Without adaptation, a transfer is sent at the cap, unpaced if
+ * there is none. Must be called before the sending threads start.
+ */
+void pacer_set_rate(size_t mbps);
+
+/**
+ * @brief Enables (1) or disables (0) the loss based adaptation.
+ */
+void pacer_set_adaptive(uint8_t adaptive);
+
+/**
+ * @brief Starts a pacer at its initial rate, with a full bucket.
+ *
+ * @param packet Size of a full packet, the bucket holds at least
+ *        PACER_BURST_MIN of them.
+ */
+void pacer_init(Pacer *pacer, size_t packet);
+
+/**
+ * @brief Returns how many full packets may leave now.
+ */
+size_t pacer_allow(Pacer *pacer);
+
+/**
+ * @brief Takes the tokens of len bytes sent.
+ */
+void pacer_consume(Pacer *pacer, size_t len);
+
+/**
+ * @brief Returns the number of milliseconds before a full packet may
+ * leave.
+ */
+int pacer_wait(Pacer *pacer);
+
+/**
+ * @brief Reports a loss of a packet sent as number seq, 'sent' packets
+ * being sent so far. The rate is halved once per round trip: only losses
+ * of packets sent after the previous decrease count.
+ */
+void pacer_loss(Pacer *pacer, size_t seq, size_t sent);
+
+/**
+ * @brief Reports an acknowledgement without loss.
+ */
+void pacer_ack(Pacer *pacer);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* PACER_H */
@@ -8,6 +8,8 @@
 #include <limits.h>
 
 #include "data_structures/array.h"
+#include "data_structures/ring_buffer.h"
+#include "data_structures/timer_wheel.h"
 
 #include "network_macros.h"
 #include "request_macros.h"
@@ -23,12 +25,40 @@
 #define SUBSCRIBE           0x04
 #define UPLOAD              0x05
 #define DOWNLOAD            0x06
+#define CONNOPT             0x07
+
+/* Datagrammes de controle d'un transfert, du receveur et de l'envoyeur */
+#define FTACK               0x08
+#define FTFIN               0x09
+
+/* Options de connexion negociees par une requete CONNOPT */
+#define CONNOPT_KEEPALIVE   0x01
+#define CONNOPT_FRAMED      0x02
+
+/*
+ * Apres CONNOPT_FRAMED, chaque message est precede de sa taille (u16, ordre
+ * reseau) au lieu d'etre termine par CRLF, dans les deux sens.
+ */
+#define FRAME_HEADER_LEN    sizeof(uint16_t)
+
+/*
+ * Un acquittement porte le premier bloc manquant puis l'etat des
+ * FT_ACK_BITS blocs suivants : l'envoyeur ne renvoie que les trous.
+ */
+#define FT_ACK_BITS         256
+#define FTACK_COMPLETE      0x01
+
+/* Buffer de reception d'une connexion TCP */
+#define RECV_RING_SIZE      16384
 
 typedef uint8_t             coderq_t;
 typedef uint16_t	    header_t;
-typedef char		    rq_buf_t[BUFSIZ];
 
 #define LOG_REQUEST_FORMAT  "CODERQ:%-12s, USERID:%u, ERROR:%s\n"
+#define LOG_TRANSFER_FORMAT "TRANSFER    , ID:%u, USERID:%u, PACKETS:%zu, " \
+			    "DATAGRAMS:%zu, SENDMMSG:%zu, SEGMENTS/CALL:%.1f\n"
+#define LOG_RECEIVE_FORMAT  "UDP RECEIVE , PACKETS:%zu, DATAGRAMS:%zu, " \
+			    "RECVMMSG:%zu, SEGMENTS/CALL:%.1f\n"
 
 extern char CRLF[3];
 
@@ -37,11 +67,31 @@ extern char CRLF[3];
 typedef struct
 {
 	header_t header;
-	uint16_t numblock;
+	uint32_t numblock;
 
-	char data[FILE_PACKET_SIZE];
+	/* Donnees du bloc, laissees dans le datagramme recu */
+	char *data;
 } FTransferRQ;
 
+/* Receveur -> envoyeur */
+typedef struct
+{
+	header_t header;
+	uint32_t base;       /* Numero du premier bloc manquant */
+	uint32_t last;       /* Nombre total de blocs, 0 tant qu'inconnu */
+	uint8_t flags;
+
+	/* Bit i : bloc 'base + i' recu */
+	uint8_t bitmap[FT_ACK_BITS / 8];
+} FTransferAck;
+
+/* Envoyeur -> receveur : tous les blocs sont partis au moins une fois */
+typedef struct
+{
+	header_t header;
+	uint32_t count;      /* Nombre total de blocs */
+} FTransferFin;
+
 /* ------ Client requests ------ */
 
 typedef struct
@@ -60,6 +110,16 @@ typedef struct
 	/* 0 <= datalen <= MAX_DATALEN = 255 */
 	uint8_t datalen;
 	char data[MAX_DATALEN];
+
+	/* UPLOAD et DOWNLOAD : taille de bloc proposee, apres les donnees */
+	uint16_t chunk;
+
+	/* Reprise : jeton du point de reprise, 0 sans reprise, puis premier
+	 * bloc manquant du receveur (DOWNLOAD) et blocs qu'il a deja parmi
+	 * les FT_ACK_BITS suivants, comme dans un acquittement */
+	uint32_t resume;
+	uint32_t first;
+	uint8_t held[FT_ACK_BITS / 8];
 } ClientRQ_Cl;
 
 typedef struct
@@ -83,6 +143,19 @@ typedef struct
 	header_t header;
 	uint16_t feed_number;
 	uint16_t count;
+
+	/* UPLOAD et DOWNLOAD : taille de bloc retenue */
+	uint16_t chunk;
+
+	/* UPLOAD et DOWNLOAD : id du transfert, porte par ses datagrammes */
+	uint16_t transfer;
+
+	/* UPLOAD et DOWNLOAD : jeton de reprise du transfert, premier bloc
+	 * a envoyer, 1 pour un transfert qui part du debut, et blocs que le
+	 * receveur a deja parmi les FT_ACK_BITS suivants */
+	uint32_t resume;
+	uint32_t first;
+	uint8_t held[FT_ACK_BITS / 8];
 } ServerRQ_Cl;
 
 typedef struct
@@ -96,6 +169,22 @@ typedef struct
 	char data[MAX_DATALEN];
 } ServerRQ_Lp;
 
+/*
+ * Billet de LASTPOSTS cote serveur : createur et auteur par id, donnees
+ * laissees dans le journal du fil. Les pseudos ne sont resolus qu'a
+ * l'encodage du ServerRQ_Lp.
+ */
+typedef struct
+{
+	uint16_t feed_number;
+
+	uint16_t creator;
+	uint16_t author;
+
+	uint8_t datalen;
+	const char *data;
+} ServerRQ_Ref;
+
 typedef struct
 {
 	header_t header;
@@ -122,8 +211,10 @@ typedef struct
 		ServerRQ_Cl cl;   /* Registration, Post and Error */
 		ServerRQ_Sb sb;   /* Subscribe */
 		ServerRQ_Lp lp;   /* LastPosts */
+		ServerRQ_Ref ref; /* LastPosts, avant encodage par le serveur */
 		ServerRQ_Nt nt;   /* Notifications */
 		FTransferRQ ft;   /* File Transfer request */
+		FTransferFin fin; /* File Transfer end */
 	};
 } ServerRQ;
 
@@ -142,38 +233,32 @@ typedef struct
 	size_t nbfeed;
 	size_t last_send_post;
 	Mult mult_infos;
+	Timer flush;      /* Envoi des nouveaux billets du fil */
 } NotificationsInfos;
 
-/**
- * @brief Permet de stocker une requete dans un buffer
- */
-typedef struct
-{
-	rq_buf_t buf;
-	size_t   size;
-} BytesRQ;
-
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
 /* --------- Requests init --------- */
 
-ServerRQ_Lp serverrq_lp_new(uint16_t feed_number, pseudo_t *creator,
-			    pseudo_t *pseudo, uint8_t datalen, char *data);
-
 ServerRQ_Nt serverrq_nt_new(uint16_t hd, uint16_t feed_number,
 			    pseudo_t *pseudo, char *data);
 
 ServerRQ_Cl serverrq_error(void);
 
-Array ftransferrqs_new(header_t header, char *file, off_t file_size);
-
 /* -------------------------------- */
 
 /**
- * @brief Permer de recevoir une requete TCP,
- *        La stocke dans 'bytes_rq' et le reste de la requete dans 'rbytes_rq'
+ * @brief Permet de recevoir une requete TCP dans le buffer de la connexion.
+ *
+ * Le message n'est pas copie : 'msg' pointe dans 'ring' et reste valide
+ * jusqu'au prochain appel. Le decoupage se fait par CRLF, ou par la taille
+ * en tete de trame si 'framed' est vrai.
+ *
+ * @return 0 si une requete complete est disponible, 1 si la socket (non
+ *         bloquante) n'a plus de donnees, -1 en cas d'erreur ou de fermeture.
  */
-uint8_t recv_request(int sfd, BytesRQ *bytes_rq, BytesRQ *rbytes_rq);
+int8_t recv_request(int sfd, RingBuffer *ring, uint8_t framed,
+		    char **msg, size_t *len);
 
 /**
  * @brief Extrait le type de la requete depuis son header
@@ -185,22 +270,14 @@ coderq_t get_rq_type(header_t hd);
  */
 uint16_t get_id(header_t hd);
 
-/**
- * @brief Rajoute un element dans un buffer et mets a jour sa taille
- */
-void appendbuf(rq_buf_t buf, size_t *buf_size, void *elt, size_t elt_size);
-
-/**
- * @brief Extrait un element d'un buffer et mets a jour sa taille
- */
-void extractbuf(char *buf, size_t *buf_size, void *elt, size_t elt_size);
-
 /* --------- Debug --------- */
 
 void debug_clientrq(ClientRQ *clientrq);
 
 void debug_serverrq(ServerRQ *serverrq);
 
+void debug_serverrq_lp(ServerRQ_Lp *rq);
+
 const char* strcoderq(coderq_t rq_type);
 
 /* ------------------------- */
@@ -10,4 +10,9 @@
 #define MAX_DATALEN         UCHAR_MAX  /* 255 */
 #define FILE_PACKET_SIZE    512
 
+/* Taille des blocs d'un transfert, negociee a la demande UPLOAD/DOWNLOAD */
+#define FT_CHUNK_MIN        FILE_PACKET_SIZE
+#define FT_CHUNK_MAX        64512
+#define FT_CHUNK_ALIGN      8
+
 #endif /* REQUEST_MACROS_H */
@@ -0,0 +1,150 @@
+/**
+ * @file send_window.h
+ * @brief Sender side of the reliable file transfers, shared by the client
+ * uploads and the server downloads.
+ *
+ * The blocks of a mapped file are sent in a sliding window of SW_WINDOW
+ * blocks. The receiver acknowledges the first block it misses and the
+ * state of the following ones: only the holes are sent again, and the
+ * blocks it already holds ahead of the window, when it resumed a transfer,
+ * are not sent at all. Once every
+ * block left, a FIN announces their number and the transfer ends when the
+ * receiver acknowledges it as complete. The sends are paced by a token
+ * bucket, slowed down when the receiver reports losses.
+ */
+
+#ifndef SEND_WINDOW_H
+#define SEND_WINDOW_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "network/datagram.h"
+#include "network/file_transfer.h"
+#include "network/pacer.h"
+#include "network/request.h"
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/* La fenetre couvre exactement le bitmap d'un acquittement */
+#define SW_WINDOW     FT_ACK_BITS
+
+/* Sans acquittement pendant SW_RTO_MS, les blocs en vol sont renvoyes */
+#define SW_RTO_MS     200
+
+/* Reprises sans reponse avant d'abandonner, soit FT_TIMEOUT_SEC */
+#define SW_RETRY_MAX  (FT_TIMEOUT_SEC * 1000 / SW_RTO_MS)
+
+/* -------------------------------- STRUCTURES ------------------------------ */
+
+typedef enum
+{
+	SW_UNSENT,         /* Entre dans la fenetre, jamais parti */
+	SW_SENT,           /* Parti, pas encore acquitte */
+	SW_ACKED,          /* Recu par le receveur, ou qu'il avait deja */
+	SW_LOST,           /* A renvoyer */
+} SwState;
+
+typedef struct
+{
+	FileMap *file;
+	size_t chunk;          /* Taille des blocs */
+	header_t header;       /* En-tete des paquets de donnees */
+	header_t fin_header;   /* En-tete du FIN */
+
+	size_t count;          /* Nombre de blocs du fichier */
+	size_t base;           /* Premier bloc non acquitte */
+	size_t next;           /* Premier bloc jamais envoye */
+	size_t lost;           /* Blocs SW_LOST dans la fenetre */
+
+	/* Indexes par bloc % SW_WINDOW, pour les blocs [base, next) et ceux
+	 * de [next, base + SW_WINDOW) que le receveur a deja, SW_ACKED */
+	uint8_t state[SW_WINDOW];
+	size_t seq[SW_WINDOW];   /* Ordre du dernier envoi du bloc */
+	size_t sent;             /* Envois effectues, donne le prochain seq */
+
+	uint8_t fin;           /* FIN a envoyer */
+	uint8_t done;          /* Le receveur a tout recu */
+	size_t retries;        /* Reprises depuis le dernier acquittement */
+	struct timespec last_ack;
+
+	Pacer pacer;
+	DgramStats stats;
+} SendWindow;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Prepares the sending of a mapped file.
+ *
+ * @param chunk Size of the blocks negotiated for the transfer.
+ * @param header Header of the data packets.
+ * @param fin_header Header of the FIN datagram.
+ */
+void send_window_init(SendWindow *w, FileMap *file, size_t chunk,
+		      header_t header, header_t fin_header);
+
+/**
+ * @brief Resumes a transfer at block first, numbered from 1: the receiver
+ * already has the blocks before it, they are considered acknowledged.
+ *
+ * @param held Bitmap of the SW_WINDOW blocks from first, laid out as in an
+ *        acknowledgement: those the receiver already holds are not sent.
+ *        The acknowledgements describe the following ones.
+ */
+void send_window_skip(SendWindow *w, size_t first, const uint8_t *held);
+
+/**
+ * @brief Sends at most quota packets, within the tokens of the pacer: the
+ * lost blocks first, then the new blocks that fit in the window, then the
+ * FIN when it is due.
+ *
+ * @return The number of datagrams sent, -1 if a send failed.
+ */
+int send_window_pump(SendWindow *w, int sfd, SA_IN6 *addr, size_t quota);
+
+/**
+ * @brief Applies an acknowledgement of the receiver.
+ *
+ * The blocks before its base and those set in its bitmap are acknowledged,
+ * even those not sent yet: the receiver of a resumed transfer holds them.
+ * A block still unacknowledged but sent before an acknowledged one is
+ * considered lost.
+ */
+void send_window_ack(SendWindow *w, FTransferAck *ack);
+
+/**
+ * @brief Checks the retransmission timer: after SW_RTO_MS without any
+ * acknowledgement, the blocks in flight and the FIN are sent again.
+ *
+ * @return 1 if the receiver did not answer SW_RETRY_MAX times in a row.
+ */
+uint8_t send_window_timeout(SendWindow *w);
+
+/**
+ * @brief Returns the number of milliseconds before the window has
+ * something to do: the pacer has tokens again or the retransmission timer
+ * expires.
+ */
+int send_window_wait(SendWindow *w);
+
+/**
+ * @brief Returns 1 if the window can send something now, without waiting
+ * for an acknowledgement or for the pacer.
+ */
+uint8_t send_window_ready(SendWindow *w);
+
+/**
+ * @brief Applies the acknowledgements queued on sfd, without blocking.
+ * Datagrams that are not an ACK of this transfer are ignored.
+ *
+ * @return The number of acknowledgements read, -1 on socket error.
+ */
+int send_window_read_acks(SendWindow *w, int sfd);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* SEND_WINDOW_H */
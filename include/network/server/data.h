@@ -3,8 +3,12 @@
 
 /* -------------------------------- INCLUDES -------------------------------- */
 
+#include <pthread.h>
+
 #include "user/user.h"
 
+#include "data_structures/record_log.h"
+
 #include "network/network_macros.h"
 #include "network/file_transfer.h"
 #include "network/request.h"
@@ -12,22 +16,39 @@
 #define USER_MAX     2047
 #define FEED_NB_MAX  65536
 
+/* Journal des utilisateurs, fils et billets, rejoue au demarrage */
+#define DATA_WAL_PATH "res/server/data.wal"
+
 /* -------------------------------- STRUCTURES ------------------------------ */
 
+/**
+ * @brief A post as stored in the log of its feed: only its 'datalen'
+ * bytes of data follow the header. The author is kept by id, its pseudo
+ * is read in the users table when the post is sent.
+ */
 typedef struct
 {
-	pseudo_t pseudo;
+	uint16_t author;
 
 	uint8_t datalen;
-	char data[MAX_DATALEN];
+	char data[];
 } Post;
 
+/* Copie d'un telechargement prise par le moteur d'envoi */
 typedef struct
 {
-	Array posts;
-	pseudo_t creator;
+	uint16_t owner;
+	size_t chunk;
+	char file_path[MAX_DATALEN];
+} OutboundInfos;
+
+typedef struct
+{
+	RecordLog posts;         /* Post, de taille variable */
+	uint16_t creator;        /* Id du createur */
 
 	NotificationsInfos *notif;
+	pthread_rwlock_t lock;   /* Protege posts et notif */
 } Feed;
 
 /* -------------------------------- FUNCTIONS ------------------------------- */
@@ -35,40 +56,39 @@ typedef struct
 /**
  * @brief Initializes the data arrays for the chat server.
  *
- * This function initializes the global arrays known_users and feeds and
- * registers the data_free() function to be called on exit.
+ * This function initializes the users and feeds tables, restores them
+ * from the journal DATA_WAL_PATH and registers the data_free() function
+ * to be called on exit.
  */
 void data_init(void);
 
 /**
  * @brief Frees the data arrays for the chat server.
  *
- * This function frees the memory allocated for the global 
- * arrays known_users and feeds and their contents.
+ * This function writes what is left in the journal and frees the memory
+ * allocated for the global tables of users and feeds and their contents.
  */
 void data_free(void);
 
 /* --------------------------------------------- */
 
 /**
- * @brief Creates a new user with the specified ID and pseudo.
+ * @brief Creates a new user with a fresh random ID and the given pseudo.
  *
- * This function creates a new user with the specified ID and pseudo,
- * initializes its arrays and adds it to the known_users array.
+ * The ID is drawn from the free IDs and the user stored in its slot under
+ * the users lock, so concurrent registrations never share an ID. The user
+ * is added to the journal before it becomes visible.
  *
- * @param id The ID of the user
  * @param pseudo The pseudo of the user
- * @return 0 if success, or 1 if the append failed.
+ * @return The ID of the new user, or 0 if no user could be added.
  */
-int user_new(uint16_t id, pseudo_t pseudo);
-
-uint16_t generate_new_id(void);
+uint16_t user_new(pseudo_t pseudo);
 
 /**
  * @brief Gets the pseudo of a user with the specified ID.
  *
- * This function searches the known_users array for a user with 
- * the specified ID and returns their pseudo.
+ * The users are indexed by ID and never removed: the lookup takes no lock
+ * and the pseudo returned stays valid.
  *
  * @param id The ID of the user.
  * @return The pseudo of the user, or NULL if the user was not found.
@@ -76,10 +96,15 @@ uint16_t generate_new_id(void);
 pseudo_t *get_pseudo(uint16_t id);
 
 /**
- * @brief Returns the number of registered users.
- *
- * This function returns the number of registered users,
- * i.e. the length of the global array known_users.
+ * @brief Returns the pseudo of the author or creator of a post, as
+ * get_pseudo(), but never NULL: a placeholder stands for an id without
+ * user, whose record the log did not replay, so that its posts are still
+ * sent.
+ */
+pseudo_t *get_author(uint16_t id);
+
+/**
+ * @brief Returns the number of registered users, without taking a lock.
  *
  * @return The number of registered users.
  */
@@ -91,15 +116,16 @@ size_t get_nb_user(void);
  * @brief Creates a new post in a specified feed with 
  * 	  the given data and author.
  *
- * The post is then appended to the feed's posts array.
+ * The post is appended to the log of the feed, in a record that takes
+ * only the size of its data, after it is added to the journal.
  *
- * @param pseudo The author's pseudo.
+ * @param author The id of the author.
  * @param datalen The length of the data content.
  * @param data A pointer to the data content.
  * @param feed_number Number of the feed to which the post will be added.
- * @return 0 if success, or 1 if the append to the feed's posts array failed.
+ * @return 0 if success, or 1 if the append to the feed's log failed.
  */
-int post_new(pseudo_t pseudo, uint8_t datalen,
+int post_new(uint16_t author, uint8_t datalen,
 	     char *data, size_t feed_number);
 
 /* --------------------------------------------- */
@@ -108,22 +134,35 @@ int post_new(pseudo_t pseudo, uint8_t datalen,
  * @brief Creates a new feed with the given creator.
  *
  * This function creates a new feed with the given creator, initializes its
- * arrays for posts and subscribers, and adds it to the global array of feed.
+ * log of posts, adds it to the journal, then to the global table of feeds.
  *
- * @param creator The pseudo of the user who created the feed.
+ * @param creator The id of the user who created the feed.
+ * @param feed_number Set to the number of the new feed.
  * @return 0 if successful, or 1 if the feed could not be created.
  */
-uint8_t feed_new(pseudo_t creator);
+uint8_t feed_new(uint16_t creator, uint16_t *feed_number);
+
+/**
+ * @brief Takes / releases the read lock of a feed.
+ *
+ * The lock must be held while the posts of the feed are read, since a
+ * concurrent append may grow the index of its log. Other feeds are not
+ * locked.
+ */
+void feed_rdlock(Feed *feed);
+void feed_unlock(Feed *feed);
 
 /**
  * @brief Gets a pointer to a Feed struct corresponding to
- * 	  a specified feed number.
+ * 	  a specified feed index (feed number - 1).
  *
- * @param feed_number The number of the feed to get.
- * @return A pointer to the feed struct, or NULL if the feed number 
+ * No lock is needed: a feed never moves once created.
+ *
+ * @param feed_index The index of the feed to get.
+ * @return A pointer to the feed struct, or NULL if the feed index
  * 	   is out of bounds.
  */
-Feed *get_feeds(size_t feed_number);
+Feed *get_feeds(size_t feed_index);
 
 /**
  * @brief Returns the number of feeds in the server.
@@ -137,26 +176,86 @@ size_t get_feeds_count(void);
 
 /* --------------------------------------------- */
 
-uint8_t notif_new(size_t nbfeed, char *addr, uint16_t port,
-		  int fd, SA_IN6 sock_addr);
-
-NotificationsInfos *get_notif_info(size_t feed_number);
+/**
+ * @brief Attaches a multicast group to a feed, unless one already exists.
+ *
+ * The port of the group is assigned here. If another subscription won the
+ * race, the socket of 'mult' is closed and the existing group is kept.
+ *
+ * @return 0 if the feed has a group, 1 on allocation failure.
+ */
+uint8_t notif_new(size_t feed_number, Mult *mult);
 
-NotificationsInfos *get_feed_notif_info(uint16_t nbfeed);
+NotificationsInfos *get_notif_info(size_t index);
 
 size_t get_subscribe_count(void);
 
 /* --------------------------------------------- */
 
-uint8_t transfer_new(uint16_t id, uint16_t feed_number, const char *file_name);
+/**
+ * @brief Starts a transfer requested by the user owner, in blocks of chunk
+ * bytes, under a new transfer id.
+ *
+ * A user may run several transfers at once, each one has its own id,
+ * carried by its datagrams.
+ *
+ * @return The id of the transfer, or 0 if no id is available.
+ */
+uint16_t transfer_new(uint16_t owner, uint16_t feed_number,
+		      const char *file_name, size_t chunk);
 
-uint8_t add_packet(uint16_t id, uint16_t numblock, char *data, size_t nbytes);
+/**
+ * @brief Resumes an upload interrupted under the resume token *token.
+ *
+ * The partial file and the blocks it holds are taken back if the saved
+ * upload has the same owner, feed, file name and block size, otherwise
+ * the upload starts over.
+ *
+ * @param token The token proposed by the client, 0 for none. Set to the
+ *        token of the upload, for a later resume.
+ * @param first Set to the first block missing, numbered from 1.
+ * @param held Set to the bitmap of the FT_ACK_BITS blocks from first that
+ *        the partial file already holds, as in an acknowledgement.
+ * @return 0 on success, 1 if the transfer does not exist.
+ */
+uint8_t transfer_resume(uint16_t transfer, uint32_t *token, uint32_t *first,
+			uint8_t *held);
 
-void id_clear_transfer(uint16_t id);
+/**
+ * @brief Hands a download over to the sending engine.
+ *
+ * The transfer id stays reserved, and out of the timeouts, until the
+ * engine releases it with id_clear_transfer().
+ *
+ * @param outbound Filled with what the engine needs to send the file.
+ * @return 0 on success, 1 if the transfer does not exist.
+ */
+uint8_t transfer_send(uint16_t transfer, OutboundInfos *outbound);
+
+/**
+ * @brief Writes a block of an upload.
+ *
+ * The post of a completed upload is journaled by the calling thread: its
+ * acknowledgement waits for wal_committed(wal_last()). A late packet of
+ * an upload published less than FT_TIMEOUT_SEC ago gets that final
+ * acknowledgement again, once.
+ *
+ * @param ack Filled with the acknowledgement to send back, if one is due.
+ * @return The number of copies of ack to send, 0 if none.
+ */
+uint8_t add_packet(uint16_t transfer, uint32_t numblock, char *data,
+		   size_t nbytes, FTransferAck *ack);
 
-char *get_tranfer_file_path(uint16_t id);
+/**
+ * @brief Handles the FIN of an upload, which announces its number of
+ * blocks. The file is published once all of them are received, as by
+ * add_packet().
+ *
+ * @return The number of copies of ack to send, 0 if none.
+ */
+uint8_t end_transfer(uint16_t transfer, uint32_t count, FTransferAck *ack);
 
-void check_transfers_timeout(void);
+void id_clear_transfer(uint16_t transfer);
 
 /* -------------------------------------------------------------------------- */
 
@@ -5,6 +5,8 @@
 
 #include "network/request.h"
 #include "data_structures/array.h"
+#include "network/datagram.h"
+#include "network/server/output_queue.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,23 +19,27 @@
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
 /**
- * @brief Sends a server request.
+ * @brief Encodes a server response in the output queue of a connection.
  *
- * This function sends a server request to the specified socket.
- * The request is specified by the given ServerRQ structure and rq_type.
+ * Nothing is written on the socket, the reactor flushes the queue when
+ * the socket is writable. A LASTPOSTS response is queued with all its posts.
  *
- * @param sockfd The socket to send the request to.
- * @param serverrq The ServerRQ structure specifying the request to send.
- * @return 0 if the request is sent successfully, 1 otherwise.
+ * @param out The output queue of the connection.
+ * @param serverrq The response to encode.
+ * @param framed Whether the connection negotiated length-prefixed frames.
+ * @return 0 if the response is queued, 1 otherwise.
  */
-uint8_t send_server_request(int sfd, ServerRQ *serverrq);
+uint8_t write_server_request(OutputQueue *out, ServerRQ *serverrq,
+			     uint8_t framed);
 
-uint8_t recv_client_request(int sfd, ClientRQ *clientrq, BytesRQ *rb_rq);
-
-ssize_t recv_datagrams(int sfd, ClientRQ *clientrq);
-
-uint8_t send_ftransfer_requests(int sfd, SA_IN6 *addr,
-				Array *a_ftrq, size_t f_size);
+/**
+ * @brief Receives the next client request available on a connection.
+ *
+ * @return 0 if a request was decoded, 1 if more data is needed,
+ *         -1 if the connection failed or was closed by the peer.
+ */
+int8_t recv_client_request(int sfd, ClientRQ *clientrq, RingBuffer *ring,
+			   uint8_t framed);
 
 uint8_t send_notif(int sfd, ServerRQ *serverrq, int nb_rq, SA_IN6 *sock_addr);
 
@@ -1,9 +1,20 @@
 #ifndef NOTIFICATIONS_SERVER_H
 #define NOTIFICATIONS_SERVER_H
 
+/* --------------------------------- DEFINE --------------------------------- */
+
+/* Les billets d'un fil sont envoyes au plus tard NOTIF_FLUSH_SEC apres */
+#define NOTIF_FLUSH_SEC 120
+
 /* -------------------------------- FUNCTION -------------------------------- */
 
-void *notifications_loop(void *args);
+/**
+ * @brief Sends the posts of a subscribed feed that were not notified yet
+ * to its multicast group. Callback of the 'flush' timer of the feed.
+ *
+ * @param args The NotificationsInfos of the feed.
+ */
+void notifications_flush(void *args);
 
 /* -------------------------------------------------------------------------- */
 
@@ -0,0 +1,108 @@
+/**
+ * @file output_queue.h
+ * @brief Prototypes of the per-connection output buffer chain.
+ */
+
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+#define OUTPUT_BLOCK_SIZE   16384
+
+/* Au dela, on arrete de lire les requetes du client */
+#define OUTPUT_HIGH_WATER   (256 * 1024)
+/* En dessous, on recommence a les lire */
+#define OUTPUT_LOW_WATER    (64 * 1024)
+
+/* MSG_ZEROCOPY ne vaut le coup que pour les gros envois */
+#define OUTPUT_ZEROCOPY_MIN (64 * 1024)
+/* Envois MSG_ZEROCOPY sans notification au plus, au dela on copie */
+#define OUTPUT_ZEROCOPY_MAX 64
+
+/* -------------------------------- STRUCTURES ------------------------------ */
+
+/**
+ * @brief A block of the chain, the bytes in [start, end) are not sent yet.
+ *
+ * A block given to a MSG_ZEROCOPY send stays allocated, and is never
+ * rewritten, until the kernel reports the send numbered zc_seq completed.
+ */
+typedef struct out_block
+{
+	struct out_block *next;
+
+	size_t capacity;
+	size_t start;
+	size_t end;
+
+	uint8_t zc_pending;
+	uint32_t zc_seq;
+
+	char data[];
+} OutBlock;
+
+/**
+ * @brief Bytes waiting to be written on a non-blocking socket.
+ *
+ * Responses are encoded straight into the blocks of the chain and the whole
+ * chain is written with as few vectored syscalls as possible.
+ */
+typedef struct output_queue
+{
+	OutBlock *head;
+	OutBlock *tail;
+	size_t pending;
+
+	/* Blocs envoyes en attente de leur notification MSG_ZEROCOPY */
+	OutBlock *zc_head;
+	OutBlock *zc_tail;
+	uint8_t zerocopy;
+	uint32_t zc_next;       /* Numero du prochain envoi MSG_ZEROCOPY */
+	uint32_t zc_completed;  /* Les envois d'avant sont tous termines */
+	uint64_t zc_ahead;      /* Bit i : envoi zc_completed + i termine */
+
+	char * (*reserve) (struct output_queue *queue, size_t len);
+	void (*commit) (struct output_queue *queue, size_t len);
+	int (*append) (struct output_queue *queue, const void *data, size_t len);
+	int8_t (*flush) (struct output_queue *queue, int sfd);
+	int8_t (*complete) (struct output_queue *queue, int sfd);
+} OutputQueue;
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes an empty output queue.
+ */
+OutputQueue output_queue_init(void);
+
+/**
+ * @brief Enables MSG_ZEROCOPY for the large flushes of a queue.
+ *
+ * @return 0 if the socket supports it, 1 otherwise (the queue keeps copying).
+ */
+uint8_t output_queue_zerocopy(OutputQueue *queue, int sfd);
+
+/**
+ * @brief Tells whether the kernel may still read blocks of the queue given
+ * to MSG_ZEROCOPY sends, until complete() reports them. This includes a
+ * block partly sent, still at the head of the chain.
+ */
+uint8_t output_queue_busy(const OutputQueue *queue);
+
+/**
+ * @brief Frees every block of an output queue, sent or not.
+ *
+ * The blocks of a MSG_ZEROCOPY send must no longer be in use: the queue is
+ * not busy, or its socket was reset, which drops what it had to send.
+ */
+void output_queue_free(OutputQueue *queue);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* OUTPUT_QUEUE_H */
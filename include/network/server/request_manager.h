@@ -20,15 +20,13 @@
 uint8_t handle_tcp_request(Array *a_serverrq, ClientRQ *clientrq);
 
 /**
- * @brief Gère les paquets udp reçu
+ * @brief Gère un paquet udp reçu, lu directement dans son emplacement
+ * de réception
+ *
+ * @param ack Rempli avec l'acquittement a renvoyer s'il est du.
+ * @return Le nombre de copies de ack a envoyer, 0 si aucune.
  */
-uint8_t handle_upload_packet(ClientRQ *clientrq, size_t nbytes);
-
-/**
- * @brief Creer l'ensemble des paquets udp pour l'envoie d'un fichier,
- * 	  Stocket dans le tableau 'a_ftrq'
- */
-uint8_t create_ftransfer_requests(Array *a_ftrq, size_t *f_size, uint16_t id);
+uint8_t handle_upload_packet(char *packet, size_t len, FTransferAck *ack);
 
 /* -------------------------------------------------------------------------- */
 
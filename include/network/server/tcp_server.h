@@ -5,9 +5,26 @@
 
 /* -------------------------------- FUNCTIONS ------------------------------- */
 
-uint8_t tcp_server_init(in_port_t port);
+#define TCP_REACTOR_MAX  64
 
-void *tcp_server_loop(__attribute__((unused)) void *args);
+/* Une connexion restee muette aussi longtemps est fermee */
+#define CONN_IDLE_SEC    60
+
+/**
+ * @brief Creates 'reactor_count' reactors, each with its own listening
+ * 	  socket bound to 'port' with SO_REUSEPORT and its own epoll set.
+ */
+uint8_t tcp_server_init(in_port_t port, uint8_t reactor_count);
+
+/**
+ * @brief Returns the reactor to pass to tcp_server_loop, or NULL.
+ */
+void *tcp_server_reactor(uint8_t index);
+
+/**
+ * @brief Event loop of one reactor, 'args' comes from tcp_server_reactor.
+ */
+void *tcp_server_loop(void *args);
 
 /* -------------------------------------------------------------------------- */
 
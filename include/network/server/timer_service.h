@@ -0,0 +1,45 @@
+#ifndef TIMER_SERVICE_H
+#define TIMER_SERVICE_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stdint.h>
+
+#include "data_structures/timer_wheel.h"
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes the timer wheel shared by the server threads.
+ *
+ * Its earliest deadline arms a timerfd, watched by the first TCP reactor
+ * which then calls timer_service_run().
+ *
+ * @return 0 on success, 1 if the timerfd could not be created.
+ */
+uint8_t timer_service_init(void);
+
+int timer_service_fd(void);
+
+/**
+ * @brief (Re)schedules a timer delay ms from now, from any thread.
+ */
+void timer_service_mod(Timer *timer, uint64_t delay);
+
+/**
+ * @brief Schedules a timer delay ms from now, unless it is already
+ * pending: its deadline is kept.
+ */
+void timer_service_add(Timer *timer, uint64_t delay);
+
+void timer_service_cancel(Timer *timer);
+
+/**
+ * @brief Runs the callbacks of the expired timers, without the lock of
+ * the service: they may take other locks and schedule timers.
+ */
+void timer_service_run(void);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* TIMER_SERVICE_H */
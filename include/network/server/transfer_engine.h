@@ -0,0 +1,58 @@
+#ifndef TRANSFER_ENGINE_H
+#define TRANSFER_ENGINE_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stdint.h>
+
+#include "network/network_macros.h"
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/* Threads dedies a l'envoi des fichiers */
+#define TRANSFER_WORKERS      2
+
+/* Telechargements envoyes en meme temps, les suivants attendent leur tour */
+#define TRANSFER_ACTIVE_MAX   32
+
+/* Paquets envoyes par un transfert avant de laisser passer le suivant */
+#define TRANSFER_QUANTUM      64
+
+/* Attente d'un worker quand tous les transferts attendent un acquittement */
+#define TRANSFER_IDLE_MS      10
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Initializes the run queues of the download engine.
+ */
+uint8_t transfer_engine_init(void);
+
+/**
+ * @brief Hands the download prepared under the transfer 'id' to the
+ * engine.
+ *
+ * Only the file path and the destination are taken here, the file is read
+ * and sent by the engine workers. The transfer id is released once the
+ * download ends.
+ *
+ * @param addr The UDP address of the client.
+ * @param first First block to send, numbered from 1: a resumed download
+ *        skips the blocks the client already has.
+ * @param held Bitmap of the FT_ACK_BITS blocks from first that the client
+ *        already has, they are not sent either.
+ * @return 0 on success, 1 if the transfer could not be queued.
+ */
+uint8_t transfer_engine_submit(uint16_t id, SA_IN6 *addr, uint32_t first,
+			       const uint8_t *held);
+
+/**
+ * @brief Worker loop: sends the active downloads in round robin,
+ * TRANSFER_QUANTUM packets at a time, and retransmits the blocks the
+ * clients report missing.
+ */
+void *transfer_engine_loop(void *args);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* TRANSFER_ENGINE_H */
@@ -0,0 +1,96 @@
+#ifndef WAL_H
+#define WAL_H
+
+/* -------------------------------- INCLUDES -------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --------------------------------- DEFINES -------------------------------- */
+
+/*
+ * Durabilite des ecritures du journal :
+ * WAL_NONE  ecrit sans fdatasync, un arret du systeme peut tout perdre ;
+ * WAL_BATCH un fdatasync au plus toutes les WAL_BATCH_MS, les reponses
+ *           n'attendent pas ;
+ * WAL_SYNC  une reponse ne part qu'une fois ses ecritures sur le disque,
+ *           les requetes en attente partagent le meme fdatasync.
+ */
+#define WAL_NONE      0
+#define WAL_BATCH     1
+#define WAL_SYNC      2
+
+#define WAL_BATCH_MS  10
+
+/* Plus grand enregistrement, en-tete compris */
+#define WAL_RECORD_MAX 1024
+
+/* -------------------------------- FUNCTIONS ------------------------------- */
+
+/**
+ * @brief Replays the log at 'path', then opens it for appending.
+ *
+ * 'apply' is called for each complete record, in order. The log is cut
+ * after the last valid record: a record torn by a crash is dropped.
+ *
+ * @return 0 on success, 1 if the log could not be read or opened.
+ */
+uint8_t wal_open(const char *path,
+		 void (*apply) (uint8_t type, const char *data, size_t len));
+
+/**
+ * @brief Writes what is left in the log and closes it.
+ */
+void wal_close(void);
+
+/**
+ * @brief Sets the durability mode, WAL_BATCH by default.
+ */
+void wal_set_mode(uint8_t mode);
+
+/**
+ * @brief Appends a record to the log, from any thread.
+ *
+ * The record is only copied in memory, the log thread writes it later.
+ * Records are written in the order of the calls: callers append under the
+ * lock that orders the change they describe. Once a write of the log has
+ * failed, every append is refused.
+ *
+ * @return The position of the end of the record, 0 on failure.
+ */
+uint64_t wal_append(uint8_t type, const void *data, size_t len);
+
+/**
+ * @brief Returns the end of the last record appended by the calling
+ * thread.
+ */
+uint64_t wal_last(void);
+
+/**
+ * @brief Tells whether a reply that depends on the records up to 'lsn' may
+ * be sent.
+ *
+ * @return 1 if they are written, or not yet but the mode is not WAL_SYNC,
+ * 0 if the reply must wait, -1 if they were lost by a failed write and
+ * the reply must be dropped.
+ */
+int8_t wal_committed(uint64_t lsn);
+
+/**
+ * @brief Registers an eventfd written after each write of the log in
+ * WAL_SYNC mode, so that a reactor or the UDP server sends the replies
+ * that were waiting.
+ *
+ * @return 0 on success, 1 if too many are registered.
+ */
+uint8_t wal_watch(int efd);
+
+/**
+ * @brief Log thread: writes the appended records and syncs them according
+ * to the durability mode.
+ */
+void *wal_loop(void *args);
+
+/* -------------------------------------------------------------------------- */
+
+#endif /* WAL_H */
@@ -15,7 +15,8 @@
 #define ERR_FEEDMAX	0x1E	   /* No more feed number available */
 #define ERR_IDMAX	0x1F	   /* No more ID available */
 
-extern uint16_t d_errno;
+/* Propre a chaque thread, plusieurs threads traitent des requetes */
+extern _Thread_local uint16_t d_errno;
 
 #define BLUE   "\001\033[1;34m\002"
 #define PURPLE "\001\033[1;35m\002"
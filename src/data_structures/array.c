@@ -73,16 +73,30 @@ static void *get(Array *array, size_t i)
 	return &((char *) array->data)[array->data_size * i];
 }
 
+/**
+ * @brief Sets the element at index i of a dynamic array.
+ *
+ * If i is past the capacity, the capacity is doubled until it fits so
+ * that filling an array out of order costs a logarithmic number of
+ * reallocations. The new slots are zeroed.
+ *
+ * @return 0 on success, 1 on failure.
+ */
 static int set(Array *array, size_t i, void *element)
 {
 	if (i >= array->capacity) {
-		array->capacity = i + 1;
-		array->length = i + 1;
+		size_t capacity = array->capacity;
+		while (capacity <= i)
+			capacity *= 2;
 
-		size_t new_size = array->capacity * array->data_size;
+		size_t old_size = array->capacity * array->data_size;
+		size_t new_size = capacity * array->data_size;
 		array->data = srealloc(array->data, new_size);
 		if (array->data == NULL)
 			return 1;
+
+		memset((char *) array->data + old_size, 0, new_size - old_size);
+		array->capacity = capacity;
 	}
 
 	char *dst = &((char *) array->data)[array->data_size * i];
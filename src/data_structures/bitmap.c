@@ -0,0 +1,92 @@
+/**
+ * @file bitmap.c
+ * @brief Implementation of a growable bitmap data structure.
+ */
+
+#include "data_structures/bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define WORD_BITS 64
+#define INIT_CAP  512
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static uint8_t grow(Bitmap *bitmap, size_t i)
+{
+	if (i >= BITMAP_BITS_MAX)
+		return 1;
+
+	size_t capacity = bitmap->capacity;
+	while (capacity <= i)
+		capacity *= 2;
+
+	size_t old_words = bitmap->capacity / WORD_BITS;
+	size_t new_words = capacity / WORD_BITS;
+
+	uint64_t *words = realloc(bitmap->words, new_words * sizeof(*words));
+	if (words == NULL)
+		return 1;
+
+	memset(words + old_words, 0, (new_words - old_words) * sizeof(*words));
+	bitmap->words = words;
+	bitmap->capacity = capacity;
+
+	return 0;
+}
+
+static int set(Bitmap *bitmap, size_t i)
+{
+	if (i >= bitmap->capacity && grow(bitmap, i))
+		return -1;
+
+	uint64_t mask = (uint64_t) 1 << (i % WORD_BITS);
+	uint64_t *word = &bitmap->words[i / WORD_BITS];
+	if (*word & mask)
+		return 0;
+
+	*word |= mask;
+	bitmap->count++;
+
+	return 1;
+}
+
+static uint8_t test(Bitmap *bitmap, size_t i)
+{
+	if (i >= bitmap->capacity)
+		return 0;
+
+	return (bitmap->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t bitmap_new(Bitmap *bitmap, size_t capacity)
+{
+	if (capacity < INIT_CAP)
+		capacity = INIT_CAP;
+	capacity = (capacity + WORD_BITS - 1) / WORD_BITS * WORD_BITS;
+
+	bitmap->words = calloc(capacity / WORD_BITS, sizeof(*bitmap->words));
+	if (bitmap->words == NULL)
+		return 1;
+
+	bitmap->capacity = capacity;
+	bitmap->count = 0;
+
+	bitmap->set = set;
+	bitmap->test = test;
+
+	return 0;
+}
+
+void bitmap_free(Bitmap *bitmap)
+{
+	free(bitmap->words);
+	bitmap->words = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
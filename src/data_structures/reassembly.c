@@ -0,0 +1,154 @@
+/**
+ * @file reassembly.c
+ * @brief Implementation of a block reassembly buffer data structure.
+ */
+
+#include "data_structures/reassembly.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define INIT_PAGES 8
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* Agrandit la table des pages, les pages elles-memes ne bougent pas */
+static uint8_t grow_pages(Reassembly *r, size_t page)
+{
+	size_t npages = r->npages ? r->npages : INIT_PAGES;
+	while (npages <= page)
+		npages *= 2;
+
+	char **pages = realloc(r->pages, npages * sizeof(*pages));
+	if (pages == NULL)
+		return 1;
+
+	memset(pages + r->npages, 0, (npages - r->npages) * sizeof(*pages));
+	r->pages = pages;
+	r->npages = npages;
+
+	return 0;
+}
+
+static char *block_slot(Reassembly *r, size_t i)
+{
+	size_t page = i / REASSEMBLY_PAGE_BLOCKS;
+	if (page >= r->npages && grow_pages(r, page))
+		return NULL;
+
+	if (r->pages[page] == NULL) {
+		r->pages[page] = malloc(REASSEMBLY_PAGE_BLOCKS * r->block_size);
+		if (r->pages[page] == NULL)
+			return NULL;
+	}
+
+	return r->pages[page] + (i % REASSEMBLY_PAGE_BLOCKS) * r->block_size;
+}
+
+static int insert(Reassembly *r, size_t i, const char *data, size_t len,
+		  uint8_t is_last)
+{
+	/* Seul le dernier bloc est court, et aucun bloc ne le suit */
+	if (i >= r->limit || len > r->block_size ||
+	    (len < r->block_size && !is_last))
+		return 0;
+	if (r->last != 0 && (i >= r->last || (is_last && i + 1 != r->last)))
+		return 0;
+	if (is_last && i + 1 < r->highest)
+		return 0;
+
+	if (r->received.test(&r->received, i))
+		return 0;
+
+	if (r->store) {
+		char *dst = block_slot(r, i);
+		if (dst == NULL)
+			return -1;
+
+		memcpy(dst, data, len);
+	}
+
+	if (r->received.set(&r->received, i) < 0)
+		return -1;
+
+	if (i + 1 > r->highest)
+		r->highest = i + 1;
+
+	while (r->received.test(&r->received, r->contiguous))
+		r->contiguous++;
+
+	if (is_last) {
+		r->last = i + 1;
+		r->size = i * r->block_size + len;
+	}
+
+	return 1;
+}
+
+static uint8_t expect(Reassembly *r, size_t count)
+{
+	if (count == 0 || count > r->limit || count < r->highest ||
+	    (r->last != 0 && r->last != count))
+		return 1;
+
+	r->last = count;
+	return 0;
+}
+
+static size_t missing(Reassembly *r)
+{
+	size_t total = r->last ? r->last : r->highest;
+	return total - r->received.count;
+}
+
+static uint8_t complete(Reassembly *r)
+{
+	return r->last != 0 && r->received.count == r->last;
+}
+
+static char *block(Reassembly *r, size_t i)
+{
+	if (!r->store || !r->received.test(&r->received, i))
+		return NULL;
+
+	return r->pages[i / REASSEMBLY_PAGE_BLOCKS] +
+	       (i % REASSEMBLY_PAGE_BLOCKS) * r->block_size;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t reassembly_new(Reassembly *r, size_t block_size, uint8_t store)
+{
+	memset(r, 0, sizeof(*r));
+
+	if (bitmap_new(&r->received, 0))
+		return 1;
+
+	r->block_size = block_size;
+	r->store = store;
+	r->limit = REASSEMBLY_SIZE_MAX / block_size + 1;
+
+	r->insert = insert;
+	r->expect = expect;
+	r->missing = missing;
+	r->complete = complete;
+	r->block = block;
+
+	return 0;
+}
+
+void reassembly_free(Reassembly *r)
+{
+	for (size_t i = 0; i < r->npages; i++)
+		free(r->pages[i]);
+
+	free(r->pages);
+	r->pages = NULL;
+	r->npages = 0;
+
+	bitmap_free(&r->received);
+}
+
+/* -------------------------------------------------------------------------- */
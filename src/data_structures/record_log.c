@@ -0,0 +1,155 @@
+/**
+ * @file record_log.c
+ * @brief Implementation of an append-only log of variable-length records.
+ */
+
+#include "data_structures/record_log.h"
+
+#include <stdlib.h>
+
+
+#define POSITION(page, offset) ((uint32_t) ((page) << 16 | (offset)))
+#define POSITION_PAGE(pos)     ((pos) >> 16)
+#define POSITION_OFFSET(pos)   ((pos) & 0xFFFF)
+
+#define ALIGN_UP(n) \
+	(((n) + LOG_RECORD_ALIGN - 1) & ~((size_t) LOG_RECORD_ALIGN - 1))
+
+/* Une position n'a que 16 bits pour le numero de page */
+#define LOG_PAGES_MAX          65536
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/**
+ * @brief Allocates the next page of the log, large enough for a record of
+ * 'size' bytes.
+ *
+ * @return 0 on success, 1 on failure.
+ */
+static uint8_t page_new(RecordLog *log, size_t size)
+{
+	if (log->pages.length >= LOG_PAGES_MAX)
+		return 1;
+
+	size_t page_size = LOG_PAGE_MIN;
+	if (log->pages.length > 0)
+		page_size = log->page_size * 2;
+	if (page_size > LOG_PAGE_MAX)
+		page_size = LOG_PAGE_MAX;
+	while (page_size < size)
+		page_size *= 2;
+
+	char *page = malloc(page_size);
+	if (page == NULL)
+		return 1;
+
+	if (log->pages.append(&log->pages, &page)) {
+		free(page);
+		return 1;
+	}
+
+	log->page_size = page_size;
+	log->page_used = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Reserves a new record at the end of the log.
+ *
+ * The record starts on a LOG_RECORD_ALIGN boundary and is never split: if
+ * it does not fit in the rest of the last page, that rest is left unused
+ * and a new page is allocated.
+ *
+ * @param size The size of the record, between 1 and LOG_RECORD_MAX.
+ * @return The bytes of the record, or NULL on failure.
+ */
+static void *append(RecordLog *log, size_t size)
+{
+	if (size == 0 || size > LOG_RECORD_MAX)
+		return NULL;
+
+	size_t offset = ALIGN_UP(log->page_used);
+	if (log->pages.length == 0 || offset + size > log->page_size) {
+		if (page_new(log, size))
+			return NULL;
+		offset = 0;
+	}
+
+	size_t page = log->pages.length - 1;
+	uint32_t position = POSITION(page, offset);
+	if (log->index.append(&log->index, &position))
+		return NULL;
+
+	char **pages = log->pages.data;
+	char *record = pages[page] + offset;
+	log->page_used = offset + size;
+	log->length++;
+
+	return record;
+}
+
+static void *get(RecordLog *log, size_t i)
+{
+	if (i >= log->length)
+		return NULL;
+
+	uint32_t *index = log->index.data;
+	char **pages = log->pages.data;
+
+	return pages[POSITION_PAGE(index[i])] + POSITION_OFFSET(index[i]);
+}
+
+/**
+ * @brief Removes the last record of the log.
+ *
+ * Its bytes are given back to the last page, where the record was always
+ * reserved. A page allocated for it alone stays empty in the log.
+ */
+static void drop(RecordLog *log)
+{
+	if (log->length == 0)
+		return;
+
+	uint32_t *index = log->index.data;
+	log->page_used = POSITION_OFFSET(index[log->length - 1]);
+	log->index.length--;
+	log->length--;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t record_log_new(RecordLog *log)
+{
+	if (array_new(&log->pages, sizeof(char *), 0))
+		return 1;
+
+	if (array_new(&log->index, sizeof(uint32_t), 0)) {
+		array_free(&log->pages);
+		return 1;
+	}
+
+	log->page_size = 0;
+	log->page_used = 0;
+	log->length = 0;
+
+	log->append = append;
+	log->get = get;
+	log->drop = drop;
+
+	return 0;
+}
+
+void record_log_free(RecordLog *log)
+{
+	char **pages = log->pages.data;
+	for (size_t i = 0; pages != NULL && i < log->pages.length; i++)
+		free(pages[i]);
+
+	array_free(&log->pages);
+	array_free(&log->index);
+	log->length = 0;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,115 @@
+/**
+ * @file ring_buffer.c
+ * @brief Implementation of a mirrored ring buffer data structure.
+ */
+
+#include "data_structures/ring_buffer.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/**
+ * @brief Returns the bytes not consumed yet, contiguous in memory.
+ *
+ * @param len Set to the number of readable bytes.
+ */
+static char *readable(RingBuffer *ring, size_t *len)
+{
+	*len = ring->tail - ring->head;
+	return ring->buf + (ring->head % ring->size);
+}
+
+static void consume(RingBuffer *ring, size_t len)
+{
+	ring->head += len;
+
+	/* Vide : on repart du debut, les positions ne grandissent pas */
+	if (ring->head == ring->tail) {
+		ring->head = 0;
+		ring->tail = 0;
+	}
+}
+
+/**
+ * @brief Returns the free space of the ring, contiguous in memory.
+ *
+ * @param len Set to the number of writable bytes.
+ */
+static char *writable(RingBuffer *ring, size_t *len)
+{
+	*len = ring->size - (ring->tail - ring->head);
+	return ring->buf + (ring->tail % ring->size);
+}
+
+static void produce(RingBuffer *ring, size_t len)
+{
+	ring->tail += len;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t ring_buffer_new(RingBuffer *ring, size_t size)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) / page * page;
+
+	int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (ftruncate(fd, (off_t) size) < 0) {
+		close(fd);
+		return 1;
+	}
+
+	/* On reserve deux fois la taille, puis on y projette deux fois le fichier */
+	char *buf = mmap(NULL, 2 * size, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+
+	int prot = PROT_READ | PROT_WRITE;
+	if (mmap(buf, size, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(buf + size, size, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(buf, 2 * size);
+		close(fd);
+		return 1;
+	}
+
+	/* Les projections gardent la memoire, le descripteur est inutile */
+	close(fd);
+
+	ring->buf = buf;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+
+	ring->readable = readable;
+	ring->consume = consume;
+	ring->writable = writable;
+	ring->produce = produce;
+
+	return 0;
+}
+
+void ring_buffer_clear(RingBuffer *ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+void ring_buffer_free(RingBuffer *ring)
+{
+	if (ring->buf != NULL)
+		munmap(ring->buf, 2 * ring->size);
+
+	ring->buf = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,331 @@
+/**
+ * @file timer_wheel.c
+ * @brief Implementation of a hierarchical timer wheel data structure.
+ */
+
+#include "data_structures/timer_wheel.h"
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Ticks couverts par une case du niveau l */
+#define LEVEL_SPAN(l) ((uint64_t) 1 << (TW_BITS * (l)))
+
+/* Plus grand delai range sans etre replace */
+#define WHEEL_SPAN    LEVEL_SPAN(TW_LEVELS)
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static void list_init(Timer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void list_append(Timer *head, Timer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void unlink_timer(Timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/* Tourne le bitmap pour que le bit 'first' devienne le bit 0 */
+static uint64_t rotate(uint64_t bits, unsigned first)
+{
+	if (first == 0)
+		return bits;
+
+	return (bits >> first) | (bits << (TW_SLOTS - first));
+}
+
+static void insert(TimerWheel *wheel, Timer *timer)
+{
+	if (timer->expires < wheel->now)
+		timer->expires = wheel->now;
+
+	uint64_t delta = timer->expires - wheel->now;
+	uint8_t level = 0;
+	while (level < TW_LEVELS - 1 && delta >= LEVEL_SPAN(level + 1))
+		level++;
+
+	/* Trop loin : range a la limite, il sera replace en y arrivant */
+	uint64_t at = timer->expires;
+	if (delta >= WHEEL_SPAN)
+		at = wheel->now + WHEEL_SPAN - 1;
+
+	uint8_t slot = (uint8_t) ((at >> (TW_BITS * level)) & (TW_SLOTS - 1));
+	timer->wheel = wheel;
+	timer->level = level;
+	timer->slot = slot;
+	list_append(&wheel->slots[level][slot], timer);
+	wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+/*
+ * Premiere case non vide du niveau dans l'ordre ou la roue les atteint.
+ * Retourne le premier tick de cette case, UINT64_MAX si le niveau est vide.
+ */
+static uint64_t first_slot(TimerWheel *wheel, uint8_t level, uint8_t *slot)
+{
+	uint64_t bits = wheel->occupied[level];
+	if (bits == 0)
+		return UINT64_MAX;
+
+	/* Index de la premiere case qui commence au tick 'now' ou apres */
+	uint64_t span = LEVEL_SPAN(level);
+	uint64_t index = (wheel->now + span - 1) >> (TW_BITS * level);
+	if (level == 0)
+		index = wheel->now;
+
+	unsigned first = (unsigned) (index & (TW_SLOTS - 1));
+	unsigned distance = (unsigned) __builtin_ctzll(rotate(bits, first));
+	*slot = (uint8_t) ((first + distance) & (TW_SLOTS - 1));
+
+	return (index + distance) << (TW_BITS * level);
+}
+
+/* Redistribue les timers d'une case dans les niveaux inferieurs */
+static void cascade(TimerWheel *wheel, uint8_t level, uint8_t slot)
+{
+	Timer pending;
+	Timer *head = &wheel->slots[level][slot];
+
+	list_init(&pending);
+	while (head->next != head) {
+		Timer *timer = head->next;
+		unlink_timer(timer);
+		list_append(&pending, timer);
+	}
+	wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+
+	while (pending.next != &pending) {
+		Timer *timer = pending.next;
+		unlink_timer(timer);
+		insert(wheel, timer);
+	}
+}
+
+/*
+ * Traite le prochain tick ou il se passe quelque chose, s'il n'est pas
+ * apres now : cascades puis timers echus deplaces dans 'expired'.
+ * Retourne 0 si la roue est a jour.
+ */
+static uint8_t advance(TimerWheel *wheel, uint64_t now)
+{
+	uint64_t tick = UINT64_MAX;
+	uint8_t level = 0;
+	uint8_t slot = 0;
+
+	for (uint8_t l = 0; l < TW_LEVELS; l++) {
+		uint8_t s;
+		uint64_t t = first_slot(wheel, l, &s);
+		/* A egalite, les cascades passent avant les timers echus */
+		if (t < tick || (t == tick && t != UINT64_MAX)) {
+			tick = t;
+			level = l;
+			slot = s;
+		}
+	}
+
+	if (tick > now) {
+		if (wheel->now <= now)
+			wheel->now = now + 1;
+		return 0;
+	}
+
+	wheel->now = tick;
+	if (level > 0) {
+		cascade(wheel, level, slot);
+		return 1;
+	}
+
+	Timer *head = &wheel->slots[0][slot];
+	while (head->next != head) {
+		Timer *timer = head->next;
+		unlink_timer(timer);
+		timer->level = TW_LEVELS;
+		list_append(&wheel->expired, timer);
+	}
+	wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+
+	/* Un timer rajoute pour maintenant par un callback part au tick
+	 * suivant */
+	wheel->now = tick + 1;
+	return 1;
+}
+
+static void add(TimerWheel *wheel, Timer *timer, uint64_t expires)
+{
+	timer_cancel(timer);
+
+	timer->expires = expires;
+	insert(wheel, timer);
+}
+
+static Timer *expire(TimerWheel *wheel, uint64_t now)
+{
+	while (wheel->expired.next == &wheel->expired) {
+		if (!advance(wheel, now))
+			return NULL;
+	}
+
+	Timer *timer = wheel->expired.next;
+	unlink_timer(timer);
+	return timer;
+}
+
+static uint64_t slot_min(Timer *head)
+{
+	uint64_t deadline = UINT64_MAX;
+	for (Timer *t = head->next; t != head; t = t->next) {
+		if (t->expires < deadline)
+			deadline = t->expires;
+	}
+
+	return deadline;
+}
+
+/*
+ * Une case du dernier niveau peut ne contenir que des timers trop
+ * lointains, ranges avant leur tour : on passe alors aux suivantes.
+ */
+static uint64_t top_min(TimerWheel *wheel)
+{
+	const uint8_t level = TW_LEVELS - 1;
+	uint64_t deadline = UINT64_MAX;
+	uint8_t slot;
+
+	uint64_t start = first_slot(wheel, level, &slot);
+	uint64_t bits = wheel->occupied[level];
+	for (uint8_t i = 0; i < TW_SLOTS && start != UINT64_MAX; i++) {
+		uint8_t s = (uint8_t) ((slot + i) & (TW_SLOTS - 1));
+		if (!(bits & ((uint64_t) 1 << s)))
+			continue;
+
+		uint64_t min = slot_min(&wheel->slots[level][s]);
+		if (min < deadline)
+			deadline = min;
+
+		uint64_t end = start + (uint64_t) (i + 1) * LEVEL_SPAN(level);
+		if (deadline < end)
+			break;
+	}
+
+	return deadline;
+}
+
+static uint64_t next(TimerWheel *wheel)
+{
+	if (wheel->expired.next != &wheel->expired)
+		return wheel->now;
+
+	uint8_t slot;
+	uint64_t deadline = first_slot(wheel, 0, &slot);
+
+	/* Les cases sont dans l'ordre des echeances : la premiere non vide
+	 * de chaque niveau contient la plus proche de ce niveau */
+	for (uint8_t level = 1; level < TW_LEVELS - 1; level++) {
+		if (first_slot(wheel, level, &slot) == UINT64_MAX)
+			continue;
+
+		uint64_t min = slot_min(&wheel->slots[level][slot]);
+		if (min < deadline)
+			deadline = min;
+	}
+
+	uint64_t min = top_min(wheel);
+	return min < deadline ? min : deadline;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+void timer_wheel_new(TimerWheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+
+	for (uint8_t level = 0; level < TW_LEVELS; level++) {
+		for (uint8_t slot = 0; slot < TW_SLOTS; slot++)
+			list_init(&wheel->slots[level][slot]);
+	}
+	list_init(&wheel->expired);
+
+	wheel->add = add;
+	wheel->expire = expire;
+	wheel->next = next;
+}
+
+void timer_wheel_run(TimerWheel *wheel, uint64_t now)
+{
+	Timer *timer;
+	while ((timer = wheel->expire(wheel, now)) != NULL)
+		timer->callback(timer->data);
+}
+
+int timer_wheel_timeout(TimerWheel *wheel, uint64_t now)
+{
+	uint64_t deadline = wheel->next(wheel);
+	if (deadline == UINT64_MAX)
+		return -1;
+
+	if (deadline <= now)
+		return 0;
+
+	if (deadline - now > INT_MAX)
+		return INT_MAX;
+
+	return (int) (deadline - now);
+}
+
+void timer_init(Timer *timer, void (*callback) (void *data), void *data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->callback = callback;
+	timer->data = data;
+}
+
+void timer_cancel(Timer *timer)
+{
+	if (!timer_pending(timer))
+		return;
+
+	TimerWheel *wheel = timer->wheel;
+	uint8_t level = timer->level;
+	uint8_t slot = timer->slot;
+	unlink_timer(timer);
+
+	/* Un timer echu est sur la liste 'expired', hors des cases */
+	if (level >= TW_LEVELS)
+		return;
+
+	Timer *head = &wheel->slots[level][slot];
+	if (head->next == head)
+		wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+}
+
+uint8_t timer_pending(const Timer *timer)
+{
+	return timer->next != NULL;
+}
+
+uint64_t timer_clock_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -2,10 +2,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "user/user.h"
 
+#include "network/codec.h"
+#include "network/datagram.h"
+#include "network/file_transfer.h"
 #include "network/network_macros.h"
+#include "network/pacer.h"
 
 #include "network/client/client.h"
 #include "network/client/data.h"
@@ -40,9 +45,56 @@ static uint8_t is_port(const char *port)
 }
 
 /*
- * -i adresse ip | -p port
+ * La taille de bloc proposee remplit un datagramme a la MTU du chemin vers
+ * le serveur : pas de fragmentation IP. Connecter une socket UDP n'envoie
+ * rien, le port TCP suffit a trouver la route.
  */
-static void parse(int argc, const char *argv[], char *hostname, char *port)
+static uint8_t set_chunk_from_mtu(const char *port)
+{
+	Client probe = client_new(port, DOMAIN, SOCK_DGRAM);
+	if (connect_client(&probe))
+		return 1;
+
+	int mtu;
+	socklen_t len = sizeof(mtu);
+	int err = connect(probe.sfd, (SA *) &probe.addr, sizeof(probe.addr));
+	if (err == 0)
+		err = getsockopt(probe.sfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+	close(probe.sfd);
+	if (err < 0) {
+		perror("path MTU");
+		return 1;
+	}
+
+	size_t overhead = DGRAM_IP_OVERHEAD + CODEC_FT_HEADER_LEN;
+	size_t chunk = (size_t) mtu > overhead ? (size_t) mtu - overhead : 0;
+	file_set_chunk_max(chunk);
+	debug_log("path MTU %d, transfer blocks of %zu bytes", mtu,
+		  file_chunk_max());
+	return 0;
+}
+
+static void usage_error(void)
+{
+	logerror("format incorrect\n Please put -i before IP address or the "
+		 "hostname, -p before the port, -b before the number of "
+		 "datagrams per send, -r before the upload rate cap in Mbit/s, "
+		 "-a before 0 or 1 for the adaptive rate, -c before the "
+		 "transfer block size in bytes or 'mtu', -g before 0 or 1 "
+		 "for the UDP segmentation offload and -k for keep-alive");
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * -i adresse ip | -p port | -b datagrammes par envoi
+ * -r plafond des envois en Mbit/s (0 sans plafond) | -a debit adaptatif (0/1)
+ * -c taille de bloc des transferts en octets, ou 'mtu' pour la deduire du
+ * chemin vers le serveur | -g super-datagrammes GSO/GRO (0/1)
+ * -k (connexion persistante)
+ */
+static void parse(int argc, const char *argv[], char *hostname, char *port,
+		  uint8_t *keep_alive, uint8_t *path_mtu)
 {
 	memset(port, 0, PORT_STRLEN);
 	strcpy(port, TCP_PORT_STR);
@@ -50,50 +102,75 @@ static void parse(int argc, const char *argv[], char *hostname, char *port)
 	memset(hostname, 0, HOSTNAME_STRLEN);
 	strcpy(hostname, "::1");
 
-	if (argc == 1)
-		return;
-	if (argc == 3 && !strcmp(argv[1], "-p")) {
-		if (is_port(argv[2]) ) {
-			memset(port, 0, PORT_STRLEN);
-			strcpy(port, argv[2]);
+	*keep_alive = 0;
+	*path_mtu = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-k")) {
+			*keep_alive = 1;
+			continue;
 		}
-		else
-			exit(EXIT_FAILURE);
-		return;
-	}
 
-	if (argc == 3 && !strcmp(argv[1], "-i")) {
-		memset(hostname, 0, HOSTNAME_STRLEN);
-		strcpy(hostname, argv[2]);
-		return;
-	}
+		if (i + 1 >= argc)
+			usage_error();
+
+		if (!strcmp(argv[i], "-p")) {
+			if (!is_port(argv[i + 1]) ||
+			    strlen(argv[i + 1]) >= PORT_STRLEN)
+				exit(EXIT_FAILURE);
 
-	if (argc == 5) {
-		uint8_t id_p = 0;
-		uint8_t id_i = 0;
-		if(!strcmp(argv[1], "-p"))
-			id_p = 2;
-		if(!strcmp(argv[1], "-i"))
-			id_i = 2;
-		if(!strcmp(argv[3], "-p"))
-			id_p = 4;
-		if(!strcmp(argv[3], "-i"))
-			id_i = 4;
-
-		memset(hostname, 0, HOSTNAME_STRLEN);
-		strcpy(hostname, argv[id_i]);
-		if (is_port(argv[id_p])) {
 			memset(port, 0, PORT_STRLEN);
-			strcpy(port, argv[id_p]);
+			strcpy(port, argv[++i]);
+		} else if (!strcmp(argv[i], "-i")) {
+			if (strlen(argv[i + 1]) >= HOSTNAME_STRLEN)
+				usage_error();
+
+			memset(hostname, 0, HOSTNAME_STRLEN);
+			strcpy(hostname, argv[++i]);
+		} else if (!strcmp(argv[i], "-b")) {
+			char *endptr;
+			long l = strtol(argv[++i], &endptr, 10);
+			if (*endptr != 0 || l < 1 || l > DGRAM_BATCH_MAX)
+				usage_error();
+
+			dgram_set_batch((size_t) l);
+		} else if (!strcmp(argv[i], "-r")) {
+			char *endptr;
+			long l = strtol(argv[++i], &endptr, 10);
+			if (*endptr != 0 || l < 0 || l > PACER_RATE_MAX)
+				usage_error();
+
+			pacer_set_rate((size_t) l);
+		} else if (!strcmp(argv[i], "-a")) {
+			char *endptr;
+			long l = strtol(argv[++i], &endptr, 10);
+			if (*endptr != 0 || l < 0 || l > 1)
+				usage_error();
+
+			pacer_set_adaptive((uint8_t) l);
+		} else if (!strcmp(argv[i], "-c")) {
+			if (!strcmp(argv[++i], "mtu")) {
+				*path_mtu = 1;
+				continue;
+			}
+
+			char *endptr;
+			long l = strtol(argv[i], &endptr, 10);
+			if (*endptr != 0 || l < FT_CHUNK_MIN || l > FT_CHUNK_MAX)
+				usage_error();
+
+			file_set_chunk_max((size_t) l);
+		} else if (!strcmp(argv[i], "-g")) {
+			char *endptr;
+			long l = strtol(argv[++i], &endptr, 10);
+			if (*endptr != 0 || l < 0 || l > 1)
+				usage_error();
+
+			dgram_set_offload((uint8_t) l);
+		} else {
+			usage_error();
 		}
-		else
-			exit(EXIT_FAILURE);
-		if (id_i != 0 && id_p != 0)
-			return;
 	}
-	logerror("format incorrect\n Please put -i before IP address or the hostname and -p before the port");
-	
-	exit(EXIT_FAILURE);
 }
 
 /* ---------------------------- PUBLIC FUNCTION ----------------------------- */
@@ -107,16 +184,22 @@ void launch_client(int argc, const char *argv[])
 
 	char port[PORT_STRLEN];
 	char hostname[HOSTNAME_STRLEN];
+	uint8_t keep_alive;
+	uint8_t path_mtu;
 
 	/* Initialisations */
 	data_init();
 	if (load_accounts())
 		exit(EXIT_FAILURE);
 
-	parse(argc, argv, hostname, port);
-	tcp_client_init(port);
+	parse(argc, argv, hostname, port, &keep_alive, &path_mtu);
+	if (tcp_client_init(port, keep_alive))
+		exit(EXIT_FAILURE);
 	set_hostname(hostname);
 
+	if (path_mtu && set_chunk_from_mtu(port))
+		exit(EXIT_FAILURE);
+
 	thread_pool = thread_pool_init(thread_count);
 	if (thread_pool == NULL)
 		exit(EXIT_FAILURE);
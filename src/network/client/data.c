@@ -1,13 +1,13 @@
 #include "network/client/data.h"
 
 #include <poll.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
 #if defined(__APPLE__)
@@ -16,12 +16,32 @@
 #include <linux/limits.h>
 #endif
 
+#include "network/datagram.h"
 #include "network/request.h"
 
 
-static FileTransferInfos m_tranfer_file;
+/* Jetons des envois interrompus, a proposer au prochain essai */
+#define UPLOAD_RECORD_PATH "res/client"
+
+/* Envoi interrompu : son jeton vaut tant que le fichier n'a pas change */
+typedef struct
+{
+	uint32_t token;
+	uint32_t chunk;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} UploadRecord;
+
+/* Transfert de la requete en cours, seul le thread TCP y touche */
+static char              m_pending_path[MAX_DATALEN];
+static uint16_t          m_pending_feed;
+static int               m_pending_sfd = -1;
+
+/* Transferts demarres, pas encore pris par le thread UDP ('Transfer *') */
+static Queue             m_started;
+static int               m_wakeup[2];
 static pthread_mutex_t   m_transfer_mutex;
-static pthread_cond_t    m_transfer_cond;
 
 static Array 		 m_subscriptions;
 static pthread_mutex_t   m_subscriptions_mutex;
@@ -65,9 +85,19 @@ static void unlock_notification(void)
 
 void data_init(void)
 {
-	memset(&m_tranfer_file, 0, sizeof(m_tranfer_file));
+	m_started = queue_init(sizeof(Transfer *));
 	pthread_mutex_init(&m_transfer_mutex, NULL);
-	pthread_cond_init(&m_transfer_cond, NULL);
+
+	/* Reveille le thread UDP, bloque dans poll, a chaque demarrage */
+	if (pipe(m_wakeup) < 0)
+		exit(EXIT_FAILURE);
+
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(m_wakeup[i], F_GETFL, 0);
+		if (flags < 0 ||
+		    fcntl(m_wakeup[i], F_SETFL, flags | O_NONBLOCK) < 0)
+			exit(EXIT_FAILURE);
+	}
 
 	if (array_new(&m_subscriptions, sizeof(Sb), 0))
 		exit(EXIT_FAILURE);
@@ -83,11 +113,15 @@ void data_init(void)
 
 void data_free(void)
 {
-	if (m_tranfer_file.active)
-		array_free(&m_tranfer_file.file_data);
+	transfer_cancel();
 
+	Transfer *transfer;
+	while ((transfer = transfer_take()) != NULL)
+		transfer_close(transfer);
+
+	close(m_wakeup[0]);
+	close(m_wakeup[1]);
 	pthread_mutex_destroy(&m_transfer_mutex);
-	pthread_cond_destroy(&m_transfer_cond);
 
 	array_free(&m_subscriptions);
 	pthread_mutex_destroy(&m_subscriptions_mutex);
@@ -107,57 +141,342 @@ void wait_notif(void)
     unlock_subscriptions();
 }
 
-uint8_t transfer_new(const char *file_name)
+uint8_t transfer_new(const char *file_name, uint16_t feed_number)
 {
-	uint8_t err;
+	transfer_cancel();
 
-	lock_transfer();
-	if (m_tranfer_file.active)
-		transfer_clear(&m_tranfer_file);
+	memset(m_pending_path, 0, MAX_DATALEN);
+	strncpy(m_pending_path, file_name, MAX_DATALEN - 1);
+	m_pending_feed = feed_number;
+	return 0;
+}
 
-	m_tranfer_file = transfer_init(file_name, 0);
-	err = (m_tranfer_file.file_data.data == NULL);
-	unlock_transfer();
+void set_transfer_socket(int sfd)
+{
+	m_pending_sfd = sfd;
+}
 
-	return err;
+void transfer_cancel(void)
+{
+	if (m_pending_sfd >= 0)
+		close(m_pending_sfd);
+
+	m_pending_sfd = -1;
 }
 
-void set_tranfer_address(int sfd, SA_IN6 *addr)
+/* Le dossier de telechargement de l'utilisateur, cree au besoin */
+static uint8_t download_dir(char *dir, size_t size)
 {
-	lock_transfer();
-	if (!m_tranfer_file.active) {
-		unlock_transfer();
+	char *home = getenv("HOME");
+	if (home == NULL)
+		return 1;
+
+	struct stat st;
+	snprintf(dir, size, "%s/Téléchargements", home);
+	if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode))
+		return 0;
+
+	snprintf(dir, size, "%s/Downloads", home);
+	if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+		perror("mkdir");
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint8_t download_path(const char *name, const char *ext, char *path,
+			     size_t size)
+{
+	char dir[PATH_MAX];
+	if (download_dir(dir, sizeof(dir)))
+		return 1;
+
+	int len = snprintf(path, size, "%s/%s%s", dir, name, ext);
+	return len < 0 || (size_t) len >= size;
+}
+
+/* Un fichier par fil et par nom, le chemin local n'est pas envoye */
+static void upload_record_path(const char *file_path, uint16_t feed_number,
+			       char *path, size_t size)
+{
+	const char *name = strrchr(file_path, '/');
+	name = name == NULL ? file_path : name + 1;
+
+	snprintf(path, size, "%s/.upload-%u-%s", UPLOAD_RECORD_PATH,
+		 feed_number, name);
+}
+
+static void upload_record_stat(UploadRecord *record, struct stat *st)
+{
+	record->size = (uint64_t) st->st_size;
+	record->mtime_sec = (int64_t) st->st_mtim.tv_sec;
+	record->mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+}
+
+static void upload_record_save(const char *path, uint32_t token,
+			       size_t chunk)
+{
+	struct stat st;
+	if (stat(m_pending_path, &st) < 0)
 		return;
+
+	UploadRecord record;
+	memset(&record, 0, sizeof(record));
+	record.token = token;
+	record.chunk = (uint32_t) chunk;
+	upload_record_stat(&record, &st);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return;
+
+	if (write(fd, &record, sizeof(record)) != (ssize_t) sizeof(record))
+		unlink(path);
+	close(fd);
+}
+
+/* Le jeton n'est propose que si le fichier n'a pas change depuis */
+static void upload_resume_request(ClientRQ_Cl *cl)
+{
+	char path[PATH_MAX];
+	upload_record_path(m_pending_path, m_pending_feed, path, sizeof(path));
+
+	UploadRecord record;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	ssize_t nbytes = read(fd, &record, sizeof(record));
+	close(fd);
+
+	UploadRecord now;
+	struct stat st;
+	if (nbytes != (ssize_t) sizeof(record) || stat(m_pending_path, &st) < 0)
+		return;
+
+	upload_record_stat(&now, &st);
+	if (record.size != now.size || record.mtime_sec != now.mtime_sec ||
+	    record.mtime_nsec != now.mtime_nsec)
+		return;
+
+	cl->resume = record.token;
+	cl->chunk = (uint16_t) record.chunk;
+}
+
+/*
+ * Le serveur envoie a partir du premier bloc qui manque au point, sans les
+ * blocs suivants que le point a deja : la requete les decrit comme un
+ * acquittement.
+ */
+static void download_resume_request(ClientRQ_Cl *cl)
+{
+	char path[PATH_MAX];
+	if (download_path(m_pending_path, FT_PARTIAL_EXT FT_CHECKPOINT_EXT,
+			  path, sizeof(path)))
+		return;
+
+	FileTransferInfos saved = transfer_init(m_pending_path, 0, 1, 0);
+	if (transfer_checkpoint_load(&saved, path) == 0 &&
+	    saved.feed_number == m_pending_feed &&
+	    strncmp(saved.file_path, m_pending_path, MAX_DATALEN) == 0) {
+		FTransferAck ack;
+		transfer_ack_new(&saved, 0, &ack);
+		cl->resume = saved.token;
+		cl->first = ack.base;
+		memcpy(cl->held, ack.bitmap, sizeof(cl->held));
+		cl->chunk = (uint16_t) saved.blocks.block_size;
 	}
 
-	m_tranfer_file.sfd = sfd;
-	m_tranfer_file.addr = *addr;
-	unlock_transfer();
+	transfer_clear(&saved);
 }
 
-int get_transfer_socket(void)
+void transfer_resume_request(ClientRQ_Cl *cl, uint8_t upload)
+{
+	cl->resume = 0;
+	cl->first = 0;
+	memset(cl->held, 0, sizeof(cl->held));
+
+	if (upload)
+		upload_resume_request(cl);
+	else
+		download_resume_request(cl);
+}
+
+static uint8_t transfer_submit(Transfer *transfer)
 {
 	lock_transfer();
-	int sfd = m_tranfer_file.sfd;
+	if (m_started.enqueue(&m_started, &transfer)) {
+		unlock_transfer();
+		return 1;
+	}
+
+	char byte = 0;
+	if (write(m_wakeup[1], &byte, 1) < 0 && errno != EAGAIN)
+		perror("write");
 	unlock_transfer();
 
-	return sfd;
+	return 0;
 }
 
-void reset_transfer_socket(void)
+/*
+ * Les blocs sont ecrits au fil de l'eau dans le fichier partiel. Si le
+ * serveur reprend apres le debut, les blocs deja recus viennent du point
+ * de reprise, sinon le fichier repart de zero.
+ */
+static uint8_t open_download(Transfer *transfer, size_t chunk, uint32_t token,
+			     uint32_t first)
 {
-	lock_transfer();
-	m_tranfer_file.sfd = 0;
-	unlock_transfer();
+	FileTransferInfos *infos = &transfer->infos;
+	if (download_path(infos->file_path, FT_PARTIAL_EXT, infos->tmp_path,
+			  MAX_DATALEN))
+		return 1;
+
+	snprintf(transfer->checkpoint, PATH_MAX, "%s%s", infos->tmp_path,
+		 FT_CHECKPOINT_EXT);
+
+	uint8_t resumed = first > 1 &&
+			  !transfer_checkpoint_load(infos,
+						    transfer->checkpoint) &&
+			  infos->token == token &&
+			  infos->blocks.block_size == chunk;
+	if (!resumed) {
+		reassembly_free(&infos->blocks);
+		if (reassembly_new(&infos->blocks, chunk, 0))
+			return 1;
+		infos->fin = 0;
+	}
+
+	/* Le point est repris ou perime, il sera reecrit en cas d'echec */
+	unlink(transfer->checkpoint);
+	infos->token = token;
+	infos->feed_number = m_pending_feed;
+
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (resumed ? 0 : O_TRUNC);
+	infos->fd = open(infos->tmp_path, flags, S_IRUSR | S_IWUSR);
+	if (infos->fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	return 0;
 }
 
-char *get_tranfer_file_path(void)
+uint8_t transfer_start_download(uint16_t id, size_t chunk, uint32_t token,
+				uint32_t first)
 {
+	if (m_pending_sfd < 0)
+		return 1;
+
+	Transfer *transfer = calloc(1, sizeof(*transfer));
+	if (transfer == NULL)
+		return 1;
+
+	transfer->id = id;
+	transfer->upload = 0;
+	transfer->infos = transfer_init(m_pending_path, m_pending_feed, chunk,
+					0);
+	if (transfer->infos.blocks.received.words == NULL ||
+	    open_download(transfer, chunk, token, first)) {
+		transfer_clear(&transfer->infos);
+		free(transfer);
+		return 1;
+	}
+
+	/* La socket appartient desormais au transfert */
+	transfer->sfd = m_pending_sfd;
+	transfer->infos.sfd = m_pending_sfd;
+	m_pending_sfd = -1;
+
+	if (transfer_submit(transfer)) {
+		transfer_close(transfer);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint8_t transfer_start_upload(uint16_t id, size_t chunk, int sfd,
+			      SA_IN6 *addr, uint32_t token, uint32_t first,
+			      const uint8_t *held)
+{
+	Transfer *transfer = calloc(1, sizeof(*transfer));
+	if (transfer == NULL)
+		return 1;
+
+	/* Les paquets sont envoyes directement depuis le fichier projete */
+	if (file_map(&transfer->file, m_pending_path)) {
+		free(transfer);
+		return 1;
+	}
+
+	transfer->id = id;
+	transfer->upload = 1;
+	transfer->sfd = sfd;
+	transfer->addr = *addr;
+
+	header_t header = (header_t) (UPLOAD | (id << CODERQ_BITSLEN));
+	header_t fin = (header_t) (FTFIN | (id << CODERQ_BITSLEN));
+	send_window_init(&transfer->window, &transfer->file, chunk, header,
+			 fin);
+	send_window_skip(&transfer->window, first, held);
+
+	/* Le jeton est garde jusqu'a la fin de l'envoi, pour le reprendre */
+	if (token != 0) {
+		upload_record_path(m_pending_path, m_pending_feed,
+				   transfer->checkpoint, PATH_MAX);
+		upload_record_save(transfer->checkpoint, token, chunk);
+	}
+
+	if (transfer_submit(transfer)) {
+		file_unmap(&transfer->file);
+		free(transfer);
+		return 1;
+	}
+
+	return 0;
+}
+
+Transfer *transfer_take(void)
+{
+	char bytes[64];
+	while (read(m_wakeup[0], bytes, sizeof(bytes)) > 0)
+		;
+
 	lock_transfer();
-	char *file_path = m_tranfer_file.file_path;
+	Node *node = m_started.dequeue(&m_started);
 	unlock_transfer();
+	if (node == NULL)
+		return NULL;
 
-	return file_path;
+	Transfer *transfer = *(Transfer **) node->data;
+	node_free(node);
+	return transfer;
+}
+
+int transfer_wakeup_fd(void)
+{
+	return m_wakeup[0];
+}
+
+void transfer_close(Transfer *transfer)
+{
+	close(transfer->sfd);
+	if (transfer->upload) {
+		/* Un envoi abouti n'a plus rien a reprendre */
+		if (transfer->window.done && transfer->checkpoint[0] != '\0')
+			unlink(transfer->checkpoint);
+		file_unmap(&transfer->file);
+	} else {
+		/* Un telechargement interrompu garde ses blocs */
+		if (transfer->infos.blocks.received.count > 0)
+			transfer_suspend(&transfer->infos,
+					 transfer->checkpoint);
+		transfer_clear(&transfer->infos);
+	}
+
+	free(transfer);
 }
 
 int subscription_add(const char *addr, uint16_t port, int sfd, uint16_t feed_nb)
@@ -276,145 +595,87 @@ uint8_t refresh_fds(Array *fds)
     return 0;
 }
 
-static uint8_t write_file(FileTransferInfos *infos)
+/* Tous les blocs sont sur le disque : le fichier prend son nom final */
+static uint8_t finish_download(FileTransferInfos *infos)
 {
-	char *home = getenv("HOME");
-	if (home == NULL)
-		return 1;
-
-	char dl_file_path[PATH_MAX];
-	memset(dl_file_path, 0, PATH_MAX);
-	sprintf(dl_file_path, "%s/Téléchargements", home);
-
-	char file_path[MAX_DATALEN];
-	memset(file_path, 0, MAX_DATALEN);
-	if (snprintf(file_path, MAX_DATALEN, "%s/%s", dl_file_path,
-		     infos->file_path) < 0)
-		return 1;
-
-	int fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		memset(dl_file_path, 0, PATH_MAX);
-		sprintf(dl_file_path, "%s/Downloads", home);
-		
-		memset(file_path, 0, MAX_DATALEN);
-		if (snprintf(file_path, MAX_DATALEN, "%s/%s", dl_file_path,
-		     infos->file_path) < 0)
-			return 1;
-		fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-		if (fd < 0) {
-			mkdir(dl_file_path, S_IRWXU);
-			fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-			if (fd < 0) {
-				perror("open");
-				return 1;
-			}
-		}
-
-	}
-
-	if (ftruncate(fd, infos->file_size) < 0) {
-		perror("ftruncate");
+	char file_path[PATH_MAX];
+	if (download_path(infos->file_path, "", file_path, sizeof(file_path)))
 		return 1;
-	}
 
-	int prot = PROT_READ | PROT_WRITE;
-	char *file = mmap(NULL, (size_t) infos->file_size, prot, MAP_SHARED, fd, 0);
-	if (file == NULL) {
-		perror("mmap");
+	int fd = infos->fd;
+	infos->fd = -1;
+	if (ftruncate(fd, (off_t) infos->blocks.size) < 0 || close(fd) < 0 ||
+	    rename(infos->tmp_path, file_path) < 0) {
+		perror("rename");
+		unlink(infos->tmp_path);
 		return 1;
 	}
 
-	char *file_content = infos->file_data.data;
-	memcpy(file, file_content, (size_t) infos->file_size);
-	munmap(file, (size_t) infos->file_size);
-	close(fd);
 	return 0;
 }
 
-int8_t add_packet(uint16_t numblock, char *data, size_t nbytes)
+/*
+ * Acquitte les paquets recus aupres du serveur quand c'est du. Une fois le
+ * FIN recu et tous les blocs arrives, le fichier est ecrit sur le disque.
+ * Retourne 0 si le transfert est termine, 1 s'il continue, -1 en cas
+ * d'erreur.
+ */
+static int8_t acknowledge(Transfer *transfer, uint8_t fin, SA_IN6 *from)
 {
-	lock_transfer();
-	FileTransferInfos *infos = &m_tranfer_file;
-
-	/* Pas de demande de Download au préalable, paquet non traité. */
-	if (!infos->active) {
-		unlock_transfer();
+	FileTransferInfos *infos = &transfer->infos;
+	uint8_t copies = transfer_ack_due(infos, fin);
+	if (copies == 0)
 		return 1;
-	}
 
-	/*
-	 * Dernier numero de paquet, enregistrement pour savoir quand est
-	 * ce qu'on a tous les paquets.
-	 */
-	if (nbytes < FILE_PACKET_SIZE)
-		infos->last_packet = numblock;
+	FTransferAck ack;
+	header_t header = (header_t) (FTACK | transfer->id << CODERQ_BITSLEN);
+	transfer_ack_new(infos, header, &ack);
+	if (dgram_send_ack(infos->sfd, from, &ack, copies))
+		perror("sendto");
 
-	if (infos->file_data.set(&infos->file_data, numblock - 1, data)) {
-		unlock_transfer();
-		return -1;
-	}
-
-	infos->file_size += (off_t) nbytes;
-
-	/* Tous les paquets sont recus, ecriture du fichier sur le disque. */
-	if (infos->file_data.length == infos->last_packet) {
-		if (write_file(infos)) {
-			unlock_transfer();
-			return -1;
-		}
-
-		close(infos->sfd);
-		transfer_clear(infos);
-		unlock_transfer();
-		return 0;
-	}
+	if (!transfer_done(infos))
+		return 1;
 
-	unlock_transfer();
-	return 1;
+	return finish_download(infos) ? -1 : 0;
 }
 
-uint8_t check_transfer_timeout(void)
+int8_t add_packet(Transfer *transfer, uint32_t numblock, char *data,
+		  size_t nbytes, SA_IN6 *from)
 {
-	lock_transfer();
+	if (numblock == 0)
+		return 1;
 
-	time_t now = time(NULL);
-	uint8_t timeout = difftime(now, m_tranfer_file.begin) > FT_TIMEOUT_SEC;
+	/* Les blocs arrivent dans le desordre, seul le dernier est court */
+	FileTransferInfos *infos = &transfer->infos;
+	Reassembly *blocks = &infos->blocks;
+	int fresh = blocks->insert(blocks, numblock - 1, data, nbytes,
+				   nbytes < blocks->block_size);
+	if (fresh < 0)
+		return -1;
 
-	if (m_tranfer_file.active && timeout) {
-		close(m_tranfer_file.sfd);
-		transfer_clear(&m_tranfer_file);
+	/* Seul le suivi est en memoire, les donnees vont sur le disque */
+	off_t offset = (off_t) (numblock - 1) * (off_t) blocks->block_size;
+	if (fresh && nbytes > 0 &&
+	    pwrite(infos->fd, data, nbytes, offset) < 0) {
+		perror("pwrite");
 
-		unlock_transfer();
-		return 1;
+		/* Le bitmap ne dit plus ce qui est sur le disque */
+		infos->token = 0;
+		return -1;
 	}
 
-	unlock_transfer();
-	return 0;
+	return acknowledge(transfer, 0, from);
 }
 
-void clear_current_transfer(void)
+int8_t end_transfer(Transfer *transfer, uint32_t count, SA_IN6 *from)
 {
-	lock_transfer();
-	transfer_clear(&m_tranfer_file);
-	unlock_transfer();
-}
-
-int wait_transfer(void)
-{
-	lock_transfer();
-	while (m_tranfer_file.sfd == 0)
-		pthread_cond_wait(&m_transfer_cond, &m_transfer_mutex);
-
-	int sfd = m_tranfer_file.sfd;
-	unlock_transfer();
-
-	return sfd;
-}
+	/* Le nombre annonce contredit les blocs recus : transfert abandonne */
+	Reassembly *blocks = &transfer->infos.blocks;
+	if (blocks->expect(blocks, count))
+		return -1;
 
-void signal_transfer(void)
-{
-	pthread_cond_signal(&m_transfer_cond);
+	transfer->infos.fin = 1;
+	return acknowledge(transfer, 1, from);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -1,5 +1,6 @@
 #include "network/client/notifications_center.h"
 
+#include <errno.h>
 #include <poll.h>
 
 #include "network/client/data.h"
@@ -24,6 +25,9 @@ static uint8_t recv_notifications(void)
 	        	if (nbytes < 0 && SBLOCK)
 	                	break;
 
+	        	if (nbytes < 0 && errno == EBADMSG)
+	        		continue;
+
 	        	if (nbytes < 0)
 	        		return 1;
 
@@ -4,10 +4,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 
 #include "user/user_input.h"
 #include "network/client/data.h"
+#include "network/codec.h"
+#include "network/datagram.h"
 #include "network/network_macros.h"
 
 #include "system/logger.h"
@@ -34,6 +35,9 @@ static uint8_t create_transfer_address(SA_IN6 *addr)
 	if ((sfd = socket(DOMAIN, SOCK_DGRAM, 0)) < 0)
 		return 1;
 
+	/* Fermee par transfer_cancel() si le telechargement ne demarre pas */
+	set_transfer_socket(sfd);
+
 	memset(addr, 0, sizeof(*addr));
 	addr->sin6_family = DOMAIN;
 	addr->sin6_port = 0;
@@ -46,6 +50,9 @@ static uint8_t create_transfer_address(SA_IN6 *addr)
 	if (fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0)
 		return 1;
 
+	if (dgram_enable_gro(sfd))
+		debug_logerror("UDP_GRO unavailable");
+
 	if (bind(sfd, (const SA *) addr, sizeof(*addr)) < 0) {
 		debug_logerror("Failed to bind");
 		return 1;
@@ -56,7 +63,6 @@ static uint8_t create_transfer_address(SA_IN6 *addr)
 		return 1;
 	}
 
-	set_tranfer_address(sfd, addr);
 	return 0;
 }
 
@@ -72,13 +78,16 @@ static uint8_t create_rqdl(ClientRQ *clientrq, uint16_t id)
 	uint8_t datalen = data_manager(DOWNLOAD, file_name);
 
 	SA_IN6 addr;
-	transfer_new(file_name);
-	create_transfer_address(&addr);
+	if (transfer_new(file_name, feed_number) ||
+	    create_transfer_address(&addr))
+		return 1;
 
 	clientrq->cl.feed_number = feed_number;
 	clientrq->cl.count = ntohs(addr.sin6_port);
 	clientrq->cl.datalen = datalen;
 	strncpy(clientrq->cl.data, file_name, datalen);
+	clientrq->cl.chunk = (uint16_t) file_chunk_max();
+	transfer_resume_request(&clientrq->cl, 0);
 	return 0;
 }
 
@@ -105,14 +114,16 @@ uint8_t create_request(ClientRQ *clientrq, uint16_t id)
 	uint8_t datalen = data_manager(rq_type, input);
 	if (rq_type == UPLOAD) {
 		file_manager(input);
-		if (transfer_new(input))
+		if (transfer_new(input, feed_number))
 			return 1;
 
+		/* Seul le nom du fichier est envoye, sans son chemin */
 		char *file_name = strrchr(input, '/');
 		if (file_name != NULL) {
 			size_t len = strlen(++file_name);
 			memmove(input, file_name, len);
 			input[len] = 0;
+			datalen = (uint8_t) len;
 		}
 	}
 
@@ -120,64 +131,42 @@ uint8_t create_request(ClientRQ *clientrq, uint16_t id)
 	clientrq->cl.feed_number = feed_number;
 	clientrq->cl.count = count;
 	clientrq->cl.datalen = datalen;
+	clientrq->cl.chunk = (uint16_t) file_chunk_max();
+	clientrq->cl.resume = 0;
+	clientrq->cl.first = 0;
+	memset(clientrq->cl.held, 0, sizeof(clientrq->cl.held));
+	if (rq_type == UPLOAD)
+		transfer_resume_request(&clientrq->cl, 1);
 
 	memcpy(clientrq->cl.data, input, datalen);
 	return 0;
 }
 
-uint8_t create_ftransfer_requests(Array *a_ftrq, size_t *f_size, uint16_t id)
+int8_t handle_download_packet(Transfer *transfer, ServerRQ *serverrq,
+			      size_t nbytes, SA_IN6 *from)
 {
-	/* Récuperation du path complet du fichier enregistré
-	 * lors du traitement de la requête TCP. */
-	char *file_path = get_tranfer_file_path();
-
-	int fd;
-	if ((fd = open(file_path, O_RDONLY)) < 0) {
-		perror("open");
-		return 1;
-	}
-
-	struct stat st;
-	if (fstat(fd, &st) < 0) {
-		perror("stat");
-		return 1;
-	}
-
-	*f_size = (size_t) st.st_size;
+	if (serverrq->type == FTFIN) {
+		if (transfer->id != get_id(serverrq->fin.header)) {
+			logerror("Invalid Packets");
+			return 1;
+		}
 
-	char *file = NULL;
-	file = mmap(NULL, *f_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (file == NULL) {
-		perror("mmap");
-		return 1;
+		return end_transfer(transfer, serverrq->fin.count, from);
 	}
 
-	uint16_t header = (uint16_t) (UPLOAD | (id << CODERQ_BITSLEN));
-	*a_ftrq = ftransferrqs_new(header, file, st.st_size);
-	if (a_ftrq->data == NULL)
-		return 1;
-
-	munmap(file, *f_size);
-	close(fd);
-	return 0;
-}
-
-int8_t handle_download_packet(ServerRQ *serverrq, size_t nbytes)
-{
 	if (serverrq->type != DOWNLOAD) {
 		logerror("Invalid Packets");
 		return 1;
 	}
 
-	uint16_t id = get_id(serverrq->ft.header);
-	uint16_t numblock = serverrq->ft.numblock;
-	if (get_user_id() != id) {
+	if (transfer->id != get_id(serverrq->ft.header)) {
 		logerror("Invalid Packets");
 		return 1;
 	}
 
-	nbytes -= (sizeof(id) + sizeof(numblock));
-	return add_packet(numblock, serverrq->ft.data, nbytes);
+	nbytes -= CODEC_FT_HEADER_LEN;
+	return add_packet(transfer, serverrq->ft.numblock, serverrq->ft.data,
+			  nbytes, from);
 }
 
 /* -------------------------------------------------------------------------- */
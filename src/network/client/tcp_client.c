@@ -1,5 +1,7 @@
 #include "network/client/tcp_client.h"
 
+#include <poll.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,6 +10,8 @@
 #include "user/user.h"
 #include "user/user_input.h"
 
+#include "network/datagram.h"
+#include "network/file_transfer.h"
 #include "network/request.h"
 #include "network/client/data.h"
 #include "network/client/client.h"
@@ -18,6 +22,13 @@
 
 static char m_port[PORT_STRLEN];
 
+/* Connexion TCP reutilisee pendant toute la session en mode keep-alive */
+static Client     m_tcpclient;
+static RingBuffer m_ring;
+static uint8_t    m_connected  = 0;
+static uint8_t    m_keep_alive = 0;
+static uint8_t    m_framed     = 0;
+
 
 /* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
 
@@ -151,30 +162,23 @@ static void print_notif(void)
 
 /* --------------------------------------------- */
 
-static uint8_t handle_file_upload(const char *port)
+/*
+ * Ouvre la socket de l'envoi vers le serveur UDP puis le confie au thread
+ * UDP : l'utilisateur peut lancer d'autres actions pendant le transfert.
+ */
+static uint8_t start_upload(const char *port, ServerRQ_Cl *cl)
 {
-	Array a_ftrq;
-	size_t file_size = 0;
-	if (create_ftransfer_requests(&a_ftrq, &file_size, get_user_id()))
-		return 1;
-
-	/* Ici le tableau 'a_ftrq' contient tous les paquets à envoyer. */
 	Client udpclient = client_new(port, DOMAIN, SOCK_DGRAM);
-	if (connect_client(&udpclient)) {
-		array_free(&a_ftrq);
+	if (connect_client(&udpclient))
 		return 1;
-	}
 
-	if (send_ftransfer_requests(&udpclient, &a_ftrq, file_size)) {
+	if (transfer_start_upload(cl->transfer, cl->chunk, udpclient.sfd,
+				  &udpclient.addr, cl->resume, cl->first,
+				  cl->held)) {
 		close(udpclient.sfd);
-		clear_current_transfer();
-		array_free(&a_ftrq);
 		return 1;
 	}
 
-	close(udpclient.sfd);
-	clear_current_transfer();
-	array_free(&a_ftrq);
 	return 0;
 }
 
@@ -191,7 +195,7 @@ static uint8_t client_callback(ClientRQ *clientrq, ServerRQ *serverrq)
 		char port[16];
 		memset(port, 0, 16);
 		snprintf(port, 16, "%u", serverrq->cl.count);
-		if (handle_file_upload(port))
+		if (start_upload(port, &serverrq->cl))
 			return 1;
 	}
 
@@ -225,46 +229,156 @@ static uint8_t client_callback(ClientRQ *clientrq, ServerRQ *serverrq)
 	}
 
 	if (type == DOWNLOAD) {
-		signal_transfer();
+		if (transfer_start_download(serverrq->cl.transfer,
+					    serverrq->cl.chunk,
+					    serverrq->cl.resume,
+					    serverrq->cl.first))
+			return 1;
 	}
 
 	return 0;
 }
 
-static uint8_t handle_client_connection(coderq_t type)
+static void close_server_connection(void)
+{
+	if (!m_connected)
+		return;
+
+	close(m_tcpclient.sfd);
+	ring_buffer_clear(&m_ring);
+	m_connected = 0;
+	m_framed = 0;
+}
+
+/*
+ * Demande au serveur de delimiter les messages par leur taille et, en mode
+ * keep-alive, de garder la connexion ouverte. Si le serveur refuse le
+ * keep-alive, le client repasse en mode une connexion par requete.
+ */
+static uint8_t negotiate_options(void)
 {
-	d_errno = NOERROR;
-	/* create client request */
 	ClientRQ clientrq;
 	memset(&clientrq, 0, sizeof(clientrq));
 
-	clientrq.type = type;
-	if (create_request(&clientrq, get_user_id())) {
-		logerror("create_request");
+	clientrq.type = CONNOPT;
+	clientrq.cl.header = (header_t) (CONNOPT | get_user_id() << CODERQ_BITSLEN);
+	clientrq.cl.count = CONNOPT_FRAMED;
+	if (m_keep_alive)
+		clientrq.cl.count |= CONNOPT_KEEPALIVE;
+
+	if (send_client_request(&m_tcpclient, &clientrq, 0))
+		return 1;
+
+	ServerRQ *serverrq = NULL;
+	if (recv_server_request(m_tcpclient.sfd, &m_ring, 0, &serverrq))
 		return 1;
+
+	if (m_keep_alive && (serverrq->type != CONNOPT ||
+			     !(serverrq->cl.count & CONNOPT_KEEPALIVE))) {
+		debug_logerror("keep-alive refused by the server");
+		m_keep_alive = 0;
 	}
 
-	debug_clientrq(&clientrq);
+	m_framed = serverrq->type == CONNOPT &&
+		   (serverrq->cl.count & CONNOPT_FRAMED);
+
+	free(serverrq);
+	return 0;
+}
+
+/*
+ * Un transfert ne se negocie que sur une connexion a trames : ses champs
+ * binaires peuvent contenir CR, qui termine les messages sans trame.
+ */
+static uint8_t open_server_connection(coderq_t type)
+{
+	if (m_connected)
+		return 0;
+
+	m_tcpclient = client_new(m_port, DOMAIN, SOCK_STREAM);
+	if (connect_client(&m_tcpclient))
+		return 1;
+
+	m_connected = 1;
+	ring_buffer_clear(&m_ring);
+	uint8_t framed = m_keep_alive || type == UPLOAD || type == DOWNLOAD;
+	if (framed && negotiate_options()) {
+		close_server_connection();
+		return 1;
+	}
+
+	return 0;
+}
 
-	/* connect client */
-	Client tcpclient = client_new(m_port, DOMAIN, SOCK_STREAM);
-	if (connect_client(&tcpclient)) {
+/*
+ * Une connexion keep-alive reutilisee a pu etre fermee par le serveur
+ * entre deux actions. Le serveur n'envoie rien sans requete : s'il y a
+ * quelque chose a lire, c'est la fin de la connexion ou une erreur.
+ */
+static uint8_t connection_alive(void)
+{
+	struct pollfd pfd = { .fd = m_tcpclient.sfd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) < 0)
+		return 0;
+
+	return pfd.revents == 0;
+}
+
+/*
+ * Envoie la requete et recoit la reponse du serveur.
+ * La requete n'est renvoyee sur une nouvelle connexion que si son envoi
+ * sur la connexion reutilisee a echoue, donc que rien n'a ete ecrit : une
+ * requete deja recue par le serveur ne doit pas etre rejouee.
+ */
+static uint8_t exchange_request(ClientRQ *clientrq, ServerRQ **serverrq)
+{
+	if (m_connected && !connection_alive())
+		close_server_connection();
+
+	uint8_t reused = m_connected;
+	if (open_server_connection(clientrq->type)) {
 		logerror("connect_client");
 		return 1;
 	}
 
-	/* send client request */
-	if (send_client_request(&tcpclient, &clientrq)) {
+	if (send_client_request(&m_tcpclient, clientrq, m_framed)) {
+		close_server_connection();
+		if (reused)
+			return exchange_request(clientrq, serverrq);
+
 		logerror("send_client_request");
-		close(tcpclient.sfd);
 		return 1;
 	}
 
-	/* receive server request */
+	if (recv_server_request(m_tcpclient.sfd, &m_ring, m_framed, serverrq)) {
+		close_server_connection();
+		logerror("recv_server_request");
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint8_t handle_client_connection(coderq_t type)
+{
+	d_errno = NOERROR;
+	/* create client request */
+	ClientRQ clientrq;
+	memset(&clientrq, 0, sizeof(clientrq));
+
+	clientrq.type = type;
+	if (create_request(&clientrq, get_user_id())) {
+		transfer_cancel();
+		logerror("create_request");
+		return 1;
+	}
+
+	debug_clientrq(&clientrq);
+
+	/* send client request and receive server request */
 	ServerRQ *serverrq = NULL;
-	if (recv_server_request(tcpclient.sfd, &serverrq)) {
-		logerror("recv_server_request\n");
-		close(tcpclient.sfd);
+	if (exchange_request(&clientrq, &serverrq)) {
+		transfer_cancel();
 		return 1;
 	}
 
@@ -273,13 +387,19 @@ static uint8_t handle_client_connection(coderq_t type)
 	/* Give back information to the user */
 	/* And process the server respond */
 	print_server_answer(serverrq->type, serverrq);
-	if (client_callback(&clientrq, serverrq)) {
+	uint8_t err = client_callback(&clientrq, serverrq);
+
+	/* Un transfert refuse par le serveur ne demarre jamais */
+	transfer_cancel();
+	free(serverrq);
+	if (err) {
 		perror("client_callback");
 		return 1;
 	}
 
-	free(serverrq);
-	close(tcpclient.sfd);
+	if (!m_keep_alive)
+		close_server_connection();
+
 	return 0;
 }
 
@@ -367,9 +487,15 @@ static uint8_t client_action(void)
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
-uint8_t tcp_client_init(const char *port)
+uint8_t tcp_client_init(const char *port, uint8_t keep_alive)
 {
 	strncpy(m_port, port, PORT_STRLEN);
+	m_keep_alive = keep_alive;
+
+	if (ring_buffer_new(&m_ring, RECV_RING_SIZE)) {
+		perror("ring_buffer_new");
+		return 1;
+	}
 
 	return 0;
 }
@@ -1,11 +1,16 @@
 #include "network/client/udp_client.h"
 
+#include <errno.h>
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "data_structures/array.h"
+
+#include "network/datagram.h"
 #include "network/request.h"
+#include "network/send_window.h"
 
 #include "network/client/data.h"
 #include "network/client/network.h"
@@ -13,79 +18,215 @@
 
 #include "system/logger.h"
 
-static struct pollfd fds;
+/*
+ * Transferts en cours ('Transfer *'), envois et telechargements, servis
+ * ensemble par ce thread. Seul ce thread y touche.
+ */
+static Array m_transfers;
+
+/* 'struct pollfd' : le reveil puis la socket de chaque transfert */
+static Array m_fds;
+
+/* Les donnees des paquets recus y restent jusqu'a leur copie */
+static char m_packet[DGRAM_RECV_MAX];
 
 
 /* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
 
-static int8_t handle_ready_fds(void)
+static Transfer *get_transfer(size_t i)
 {
-	ServerRQ serverrq;
-	ssize_t nbytes;
-	int8_t err;
+	return ((Transfer **) m_transfers.data)[i];
+}
 
-	memset(&serverrq, 0, sizeof(serverrq));
-	if (!(fds.revents & POLLIN))
-		return 1;
+/*
+ * Traite les paquets d'une reception, plusieurs si le noyau les a
+ * coalesces. Retourne 1 tant que le telechargement continue.
+ */
+static int8_t handle_packets(Transfer *transfer, size_t nbytes,
+			     size_t segment, SA_IN6 *from)
+{
+	transfer->stats.syscalls++;
+	transfer->stats.messages++;
 
-	while (1) {
-		nbytes = recv_datagrams(fds.fd, &serverrq);
-		if (nbytes < 0 && SBLOCK)
-			return 1;
+	for (size_t offset = 0; offset < nbytes; offset += segment) {
+		size_t size = nbytes - offset < segment ? nbytes - offset : segment;
 
-		if (nbytes < 0)
-			return -1;
+		transfer->stats.packets++;
+		ServerRQ serverrq;
+		memset(&serverrq, 0, sizeof(serverrq));
+		if (decode_datagram(m_packet + offset, size, &serverrq))
+			continue;
 
-		err = handle_download_packet(&serverrq, (size_t) nbytes);
-		if (err != 1) {
-			reset_transfer_socket();
+		int8_t err = handle_download_packet(transfer, &serverrq, size,
+						    from);
+		if (err != 1)
 			return err;
+	}
+
+	return 1;
+}
+
+static int8_t receive_download(Transfer *transfer, short revents)
+{
+	SA_IN6 from;
+	size_t segment;
+
+	if (revents & POLLIN) {
+		while (1) {
+			ssize_t nbytes = recv_datagrams(transfer->sfd, m_packet,
+							sizeof(m_packet),
+							&segment, &from);
+			if (nbytes < 0 && SBLOCK)
+				break;
+
+			if (nbytes < 0)
+				return -1;
+
+			int8_t err = handle_packets(transfer, (size_t) nbytes,
+						    segment, &from);
+			if (err != 1)
+				return err;
 		}
 	}
+
+	/* Le serveur ne repond plus */
+	time_t now = time(NULL);
+	if (difftime(now, transfer->infos.activity) > FT_TIMEOUT_SEC)
+		return -1;
+
+	return 1;
 }
 
-static int8_t handle_download(void)
+static int8_t send_upload(Transfer *transfer)
 {
-	int timeout = 1000 * FT_TIMEOUT_SEC;
+	SendWindow *window = &transfer->window;
+	if (send_window_read_acks(window, transfer->sfd) < 0)
+		return -1;
 
-	if (check_transfer_timeout())
+	if (window->done)
 		return 0;
 
-	switch (poll(&fds, 1, timeout)) {
-	case -1:
-		perror("poll");
+	if (send_window_timeout(window))
 		return -1;
 
-	case 0:
-		close(fds.fd);
-		reset_transfer_socket();
-		return 0;
+	if (send_window_pump(window, transfer->sfd, &transfer->addr,
+			     dgram_batch()) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* Delai avant que l'un des transferts ait quelque chose a faire, en ms */
+static int next_timeout(void)
+{
+	int timeout = -1;
+	time_t now = time(NULL);
+
+	for (size_t i = 0; i < m_transfers.length; i++) {
+		Transfer *transfer = get_transfer(i);
+		int wait;
+		if (transfer->upload) {
+			SendWindow *window = &transfer->window;
+			wait = send_window_ready(window) ? 0 :
+			       send_window_wait(window);
+		} else {
+			/* Le delai d'expiration est verifie a la seconde */
+			time_t end = transfer->infos.activity +
+				     FT_TIMEOUT_SEC + 1;
+			wait = end > now ? (int) (end - now) * 1000 : 0;
+		}
+
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+
+	return timeout;
+}
+
+static void transfer_end(size_t i, int8_t err)
+{
+	Transfer *transfer = get_transfer(i);
+	const char *kind = transfer->upload ? "upload" : "download";
+	DgramStats *stats = transfer->upload ? &transfer->window.stats :
+			    &transfer->stats;
+
+	if (err < 0)
+		logerror("%s %u failed", kind, transfer->id);
+	else
+		debug_log("%s %u: %zu packets, %zu datagrams, %zu calls, "
+			  "%.1f packets per call", kind, transfer->id,
+			  stats->packets, stats->messages, stats->syscalls,
+			  dgram_segments_per_call(stats));
+
+	transfer_close(transfer);
+
+	/* Le dernier prend sa place, l'ordre des transferts n'importe pas */
+	Transfer **transfers = m_transfers.data;
+	transfers[i] = transfers[--m_transfers.length];
+}
 
-	default:
-		return handle_ready_fds();
+/* Prend les transferts demarres par le thread TCP */
+static uint8_t take_transfers(void)
+{
+	Transfer *transfer;
+	while ((transfer = transfer_take()) != NULL) {
+		if (m_transfers.append(&m_transfers, &transfer)) {
+			transfer_close(transfer);
+			return 1;
+		}
 	}
+
+	return 0;
+}
+
+static uint8_t refresh_poll(void)
+{
+	m_fds.length = 0;
+
+	struct pollfd pfd = { .fd = transfer_wakeup_fd(), .events = POLLIN };
+	if (m_fds.append(&m_fds, &pfd))
+		return 1;
+
+	for (size_t i = 0; i < m_transfers.length; i++) {
+		pfd.fd = get_transfer(i)->sfd;
+		if (m_fds.append(&m_fds, &pfd))
+			return 1;
+	}
+
+	return 0;
 }
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
 void *udp_client_loop(__attribute__((unused)) void *arg)
 {
-	int8_t err;
+	if (array_new(&m_transfers, sizeof(Transfer *), 0) ||
+	    array_new(&m_fds, sizeof(struct pollfd), 0))
+		return NULL;
 
 	while (1) {
-		int sfd = wait_transfer();
-
-		fds.fd = sfd;
-		fds.events = POLLIN;
+		if (take_transfers() || refresh_poll())
+			return NULL;
+
+		struct pollfd *fds = m_fds.data;
+		if (poll(fds, m_fds.length, next_timeout()) < 0 &&
+		    errno != EINTR) {
+			perror("poll");
+			return NULL;
+		}
 
-		while (1) {
-			err = handle_download();
-			if (err == -1)
-				return NULL;
-			else if (err == 0)
-				break;
+		/* A rebours : un transfert fini est remplace par le dernier */
+		for (size_t i = m_transfers.length; i-- > 0;) {
+			Transfer *transfer = get_transfer(i);
+			int8_t err = transfer->upload ? send_upload(transfer) :
+				     receive_download(transfer,
+						      fds[i + 1].revents);
+			if (err != 1)
+				transfer_end(i, err);
 		}
 	}
+
+	return NULL;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -0,0 +1,277 @@
+/**
+ * @file codec.c
+ * @brief Implementation of the shared request codec.
+ */
+
+#include "network/codec.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+
+#define U8(type, field) \
+	{ FIELD_U8, offsetof(type, field), 1, 0 }
+#define U16(type, field) \
+	{ FIELD_U16, offsetof(type, field), 2, 0 }
+#define U32(type, field) \
+	{ FIELD_U32, offsetof(type, field), 4, 0 }
+#define BYTES(type, field, n) \
+	{ FIELD_BYTES, offsetof(type, field), n, 0 }
+#define VARBYTES(type, field, n, lenfield) \
+	{ FIELD_VARBYTES, offsetof(type, field), n, offsetof(type, lenfield) }
+
+#define MESSAGE(name, fields) \
+	{ name, fields, sizeof(fields) / sizeof(fields[0]) }
+
+/* ---------------------------- MESSAGES LAYOUTS ---------------------------- */
+
+static const FieldDesc m_client_rg[] = {
+	U16(ClientRQ_Rg, header),
+	BYTES(ClientRQ_Rg, pseudo, PSEUDO_LEN),
+};
+
+static const FieldDesc m_client_cl[] = {
+	U16(ClientRQ_Cl, header),
+	U16(ClientRQ_Cl, feed_number),
+	U16(ClientRQ_Cl, count),
+	U8(ClientRQ_Cl, datalen),
+	VARBYTES(ClientRQ_Cl, data, MAX_DATALEN, datalen),
+};
+
+/* Sans jeton de reprise, le transfert part du debut */
+static const FieldDesc m_client_ft[] = {
+	U16(ClientRQ_Cl, header),
+	U16(ClientRQ_Cl, feed_number),
+	U16(ClientRQ_Cl, count),
+	U8(ClientRQ_Cl, datalen),
+	VARBYTES(ClientRQ_Cl, data, MAX_DATALEN, datalen),
+	U16(ClientRQ_Cl, chunk),
+};
+
+/* Un pair sans reprise s'arrete a chunk, les champs suivants sont ignores */
+static const FieldDesc m_client_rs[] = {
+	U16(ClientRQ_Cl, header),
+	U16(ClientRQ_Cl, feed_number),
+	U16(ClientRQ_Cl, count),
+	U8(ClientRQ_Cl, datalen),
+	VARBYTES(ClientRQ_Cl, data, MAX_DATALEN, datalen),
+	U16(ClientRQ_Cl, chunk),
+	U32(ClientRQ_Cl, resume),
+	U32(ClientRQ_Cl, first),
+	BYTES(ClientRQ_Cl, held, FT_ACK_BITS / 8),
+};
+
+static const FieldDesc m_server_cl[] = {
+	U16(ServerRQ_Cl, header),
+	U16(ServerRQ_Cl, feed_number),
+	U16(ServerRQ_Cl, count),
+};
+
+static const FieldDesc m_server_ft[] = {
+	U16(ServerRQ_Cl, header),
+	U16(ServerRQ_Cl, feed_number),
+	U16(ServerRQ_Cl, count),
+	U16(ServerRQ_Cl, chunk),
+	U16(ServerRQ_Cl, transfer),
+};
+
+static const FieldDesc m_server_rs[] = {
+	U16(ServerRQ_Cl, header),
+	U16(ServerRQ_Cl, feed_number),
+	U16(ServerRQ_Cl, count),
+	U16(ServerRQ_Cl, chunk),
+	U16(ServerRQ_Cl, transfer),
+	U32(ServerRQ_Cl, resume),
+	U32(ServerRQ_Cl, first),
+	BYTES(ServerRQ_Cl, held, FT_ACK_BITS / 8),
+};
+
+static const FieldDesc m_server_lp[] = {
+	U16(ServerRQ_Lp, feed_number),
+	BYTES(ServerRQ_Lp, creator, PSEUDO_LEN),
+	BYTES(ServerRQ_Lp, pseudo, PSEUDO_LEN),
+	U8(ServerRQ_Lp, datalen),
+	VARBYTES(ServerRQ_Lp, data, MAX_DATALEN, datalen),
+};
+
+static const FieldDesc m_server_sb[] = {
+	U16(ServerRQ_Sb, header),
+	U16(ServerRQ_Sb, feed_number),
+	U16(ServerRQ_Sb, count),
+	BYTES(ServerRQ_Sb, addr, ADDRMULT_LEN),
+};
+
+static const FieldDesc m_server_nt[] = {
+	U16(ServerRQ_Nt, header),
+	U16(ServerRQ_Nt, feed_number),
+	BYTES(ServerRQ_Nt, pseudo, PSEUDO_LEN),
+	BYTES(ServerRQ_Nt, data, NT_DATA_LEN),
+};
+
+static const FieldDesc m_ft_header[] = {
+	U16(FTransferRQ, header),
+	U32(FTransferRQ, numblock),
+};
+
+static const FieldDesc m_ft_ack[] = {
+	U16(FTransferAck, header),
+	U32(FTransferAck, base),
+	U32(FTransferAck, last),
+	U8(FTransferAck, flags),
+	BYTES(FTransferAck, bitmap, FT_ACK_BITS / 8),
+};
+
+static const FieldDesc m_ft_fin[] = {
+	U16(FTransferFin, header),
+	U32(FTransferFin, count),
+};
+
+static const MessageDesc m_messages[MSG_KIND_COUNT] = {
+	[MSG_CLIENT_RG] = MESSAGE("ClientRQ_Rg", m_client_rg),
+	[MSG_CLIENT_CL] = MESSAGE("ClientRQ_Cl", m_client_cl),
+	[MSG_CLIENT_FT] = MESSAGE("ClientRQ_Ft", m_client_ft),
+	[MSG_CLIENT_RS] = MESSAGE("ClientRQ_Rs", m_client_rs),
+	[MSG_SERVER_CL] = MESSAGE("ServerRQ_Cl", m_server_cl),
+	[MSG_SERVER_FT] = MESSAGE("ServerRQ_Ft", m_server_ft),
+	[MSG_SERVER_RS] = MESSAGE("ServerRQ_Rs", m_server_rs),
+	[MSG_SERVER_LP] = MESSAGE("ServerRQ_Lp", m_server_lp),
+	[MSG_SERVER_SB] = MESSAGE("ServerRQ_Sb", m_server_sb),
+	[MSG_SERVER_NT] = MESSAGE("ServerRQ_Nt", m_server_nt),
+	[MSG_FT_HEADER] = MESSAGE("FTransferRQ", m_ft_header),
+	[MSG_FT_ACK]    = MESSAGE("FTransferAck", m_ft_ack),
+	[MSG_FT_FIN]    = MESSAGE("FTransferFin", m_ft_fin),
+};
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* Taille sur le fil d'un champ, d'apres le message deja rempli */
+static size_t field_size(const FieldDesc *field, const char *msg)
+{
+	if (field->kind == FIELD_VARBYTES)
+		return (size_t) *(const uint8_t *) (msg + field->len_offset);
+
+	return field->len;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+size_t codec_size(MessageKind kind, const void *msg)
+{
+	const MessageDesc *desc = &m_messages[kind];
+	size_t size = 0;
+
+	for (size_t i = 0; i < desc->nfields; i++)
+		size += field_size(&desc->fields[i], msg);
+
+	return size;
+}
+
+size_t codec_encode(MessageKind kind, const void *msg, char *dst, size_t cap)
+{
+	const MessageDesc *desc = &m_messages[kind];
+	const char *src = msg;
+	size_t size = 0;
+
+	for (size_t i = 0; i < desc->nfields; i++) {
+		const FieldDesc *field = &desc->fields[i];
+		size_t len = field_size(field, src);
+
+		if (len > field->len || cap - size < len)
+			return 0;
+
+		if (field->kind == FIELD_U16) {
+			uint16_t value;
+			memcpy(&value, src + field->offset, sizeof(value));
+			value = htons(value);
+			memcpy(dst + size, &value, sizeof(value));
+		} else if (field->kind == FIELD_U32) {
+			uint32_t value;
+			memcpy(&value, src + field->offset, sizeof(value));
+			value = htonl(value);
+			memcpy(dst + size, &value, sizeof(value));
+		} else {
+			memcpy(dst + size, src + field->offset, len);
+		}
+
+		size += len;
+	}
+
+	return size;
+}
+
+size_t codec_decode(MessageKind kind, const char *src, size_t len, void *msg)
+{
+	const MessageDesc *desc = &m_messages[kind];
+	char *dst = msg;
+	size_t size = 0;
+
+	for (size_t i = 0; i < desc->nfields; i++) {
+		const FieldDesc *field = &desc->fields[i];
+
+		/* La longueur a deja ete decodee, elle precede les donnees */
+		size_t flen = field_size(field, dst);
+		if (flen > field->len || len - size < flen)
+			return 0;
+
+		if (field->kind == FIELD_U16) {
+			uint16_t value;
+			memcpy(&value, src + size, sizeof(value));
+			value = ntohs(value);
+			memcpy(dst + field->offset, &value, sizeof(value));
+		} else if (field->kind == FIELD_U32) {
+			uint32_t value;
+			memcpy(&value, src + size, sizeof(value));
+			value = ntohl(value);
+			memcpy(dst + field->offset, &value, sizeof(value));
+		} else {
+			memcpy(dst + field->offset, src + size, flen);
+		}
+
+		size += flen;
+	}
+
+	return size;
+}
+
+size_t codec_frame_size(MessageKind kind, const void *msg, uint8_t framed)
+{
+	size_t overhead = framed ? FRAME_HEADER_LEN : strlen(CRLF);
+	return codec_size(kind, msg) + overhead;
+}
+
+size_t codec_encode_frame(MessageKind kind, const void *msg, char *dst,
+			  size_t cap, uint8_t framed)
+{
+	if (framed) {
+		if (cap < FRAME_HEADER_LEN)
+			return 0;
+
+		size_t len = codec_encode(kind, msg, dst + FRAME_HEADER_LEN,
+					  cap - FRAME_HEADER_LEN);
+		if (len == 0 || len > UINT16_MAX)
+			return 0;
+
+		uint16_t flen = htons((uint16_t) len);
+		memcpy(dst, &flen, sizeof(flen));
+		return FRAME_HEADER_LEN + len;
+	}
+
+	size_t len = codec_encode(kind, msg, dst, cap);
+	if (len == 0 || cap - len < strlen(CRLF))
+		return 0;
+
+	memcpy(dst + len, CRLF, strlen(CRLF));
+	return len + strlen(CRLF);
+}
+
+header_t codec_header(const char *src, size_t len)
+{
+	header_t hd;
+	if (len < sizeof(hd))
+		return 0;
+
+	memcpy(&hd, src, sizeof(hd));
+	return ntohs(hd);
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,417 @@
+/**
+ * @file datagram.c
+ * @brief Implementation of the batched UDP sends and receives.
+ */
+
+#include "network/datagram.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/udp.h>
+
+#include "network/codec.h"
+
+#include "system/logger.h"
+
+
+/*
+ * Place des donnees annexes d'un emplacement : le compteur SO_RXQ_OVFL
+ * et la taille des paquets coalesces par GRO
+ */
+#define DGRAM_CONTROL_LEN   (CMSG_SPACE(sizeof(uint32_t)) + \
+			     CMSG_SPACE(sizeof(int)))
+
+/* Donnees annexes d'un envoi GSO : la taille des segments */
+#define DGRAM_GSO_CONTROL_LEN CMSG_SPACE(sizeof(uint16_t))
+
+/* Fixees au demarrage, avant le lancement des threads */
+static size_t m_batch = DGRAM_BATCH_DEFAULT;
+static uint8_t m_offload = 0;
+
+/* Segmentation des envois, coupee des que le noyau la refuse */
+static atomic_bool m_gso = 0;
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* Cherche une donnee annexe d'un message, retourne 1 si elle est presente */
+static uint8_t read_cmsg(struct msghdr *msg, int level, int type,
+			 void *value, size_t size)
+{
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == level && cmsg->cmsg_type == type) {
+			memcpy(value, CMSG_DATA(cmsg), size);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Taille des paquets d'un datagramme recu de len octets */
+static size_t read_segment(struct msghdr *msg, size_t len)
+{
+	int segment;
+	if (read_cmsg(msg, SOL_UDP, UDP_GRO, &segment, sizeof(segment)) &&
+	    segment > 0)
+		return (size_t) segment;
+
+	return len;
+}
+
+/* Paquets de packet octets portes par un super-datagramme, 1 sans GSO */
+static size_t gso_segments(size_t packet)
+{
+	if (!atomic_load(&m_gso))
+		return 1;
+
+	size_t segments = DGRAM_RECV_MAX / packet;
+	if (segments > DGRAM_GSO_SEGMENTS)
+		segments = DGRAM_GSO_SEGMENTS;
+
+	return segments > 1 ? segments : 1;
+}
+
+/*
+ * Erreurs d'un envoi segmente qui viennent du GSO lui-meme : noyau trop
+ * ancien, interface sans calcul de somme de controle, segment plus grand
+ * que la MTU du chemin.
+ */
+static uint8_t is_gso_error(int err)
+{
+	return err == EIO || err == EINVAL || err == EOPNOTSUPP ||
+	       err == ENOPROTOOPT || err == EMSGSIZE;
+}
+
+/*
+ * Envoie les blocs regroupes par segments : un message porte au plus
+ * 'segments' blocs pleins, un bloc court termine son message.
+ */
+static uint8_t send_blocks(int sfd, SA_IN6 *addr, header_t header,
+			   FileMap *file, size_t chunk, const size_t *blocks,
+			   size_t count, size_t segments, DgramStats *stats)
+{
+	char hd[count][CODEC_FT_HEADER_LEN];
+	struct iovec iov[count][2];
+	struct mmsghdr msgs[count];
+	char control[count][DGRAM_GSO_CONTROL_LEN];
+	memset(msgs, 0, sizeof(msgs));
+	memset(control, 0, sizeof(control));
+
+	size_t nmsgs = 0;
+	for (size_t j = 0; j < count; j++) {
+		size_t offset = blocks[j] * chunk;
+		size_t len = file->size - offset;
+		if (len > chunk)
+			len = chunk;
+
+		FTransferRQ ftrq;
+		ftrq.header = header;
+		ftrq.numblock = (uint32_t) (blocks[j] + 1);
+		codec_encode(MSG_FT_HEADER, &ftrq, hd[j], sizeof(hd[j]));
+
+		/* Les donnees partent des pages du fichier, sans copie */
+		iov[j][0].iov_base = hd[j];
+		iov[j][0].iov_len = sizeof(hd[j]);
+		iov[j][1].iov_base = len ? file->data + offset : NULL;
+		iov[j][1].iov_len = len;
+
+		/* Les iovec des blocs d'un message se suivent dans le tableau */
+		struct msghdr *hdr = &msgs[nmsgs].msg_hdr;
+		if (hdr->msg_iovlen == 0) {
+			hdr->msg_name = addr;
+			hdr->msg_namelen = sizeof(*addr);
+			hdr->msg_iov = iov[j];
+		}
+		hdr->msg_iovlen += 2;
+
+		if (hdr->msg_iovlen == 2 * segments || len < chunk ||
+		    j + 1 == count)
+			nmsgs++;
+	}
+
+	for (size_t i = 0; i < nmsgs; i++) {
+		struct msghdr *hdr = &msgs[i].msg_hdr;
+		if (hdr->msg_iovlen == 2)
+			continue;
+
+		/* Le noyau decoupe le message en paquets d'un bloc */
+		hdr->msg_control = control[i];
+		hdr->msg_controllen = sizeof(control[i]);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+		uint16_t size = (uint16_t) DGRAM_PACKET_SIZE(chunk);
+		memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+	}
+
+	if (dgram_send(sfd, msgs, nmsgs, stats))
+		return 1;
+
+	/* dgram_send compte un paquet par message */
+	if (stats != NULL)
+		stats->packets += count - nmsgs;
+
+	return 0;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+void dgram_set_batch(size_t batch)
+{
+	if (batch < 1)
+		batch = 1;
+	if (batch > DGRAM_BATCH_MAX)
+		batch = DGRAM_BATCH_MAX;
+
+	m_batch = batch;
+}
+
+size_t dgram_batch(void)
+{
+	return m_batch;
+}
+
+void dgram_set_offload(uint8_t offload)
+{
+	m_offload = offload;
+	atomic_store(&m_gso, offload != 0);
+}
+
+uint8_t dgram_enable_gro(int sfd)
+{
+	if (!m_offload)
+		return 0;
+
+	int optv = 1;
+	if (setsockopt(sfd, SOL_UDP, UDP_GRO, &optv, sizeof(optv)) < 0)
+		return 1;
+
+	return 0;
+}
+
+double dgram_segments_per_call(const DgramStats *stats)
+{
+	if (stats->syscalls == 0)
+		return 0;
+
+	return (double) stats->packets / (double) stats->syscalls;
+}
+
+uint8_t dgram_send(int sfd, struct mmsghdr *msgs, size_t count,
+		   DgramStats *stats)
+{
+	size_t sent = 0;
+	while (sent < count) {
+		size_t n = count - sent;
+		if (n > m_batch)
+			n = m_batch;
+
+		int ret = sendmmsg(sfd, msgs + sent, (unsigned int) n, 0);
+		if (stats != NULL)
+			stats->syscalls++;
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		/* Envoi partiel : on reprend au premier message non parti */
+		sent += (size_t) ret;
+		if (stats != NULL) {
+			stats->packets += (size_t) ret;
+			stats->messages += (size_t) ret;
+		}
+	}
+
+	return 0;
+}
+
+uint8_t dgram_send_blocks(int sfd, SA_IN6 *addr, header_t header,
+			  FileMap *file, size_t chunk, const size_t *blocks,
+			  size_t count, DgramStats *stats)
+{
+	if (count == 0)
+		return 0;
+
+	size_t segments = gso_segments(DGRAM_PACKET_SIZE(chunk));
+	if (!send_blocks(sfd, addr, header, file, chunk, blocks, count,
+			 segments, stats))
+		return 0;
+
+	if (segments == 1 || !is_gso_error(errno))
+		return 1;
+
+	/*
+	 * Segmentation refusee : elle est coupee pour tous les transferts et
+	 * les blocs repartent un par un. Ceux deja partis sont des doublons,
+	 * le receveur les ignore.
+	 */
+	if (atomic_exchange(&m_gso, 0))
+		logerror("UDP segmentation offload unavailable (%s), "
+			 "falling back to one datagram per block",
+			 strerror(errno));
+
+	return send_blocks(sfd, addr, header, file, chunk, blocks, count, 1,
+			   stats);
+}
+
+uint8_t dgram_send_ack(int sfd, SA_IN6 *addr, FTransferAck *ack,
+		       uint8_t copies)
+{
+	char buf[CODEC_MSG_MAX];
+	size_t len = codec_encode(MSG_FT_ACK, ack, buf, sizeof(buf));
+	if (len == 0)
+		return 1;
+
+	/* Un acquittement perdu est remplace par le suivant, pas de reprise */
+	for (uint8_t i = 0; i < copies; i++) {
+		if (sendto(sfd, buf, len, 0, (SA *) addr, sizeof(*addr)) < 0 &&
+		    errno != EAGAIN)
+			return 1;
+	}
+
+	return 0;
+}
+
+uint8_t dgram_slots_new(DgramSlots *slots, size_t count, size_t size)
+{
+	memset(slots, 0, sizeof(*slots));
+
+	/* Un emplacement recoit les paquets coalesces d'un seul bloc */
+	if (m_offload)
+		size = DGRAM_RECV_MAX;
+
+	slots->bufs = malloc(count * size);
+	slots->control = malloc(count * DGRAM_CONTROL_LEN);
+	slots->addrs = malloc(count * sizeof(*slots->addrs));
+	slots->segments = malloc(count * sizeof(*slots->segments));
+	slots->iov = malloc(count * sizeof(*slots->iov));
+	slots->msgs = malloc(count * sizeof(*slots->msgs));
+	if (slots->bufs == NULL || slots->control == NULL ||
+	    slots->addrs == NULL || slots->segments == NULL ||
+	    slots->iov == NULL || slots->msgs == NULL) {
+		dgram_slots_free(slots);
+		return 1;
+	}
+
+	slots->count = count;
+	slots->size = size;
+	for (size_t i = 0; i < count; i++) {
+		slots->iov[i].iov_base = slots->bufs + i * size;
+		slots->iov[i].iov_len = size;
+	}
+
+	return 0;
+}
+
+void dgram_slots_free(DgramSlots *slots)
+{
+	free(slots->bufs);
+	free(slots->control);
+	free(slots->addrs);
+	free(slots->segments);
+	free(slots->iov);
+	free(slots->msgs);
+	memset(slots, 0, sizeof(*slots));
+}
+
+uint8_t dgram_enable_drop_count(int sfd)
+{
+	int optv = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_RXQ_OVFL, &optv, sizeof(optv)) < 0)
+		return 1;
+
+	return 0;
+}
+
+int dgram_recv(int sfd, DgramSlots *slots, uint32_t *dropped)
+{
+	*dropped = 0;
+
+	/* Le noyau modifie les en-tetes, ils sont remis a zero a chaque appel */
+	memset(slots->msgs, 0, slots->count * sizeof(*slots->msgs));
+	for (size_t i = 0; i < slots->count; i++) {
+		struct msghdr *hdr = &slots->msgs[i].msg_hdr;
+		hdr->msg_iov = &slots->iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = slots->control + i * DGRAM_CONTROL_LEN;
+		hdr->msg_controllen = DGRAM_CONTROL_LEN;
+		hdr->msg_name = &slots->addrs[i];
+		hdr->msg_namelen = sizeof(slots->addrs[i]);
+	}
+
+	/* Bloque jusqu'au premier datagramme, prend ensuite ceux deja arrives */
+	int n = recvmmsg(sfd, slots->msgs, (unsigned int) slots->count,
+			 MSG_WAITFORONE, NULL);
+	if (n <= 0)
+		return n < 0 ? -1 : 0;
+
+	slots->stats.syscalls++;
+	slots->stats.messages += (size_t) n;
+	for (int i = 0; i < n; i++) {
+		size_t len = slots->msgs[i].msg_len;
+		size_t segment = read_segment(&slots->msgs[i].msg_hdr, len);
+
+		slots->segments[i] = segment;
+		slots->stats.packets += len > segment ?
+					(len + segment - 1) / segment : 1;
+	}
+
+	/*
+	 * Le compteur est cumulatif et n'est joint qu'une fois non nul, le
+	 * dernier message porte la valeur la plus recente.
+	 */
+	uint32_t count;
+	if (read_cmsg(&slots->msgs[n - 1].msg_hdr, SOL_SOCKET, SO_RXQ_OVFL,
+		      &count, sizeof(count))) {
+		*dropped = count - slots->drops;
+		slots->drops = count;
+	}
+
+	return n;
+}
+
+char *dgram_slot(DgramSlots *slots, size_t i, size_t *len, size_t *segment,
+		 SA_IN6 **from)
+{
+	if (slots->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+		return NULL;
+
+	*len = slots->msgs[i].msg_len;
+	*segment = slots->segments[i];
+	if (from != NULL)
+		*from = &slots->addrs[i];
+	return slots->iov[i].iov_base;
+}
+
+ssize_t dgram_recv_one(int sfd, char *buf, size_t cap, size_t *segment,
+		       SA_IN6 *from)
+{
+	char control[DGRAM_CONTROL_LEN];
+	struct iovec iov = { buf, cap };
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof(*from);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t nbytes = recvmsg(sfd, &msg, 0);
+	if (nbytes < 0)
+		return nbytes;
+
+	*segment = read_segment(&msg, (size_t) nbytes);
+	return nbytes;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -1,27 +1,126 @@
 #include "network/file_transfer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "network/request_macros.h"
 
 
-FileTransferInfos transfer_init(const char *file_name, uint16_t feed_number)
+/* "FTCK" : point de reprise d'un transfert */
+#define CHECKPOINT_MAGIC 0x4654434bu
+
+/* Fixee au demarrage, avant le lancement des threads */
+static size_t m_chunk_max = FT_CHUNK_MAX;
+
+/* En-tete d'un point de reprise, suivi des mots du bitmap des blocs */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t token;
+	uint16_t owner;
+	uint16_t feed_number;
+	uint32_t chunk;
+	uint64_t last;
+	uint64_t size;
+	uint64_t words;
+	char file_name[MAX_DATALEN];
+} Checkpoint;
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* Jeton non nul, 0 signifie sans reprise */
+static uint32_t token_fix(uint32_t token)
+{
+	return token == 0 ? 1 : token;
+}
+
+static size_t chunk_fix(size_t chunk)
+{
+	return chunk - chunk % FT_CHUNK_ALIGN;
+}
+
+static uint8_t read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= (size_t) n;
+	}
+
+	return 0;
+}
+
+static uint8_t write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= (size_t) n;
+	}
+
+	return 0;
+}
+
+/* Rejoue les blocs du bitmap dans la reconstitution vide de infos */
+static uint8_t replay_blocks(FileTransferInfos *infos, Checkpoint *ck,
+			     uint64_t *words)
+{
+	Reassembly *r = &infos->blocks;
+	size_t last = (size_t) ck->last;
+
+	/* Le dernier bloc d'abord, il est court et fixe la taille */
+	if (last != 0 && (words[(last - 1) / 64] >> ((last - 1) % 64)) & 1) {
+		size_t len = (size_t) ck->size - (last - 1) * r->block_size;
+		if (r->insert(r, last - 1, NULL, len, 1) != 1)
+			return 1;
+	}
+
+	for (size_t w = 0; w < ck->words; w++) {
+		for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1) {
+			size_t i = w * 64 + (size_t) __builtin_ctzll(bits);
+			if (last != 0 && i + 1 == last)
+				continue;
+			if (r->insert(r, i, NULL, r->block_size, 0) != 1)
+				return 1;
+		}
+	}
+
+	if (last != 0 && r->expect(r, last))
+		return 1;
+
+	infos->fin = last != 0;
+	return 0;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+
+FileTransferInfos transfer_init(const char *file_name, uint16_t feed_number,
+				size_t chunk, uint8_t store)
 {
 	FileTransferInfos infos;
 	memset(&infos, 0, sizeof(infos));
 
 	infos.active = 1;
 	infos.begin = time(NULL);
+	infos.activity = infos.begin;
 
 	memcpy(infos.file_path, file_name, MAX_DATALEN);
 	infos.feed_number = feed_number;
 
-	array_new(&infos.file_data, FILE_PACKET_SIZE, 0);
-	infos.last_packet = 0;
-	infos.file_size = 0;
+	reassembly_new(&infos.blocks, chunk, store);
+	infos.fd = -1;
 
 	return infos;
 }
@@ -38,13 +137,269 @@ uint8_t file_exist(char *file_name, uint16_t feed_number)
 		return 0;
 
 	close(fd);
-	memcpy(file_name, path_file, strlen(path_file));
+	memcpy(file_name, path_file, strlen(path_file) + 1);
 	return 1;
 }
 
 
 void transfer_clear(FileTransferInfos *infos)
 {
-	array_free(&infos->file_data);
+	/* Un envoi inacheve ne laisse pas de fichier partiel */
+	if (infos->active && infos->fd >= 0) {
+		close(infos->fd);
+		unlink(infos->tmp_path);
+	}
+
+	reassembly_free(&infos->blocks);
 	memset(infos, 0, sizeof(*infos));
+	infos->fd = -1;
+}
+
+
+uint8_t transfer_done(FileTransferInfos *infos)
+{
+	return infos->fin && infos->blocks.complete(&infos->blocks);
+}
+
+
+uint8_t transfer_ack_due(FileTransferInfos *infos, uint8_t fin)
+{
+	infos->activity = time(NULL);
+	infos->unacked++;
+
+	if (transfer_done(infos))
+		return FT_ACK_REPEAT;
+
+	/* Meme volume entre deux ACK quelle que soit la taille des blocs */
+	size_t every = FT_ACK_EVERY * FT_CHUNK_MIN / infos->blocks.block_size;
+	if (!fin && infos->unacked < every)
+		return 0;
+
+	infos->unacked = 0;
+	return 1;
+}
+
+
+void transfer_ack_new(FileTransferInfos *infos, header_t header,
+		      FTransferAck *ack)
+{
+	Reassembly *blocks = &infos->blocks;
+
+	memset(ack, 0, sizeof(*ack));
+	ack->header = header;
+	ack->base = (uint32_t) (blocks->contiguous + 1);
+	ack->last = (uint32_t) blocks->last;
+	if (transfer_done(infos))
+		ack->flags |= FTACK_COMPLETE;
+
+	/* Le bit 0 correspond au premier bloc manquant, toujours a 0 */
+	for (size_t i = 1; i < FT_ACK_BITS; i++) {
+		if (blocks->received.test(&blocks->received,
+					  blocks->contiguous + i))
+			ack->bitmap[i / 8] |= (uint8_t) (1 << (i % 8));
+	}
+}
+
+
+uint8_t file_map(FileMap *map, const char *path)
+{
+	memset(map, 0, sizeof(*map));
+
+	int fd;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("open");
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		close(fd);
+		return 1;
+	}
+
+	map->size = (size_t) st.st_size;
+	if (map->size > FT_FILE_MAX) {
+		close(fd);
+		return 1;
+	}
+
+	/* Un fichier vide n'a rien a projeter, seul le paquet final part */
+	if (map->size > 0) {
+		map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map->data == MAP_FAILED) {
+			perror("mmap");
+			map->data = NULL;
+			close(fd);
+			return 1;
+		}
+
+		madvise(map->data, map->size, MADV_SEQUENTIAL);
+	}
+
+	/* La projection reste valide apres la fermeture */
+	close(fd);
+	return 0;
+}
+
+
+void file_unmap(FileMap *map)
+{
+	if (map->data != NULL)
+		munmap(map->data, map->size);
+
+	memset(map, 0, sizeof(*map));
+}
+
+
+void file_set_chunk_max(size_t chunk)
+{
+	if (chunk < FT_CHUNK_MIN)
+		chunk = FT_CHUNK_MIN;
+	if (chunk > FT_CHUNK_MAX)
+		chunk = FT_CHUNK_MAX;
+
+	m_chunk_max = chunk_fix(chunk);
+}
+
+
+size_t file_chunk_max(void)
+{
+	return m_chunk_max;
+}
+
+
+uint16_t file_chunk_negotiate(uint16_t chunk)
+{
+	size_t retained = chunk < m_chunk_max ? chunk : m_chunk_max;
+	if (retained < FT_CHUNK_MIN)
+		retained = FT_CHUNK_MIN;
+
+	return (uint16_t) chunk_fix(retained);
+}
+
+
+size_t file_block_count(size_t size, size_t chunk)
+{
+	return size / chunk + 1;
+}
+
+
+uint32_t transfer_token_new(void)
+{
+	uint32_t token = (uint32_t) random() ^ ((uint32_t) random() << 16);
+	return token_fix(token);
+}
+
+
+uint32_t file_token(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0)
+		return 0;
+
+	/* FNV-1a sur ce qui change quand le fichier est remplace */
+	uint64_t fields[4] = {
+		(uint64_t) st.st_ino, (uint64_t) st.st_size,
+		(uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec
+	};
+	uint32_t hash = 2166136261u;
+	const uint8_t *bytes = (const uint8_t *) fields;
+	for (size_t i = 0; i < sizeof(fields); i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return token_fix(hash);
+}
+
+
+uint8_t transfer_checkpoint_save(FileTransferInfos *infos, const char *path)
+{
+	Reassembly *r = &infos->blocks;
+
+	Checkpoint ck;
+	memset(&ck, 0, sizeof(ck));
+	ck.magic = CHECKPOINT_MAGIC;
+	ck.token = infos->token;
+	ck.owner = infos->owner;
+	ck.feed_number = infos->feed_number;
+	ck.chunk = (uint32_t) r->block_size;
+	ck.last = r->last;
+	ck.size = r->size;
+	ck.words = (r->highest + 63) / 64;
+	memcpy(ck.file_name, infos->file_path, MAX_DATALEN);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("open: checkpoint");
+		return 1;
+	}
+
+	uint8_t err = write_all(fd, &ck, sizeof(ck)) ||
+		      write_all(fd, r->received.words,
+				(size_t) ck.words * sizeof(uint64_t));
+	close(fd);
+
+	if (err)
+		unlink(path);
+	return err;
+}
+
+
+uint8_t transfer_suspend(FileTransferInfos *infos, const char *path)
+{
+	if (infos->fd < 0 || infos->token == 0)
+		return 1;
+
+	/* Les blocs listes doivent etre sur le disque */
+	if (fdatasync(infos->fd) < 0 || transfer_checkpoint_save(infos, path))
+		return 1;
+
+	close(infos->fd);
+	infos->fd = -1;
+	return 0;
+}
+
+
+uint8_t transfer_checkpoint_load(FileTransferInfos *infos, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	Checkpoint ck;
+	uint64_t *words = NULL;
+	uint8_t err = read_all(fd, &ck, sizeof(ck)) ||
+		      ck.magic != CHECKPOINT_MAGIC || ck.chunk == 0 ||
+		      ck.words > FT_FILE_MAX / ck.chunk / 64 + 1 ||
+		      (ck.last != 0 && ck.words > (ck.last + 63) / 64);
+
+	if (!err && ck.words > 0) {
+		words = malloc((size_t) ck.words * sizeof(uint64_t));
+		err = words == NULL ||
+		      read_all(fd, words, (size_t) ck.words * sizeof(uint64_t));
+	}
+	close(fd);
+
+	if (!err) {
+		ck.file_name[MAX_DATALEN - 1] = '\0';
+
+		uint8_t store = infos->blocks.store;
+		reassembly_free(&infos->blocks);
+		err = reassembly_new(&infos->blocks, ck.chunk, store);
+		if (!err)
+			err = replay_blocks(infos, &ck, words);
+	}
+
+	if (!err) {
+		infos->token = ck.token;
+		infos->owner = ck.owner;
+		infos->feed_number = ck.feed_number;
+		memcpy(infos->file_path, ck.file_name, MAX_DATALEN);
+	}
+
+	free(words);
+	return err;
 }
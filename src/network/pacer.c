@@ -0,0 +1,142 @@
+/**
+ * @file pacer.c
+ * @brief Implementation of the token bucket pacing of the file transfers.
+ */
+
+#include "network/pacer.h"
+
+
+/* Fixes au demarrage, avant le lancement des threads */
+static uint64_t m_cap;                /* Octets par seconde, 0 sans plafond */
+static uint8_t m_adaptive = 1;
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static void set_burst(Pacer *pacer)
+{
+	pacer->burst = pacer->rate * PACER_BURST_US / 1000000;
+	if (pacer->burst < PACER_BURST_MIN * pacer->packet)
+		pacer->burst = PACER_BURST_MIN * pacer->packet;
+
+	if (pacer->tokens > pacer->burst)
+		pacer->tokens = pacer->burst;
+}
+
+static void refill(Pacer *pacer)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t ns = (now.tv_sec - pacer->refill.tv_sec) * 1000000000 +
+		     (now.tv_nsec - pacer->refill.tv_nsec);
+	if (ns > 1000000000)
+		ns = 1000000000;
+
+	/* Sans jeton entier, le temps ecoule compte pour le prochain appel */
+	uint64_t added = pacer->rate * (uint64_t) ns / 1000000000;
+	if (added == 0)
+		return;
+
+	pacer->tokens += added;
+	if (pacer->tokens > pacer->burst)
+		pacer->tokens = pacer->burst;
+	pacer->refill = now;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+void pacer_set_rate(size_t mbps)
+{
+	m_cap = (uint64_t) mbps * 125000;
+}
+
+void pacer_set_adaptive(uint8_t adaptive)
+{
+	m_adaptive = adaptive;
+}
+
+void pacer_init(Pacer *pacer, size_t packet)
+{
+	/* Sans adaptation, le plafond seul regle le debit */
+	pacer->rate = m_cap;
+	if (m_adaptive) {
+		pacer->rate = (uint64_t) PACER_RATE_INIT * 125000;
+		if (m_cap != 0 && m_cap < pacer->rate)
+			pacer->rate = m_cap;
+	}
+
+	pacer->packet = packet;
+	pacer->floor = PACER_PACKETS_MIN * (uint64_t) packet;
+	if (pacer->floor < PACER_RATE_MIN)
+		pacer->floor = PACER_RATE_MIN;
+	if (pacer->floor > pacer->rate)
+		pacer->floor = pacer->rate;
+
+	pacer->tokens = 0;
+	set_burst(pacer);
+	pacer->tokens = pacer->burst;
+	pacer->recover = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &pacer->refill);
+}
+
+size_t pacer_allow(Pacer *pacer)
+{
+	if (pacer->rate == 0)
+		return SIZE_MAX;
+
+	refill(pacer);
+	return (size_t) (pacer->tokens / pacer->packet);
+}
+
+void pacer_consume(Pacer *pacer, size_t len)
+{
+	if (pacer->rate == 0)
+		return;
+
+	pacer->tokens = pacer->tokens > len ? pacer->tokens - len : 0;
+}
+
+int pacer_wait(Pacer *pacer)
+{
+	if (pacer->rate == 0)
+		return 0;
+
+	refill(pacer);
+	if (pacer->tokens >= pacer->packet)
+		return 0;
+
+	/* Arrondi au-dessus : au reveil le paquet peut partir */
+	uint64_t missing = pacer->packet - pacer->tokens;
+	return (int) ((missing * 1000 + pacer->rate - 1) / pacer->rate);
+}
+
+void pacer_loss(Pacer *pacer, size_t seq, size_t sent)
+{
+	if (!m_adaptive || pacer->rate == 0 || seq < pacer->recover)
+		return;
+
+	pacer->rate /= 2;
+	if (pacer->rate < pacer->floor)
+		pacer->rate = pacer->floor;
+
+	pacer->recover = sent;
+	set_burst(pacer);
+}
+
+void pacer_ack(Pacer *pacer)
+{
+	if (!m_adaptive || pacer->rate == 0)
+		return;
+
+	uint64_t step = pacer->rate / PACER_GROWTH;
+	pacer->rate += step > PACER_RATE_STEP ? step : PACER_RATE_STEP;
+
+	uint64_t cap = m_cap ? m_cap : (uint64_t) PACER_RATE_MAX * 125000;
+	if (pacer->rate > cap)
+		pacer->rate = cap;
+
+	set_burst(pacer);
+}
+
+/* -------------------------------------------------------------------------- */
@@ -15,7 +15,10 @@ static const char *strrq[] = {
 	"Last posts",
 	"Subscribe",
 	"Upload",
-	"Download"
+	"Download",
+	"Connection options",
+	"Transfer ack",
+	"Transfer end"
 };
 
 char CRLF[3] = "\r\n";
@@ -44,18 +47,6 @@ static void debug_clientrqcl(ClientRQ_Cl *rq)
 
 /* ----- Server requests printer ----- */
 
-static void debug_serverrq_lp(ServerRQ_Lp *rq)
-{
-	debug_log(" NUMFIL: %u", rq->feed_number);
-
-	debug_log("CREATOR: %.*s", PSEUDO_LEN, rq->creator);
-	debug_log(" PSEUDO: %.*s", PSEUDO_LEN, rq->pseudo);
-
-	debug_log("DATALEN: %u", rq->datalen);
-	debug_log("   DATA: %.*s\n", rq->datalen, rq->data);
-}
-
-
 static void debug_serverrq_cl(ServerRQ_Cl *rq)
 {
 	debug_log("CODEREQ: %s", strcoderq(get_rq_type(rq->header)));
@@ -75,21 +66,6 @@ static void debug_serverrq_sb(ServerRQ_Sb *rq)
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
-ServerRQ_Lp serverrq_lp_new(uint16_t feed_number, pseudo_t *creator,
-			    pseudo_t *pseudo, uint8_t datalen, char *data)
-{
-	ServerRQ_Lp serverrq_lp;
-
-	serverrq_lp.feed_number = feed_number;
-	memcpy(serverrq_lp.creator, creator, PSEUDO_LEN);
-	memcpy(serverrq_lp.pseudo, pseudo, PSEUDO_LEN);
-
-	serverrq_lp.datalen = datalen;
-	memcpy(serverrq_lp.data, data, datalen);
-
-	return serverrq_lp;
-}
-
 ServerRQ_Nt serverrq_nt_new(uint16_t hd, uint16_t feed_number, pseudo_t *pseudo, char *data)
 {
 	ServerRQ_Nt serverrq_nt;
@@ -114,101 +90,82 @@ ServerRQ_Cl serverrq_error(void)
 }
 
 /*
- * Création de tous les paquets UDP à envoyer
- * contenant tous les morceaux du fichier.
+ * Cherche un message complet au debut du buffer, sans le copier.
+ * Retourne 1 s'il est trouve, 0 s'il est incomplet, -1 s'il est invalide.
  */
-Array ftransferrqs_new(header_t header, char *file, off_t file_size)
+static int8_t next_message(RingBuffer *ring, uint8_t framed,
+			   char **msg, size_t *len)
 {
-	uint16_t numblock = (uint16_t) (file_size / FILE_PACKET_SIZE) + 1;
-	if ((file_size % FILE_PACKET_SIZE) == 0 && file_size != 0)
-		numblock++;
+	size_t avail;
+	char *data = ring->readable(ring, &avail);
 
-	Array a_rqft;
-	if (array_new(&a_rqft, sizeof(FTransferRQ), numblock))
-		return a_rqft;
+	if (framed) {
+		if (avail < FRAME_HEADER_LEN)
+			return 0;
 
-	FTransferRQ *ft_rq = a_rqft.data;
-	for (uint16_t i = 0; i < numblock; i++) {
-		size_t len = FILE_PACKET_SIZE;
-		if (i == numblock - 1)
-			len = (size_t) (file_size % FILE_PACKET_SIZE);
+		uint16_t flen;
+		memcpy(&flen, data, sizeof(flen));
+		flen = ntohs(flen);
 
-		ft_rq[i].header = header;
-		ft_rq[i].numblock = i + 1;
+		/* Une trame qui ne tient pas dans le buffer ne sera jamais complete */
+		if (flen == 0 || flen > ring->size - FRAME_HEADER_LEN)
+			return -1;
 
-		memset(ft_rq[i].data, 0, FILE_PACKET_SIZE);
-		if (file_size == 0)
-			continue;
+		if (avail < FRAME_HEADER_LEN + flen)
+			return 0;
 
-		memcpy(ft_rq[i].data, file + (i * FILE_PACKET_SIZE), len);
+		*msg = data + FRAME_HEADER_LEN;
+		*len = flen;
+		ring->consume(ring, FRAME_HEADER_LEN + flen);
+		return 1;
 	}
 
-	a_rqft.length = numblock;
-	return a_rqft;
-}
+	char *end = memchr(data, CRLF[0], avail);
+	if (end == NULL)
+		return 0;
 
+	/* Il faut au moins un octet apres '\r' pour reconnaitre CRLF */
+	size_t startlen = (size_t) (end - data);
+	if (startlen + 1 >= avail)
+		return 0;
 
-uint8_t recv_request(int sfd, BytesRQ *bytes_rq, BytesRQ *rbytes_rq)
-{
-	*bytes_rq = *rbytes_rq;
-	memset(rbytes_rq, 0, sizeof(*rbytes_rq));
+	uint8_t is_crlf = (end[1] == CRLF[1]);
+	*msg = data;
+	*len = startlen;
+	ring->consume(ring, startlen + 1 + is_crlf);
+	return 1;
+}
 
+int8_t recv_request(int sfd, RingBuffer *ring, uint8_t framed,
+		    char **msg, size_t *len)
+{
 	while (1) {
-		char *end = memchr(bytes_rq->buf, CRLF[0], bytes_rq->size);
-		if (end != NULL) {
-			size_t startlen = (size_t) (end - bytes_rq->buf);
-			size_t endlen = bytes_rq->size - startlen - 1;
-
-			uint8_t is_crlf = (end[1] == CRLF[1]);
-			if (is_crlf) {
-				end++;
-				endlen--;
-			}
-
-			memcpy(rbytes_rq->buf, end + 1, endlen);
-			rbytes_rq->size = endlen;
-
-			memset(bytes_rq->buf + startlen + is_crlf, 0, endlen);
-			bytes_rq->size = startlen;
-			return 0;
-		}
+		int8_t found = next_message(ring, framed, msg, len);
+		if (found != 0)
+			return (found > 0) ? 0 : -1;
 
-		ssize_t read_size;
-		size_t len = BUFSIZ - bytes_rq->size;
+		/* Requete plus grande que le buffer, elle ne sera jamais complete */
+		size_t space;
+		char *dst = ring->writable(ring, &space);
+		if (space == 0)
+			return -1;
 
-		read_size = recv(sfd, bytes_rq->buf + bytes_rq->size, len, 0);
+		ssize_t read_size = recv(sfd, dst, space, 0);
 		if (read_size < 0 && SBLOCK)
-			return 0;
+			return 1;
 
 		if (read_size < 0) {
 			perror("recv");
-			return 1;
+			return -1;
 		}
 
 		if (read_size == 0)
-			return 0;
-
-		bytes_rq->size += (size_t) read_size;
-	}
-}
-
-void appendbuf(rq_buf_t buf, size_t *buf_size, void *elt, size_t elt_size)
-{
-	memcpy(buf + *buf_size, elt, elt_size);
-	(*buf_size) += elt_size;
-}
+			return -1;
 
-void extractbuf(char *buf, size_t *buf_size, void *elt, size_t elt_size)
-{
-	if (buf_size == NULL) {
-		memcpy(elt, buf, elt_size);
-	} else {
-		memcpy(elt, buf + *buf_size, elt_size);
-		(*buf_size) += elt_size;
+		ring->produce(ring, (size_t) read_size);
 	}
 }
 
-
 #define HEADER_MASK 0x1F
 
 coderq_t get_rq_type(header_t hd)
@@ -236,8 +193,8 @@ void debug_serverrq(ServerRQ *serverrq)
 {
 	coderq_t type = serverrq->type;
 
-	if (type == REGISTRATION || type == NEWPOST ||
-	    type == UPLOAD || type == DOWNLOAD || d_errno != NOERROR) {
+	if (type == REGISTRATION || type == NEWPOST || type == UPLOAD ||
+	    type == DOWNLOAD || type == CONNOPT || d_errno != NOERROR) {
 		debug_serverrq_cl(&serverrq->cl);
 	} else if (type == LASTPOSTS) {
 		const int maxpostprint = 10;
@@ -251,9 +208,20 @@ void debug_serverrq(ServerRQ *serverrq)
 		debug_serverrq_sb(&serverrq->sb);
 }
 
+void debug_serverrq_lp(ServerRQ_Lp *rq)
+{
+	debug_log(" NUMFIL: %u", rq->feed_number);
+
+	debug_log("CREATOR: %.*s", PSEUDO_LEN, rq->creator);
+	debug_log(" PSEUDO: %.*s", PSEUDO_LEN, rq->pseudo);
+
+	debug_log("DATALEN: %u", rq->datalen);
+	debug_log("   DATA: %.*s\n", rq->datalen, rq->data);
+}
+
 const char* strcoderq(coderq_t rq_type)
 {
-	if ((rq_type < 1 || rq_type > 6) && d_errno == NOERROR)
+	if ((rq_type < 1 || rq_type > FTFIN) && d_errno == NOERROR)
 		return NULL;
 
 	if (d_errno != NOERROR)
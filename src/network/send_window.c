@@ -0,0 +1,298 @@
+/**
+ * @file send_window.c
+ * @brief Implementation of the sender side of the reliable file transfers.
+ */
+
+#include "network/send_window.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "network/codec.h"
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static long elapsed_ms(struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000 +
+	       (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* Des blocs ou le FIN sont a envoyer sans attendre d'acquittement */
+static uint8_t has_work(SendWindow *w)
+{
+	if (w->done)
+		return 0;
+
+	return w->lost > 0 || w->fin ||
+	       (w->next < w->count && w->next < w->base + SW_WINDOW);
+}
+
+/* Le temporisateur ne tourne que si une reponse est attendue */
+static uint8_t waiting_answer(SendWindow *w)
+{
+	return !w->done && (w->base < w->next || w->next == w->count);
+}
+
+static uint8_t send_fin(SendWindow *w, int sfd, SA_IN6 *addr)
+{
+	FTransferFin fin = { w->fin_header, (uint32_t) w->count };
+
+	char buf[CODEC_MSG_MAX];
+	size_t len = codec_encode(MSG_FT_FIN, &fin, buf, sizeof(buf));
+	if (len == 0)
+		return 1;
+
+	w->stats.syscalls++;
+	if (sendto(sfd, buf, len, 0, (SA *) addr, sizeof(*addr)) < 0)
+		return errno != EAGAIN;
+
+	w->stats.packets++;
+	w->stats.messages++;
+	w->fin = 0;
+	return 0;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+void send_window_init(SendWindow *w, FileMap *file, size_t chunk,
+		      header_t header, header_t fin_header)
+{
+	memset(w, 0, sizeof(*w));
+
+	w->file = file;
+	w->chunk = chunk;
+	w->header = header;
+	w->fin_header = fin_header;
+	w->count = file_block_count(file->size, chunk);
+
+	clock_gettime(CLOCK_MONOTONIC, &w->last_ack);
+	pacer_init(&w->pacer, DGRAM_PACKET_SIZE(chunk));
+}
+
+void send_window_skip(SendWindow *w, size_t first, const uint8_t *held)
+{
+	size_t skip = 0;
+	if (first > 1)
+		skip = first - 1 < w->count ? first - 1 : w->count;
+	w->base = skip;
+	w->next = skip;
+
+	/* Le bit 0 est le premier bloc manquant, il part toujours */
+	for (size_t i = 1; i < SW_WINDOW && skip + i < w->count; i++) {
+		if (held[i / 8] & (1 << (i % 8)))
+			w->state[(skip + i) % SW_WINDOW] = SW_ACKED;
+	}
+
+	/* Plus aucun bloc a envoyer, le FIN suffit */
+	if (w->next == w->count)
+		w->fin = 1;
+}
+
+int send_window_pump(SendWindow *w, int sfd, SA_IN6 *addr, size_t quota)
+{
+	if (w->done)
+		return 0;
+
+	if (quota > SW_WINDOW)
+		quota = SW_WINDOW;
+
+	size_t allowed = pacer_allow(&w->pacer);
+	if (quota > allowed)
+		quota = allowed;
+	if (quota == 0)
+		return 0;
+
+	/* Rien en vol : le temporisateur part du premier envoi */
+	if (w->base == w->next && !w->fin)
+		clock_gettime(CLOCK_MONOTONIC, &w->last_ack);
+
+	size_t blocks[SW_WINDOW];
+	size_t n = 0;
+
+	/* Les trous d'abord, ils bloquent la fenetre du receveur */
+	for (size_t b = w->base; w->lost > 0 && b < w->next && n < quota; b++) {
+		if (w->state[b % SW_WINDOW] != SW_LOST)
+			continue;
+
+		w->lost--;
+		blocks[n++] = b;
+	}
+
+	while (n < quota && w->next < w->count &&
+	       w->next < w->base + SW_WINDOW) {
+		/* Le receveur d'un transfert repris a deja ce bloc */
+		size_t b = w->next++;
+		if (w->state[b % SW_WINDOW] != SW_ACKED)
+			blocks[n++] = b;
+
+		/* Tous les blocs sont partis une fois, le FIN les annonce */
+		if (w->next == w->count)
+			w->fin = 1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		w->state[blocks[i] % SW_WINDOW] = SW_SENT;
+		w->seq[blocks[i] % SW_WINDOW] = w->sent++;
+	}
+
+	if (n > 0 && dgram_send_blocks(sfd, addr, w->header, w->file, w->chunk,
+				       blocks, n, &w->stats))
+		return -1;
+
+	if (w->fin && n < quota) {
+		if (send_fin(w, sfd, addr))
+			return -1;
+		n++;
+	}
+
+	/* Le FIN compte comme un paquet plein, il est rare */
+	pacer_consume(&w->pacer, n * w->pacer.packet);
+	return (int) n;
+}
+
+void send_window_ack(SendWindow *w, FTransferAck *ack)
+{
+	if (w->done)
+		return;
+
+	if (ack->flags & FTACK_COMPLETE) {
+		w->done = 1;
+		return;
+	}
+
+	if (ack->base == 0)
+		return;
+
+	w->retries = 0;
+	clock_gettime(CLOCK_MONOTONIC, &w->last_ack);
+
+	/* Le receveur d'un transfert repris peut avoir des blocs pas encore
+	 * partis : ils ne partiront pas */
+	size_t base = (size_t) ack->base - 1;
+	if (base > w->count)
+		base = w->count;
+	if (base > w->next) {
+		w->next = base;
+		w->fin = w->next == w->count;
+	}
+
+	/* seq + 1 du plus recent envoi acquitte, 0 si aucun */
+	size_t newest = 0;
+	for (; w->base < base; w->base++) {
+		size_t slot = w->base % SW_WINDOW;
+		if (w->state[slot] == SW_LOST)
+			w->lost--;
+		if (w->seq[slot] + 1 > newest)
+			newest = w->seq[slot] + 1;
+
+		/* La case passe au bloc base + SW_WINDOW, jamais parti */
+		w->state[slot] = SW_UNSENT;
+		w->seq[slot] = 0;
+	}
+
+	/* Un acquittement en retard decrit aussi des blocs deja sortis */
+	for (size_t i = 1; i < SW_WINDOW && base + i < w->count; i++) {
+		if (base + i < w->base ||
+		    !(ack->bitmap[i / 8] & (1 << (i % 8))))
+			continue;
+
+		size_t slot = (base + i) % SW_WINDOW;
+		if (w->state[slot] == SW_LOST)
+			w->lost--;
+		w->state[slot] = SW_ACKED;
+		if (w->seq[slot] + 1 > newest)
+			newest = w->seq[slot] + 1;
+	}
+
+	/* Un bloc parti avant un bloc recu ne viendra plus */
+	size_t lost = w->lost;
+	size_t oldest = SIZE_MAX;
+	for (size_t b = w->base; b < w->next; b++) {
+		size_t slot = b % SW_WINDOW;
+		if (w->state[slot] == SW_SENT && w->seq[slot] + 1 < newest) {
+			w->state[slot] = SW_LOST;
+			w->lost++;
+			if (w->seq[slot] < oldest)
+				oldest = w->seq[slot];
+		}
+	}
+
+	if (w->lost > lost)
+		pacer_loss(&w->pacer, oldest, w->sent);
+	else
+		pacer_ack(&w->pacer);
+}
+
+uint8_t send_window_timeout(SendWindow *w)
+{
+	if (!waiting_answer(w) || elapsed_ms(&w->last_ack) < SW_RTO_MS)
+		return 0;
+
+	if (++w->retries > SW_RETRY_MAX)
+		return 1;
+
+	for (size_t b = w->base; b < w->next; b++) {
+		size_t slot = b % SW_WINDOW;
+		if (w->state[slot] == SW_SENT) {
+			w->state[slot] = SW_LOST;
+			w->lost++;
+		}
+	}
+
+	/* Le FIN repart aussi, sa reponse dit ce qui manque encore */
+	w->fin = w->next == w->count;
+	pacer_loss(&w->pacer, w->sent, w->sent);
+	clock_gettime(CLOCK_MONOTONIC, &w->last_ack);
+
+	return 0;
+}
+
+int send_window_wait(SendWindow *w)
+{
+	int wait = SW_RTO_MS;
+	if (waiting_answer(w)) {
+		long left = SW_RTO_MS - elapsed_ms(&w->last_ack);
+		wait = left > 0 ? (int) left : 0;
+	}
+
+	if (has_work(w)) {
+		int tokens = pacer_wait(&w->pacer);
+		if (tokens < wait)
+			wait = tokens;
+	}
+
+	return wait;
+}
+
+uint8_t send_window_ready(SendWindow *w)
+{
+	return has_work(w) && pacer_allow(&w->pacer) > 0;
+}
+
+int send_window_read_acks(SendWindow *w, int sfd)
+{
+	char buf[CODEC_MSG_MAX];
+	int count = 0;
+
+	while (1) {
+		ssize_t nbytes = recv(sfd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (nbytes < 0)
+			return SBLOCK || errno == EINTR ? count : -1;
+
+		FTransferAck ack;
+		if (codec_decode(MSG_FT_ACK, buf, (size_t) nbytes, &ack) == 0 ||
+		    get_rq_type(ack.header) != FTACK ||
+		    get_id(ack.header) != get_id(w->header))
+			continue;
+
+		send_window_ack(w, &ack);
+		count++;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
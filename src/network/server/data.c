@@ -5,6 +5,7 @@
 
 #include "network/server/data.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,29 +15,111 @@
 #include <time.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "data_structures/array.h"
 #include "network/file_transfer.h"
 
+#include "network/server/notifications_server.h"
+#include "network/server/timer_service.h"
+#include "network/server/wal.h"
+
+#include "system/logger.h"
+
 
 /**
- * @brief Array of all registered users.
+ * @brief Pseudos of the registered users, indexed by id.
+ *
+ * Posts and feeds only keep the id of their author: this dense table, 20
+ * KiB, is all that is read to resolve pseudos when posts are sent. A slot
+ * is written once under the users lock, then published by its flag with
+ * release semantics. Users are never modified nor removed, so readers only
+ * load the flag: get_pseudo() takes no lock and its pointer stays valid.
  */
-static Array m_known_users;
+static pseudo_t m_pseudos[ID_MAX + 1];
+static atomic_bool m_registered[ID_MAX + 1];
+static atomic_size_t m_user_count;
+
+/* Ids libres, tires au hasard parmi ceux qui restent */
+static uint16_t m_free_ids[ID_MAX];
+static size_t m_free_count;
 static pthread_mutex_t m_users_mutex;
 
+/*
+ * Enregistrements du journal, ajoutes avant que le changement ne soit
+ * visible et sous le verrou qui l'ordonne :
+ * WAL_USER id (2), pseudo ; WAL_FEED numero (2), createur (2) ;
+ * WAL_POST numero du fil (2), auteur (2), datalen (1), donnees.
+ */
+#define WAL_USER  1
+#define WAL_FEED  2
+#define WAL_POST  3
+
+#define WAL_POST_HEADER 5
+
+/* Fils par segment, un segment n'est jamais deplace ni libere */
+#define FEED_SEGMENT_SIZE 256
+#define FEED_SEGMENTS     (FEED_NB_MAX / FEED_SEGMENT_SIZE)
+
 /**
- * @brief Array of all feeds.
+ * @brief Table of all feeds, made of segments allocated on demand.
+ *
+ * A feed keeps its address for the lifetime of the server. It is written
+ * under the feeds lock, then published by the feed count with release
+ * semantics: get_feeds() takes no lock. Each feed has its own lock for
+ * its posts, so posts to different feeds proceed in parallel.
  */
-static Array m_feeds;
+static Feed *m_feed_segments[FEED_SEGMENTS];
+static atomic_size_t m_feed_count;
 static pthread_mutex_t m_feeds_mutex;
 
+/**
+ * @brief Array of the transfers, indexed by transfer id.
+ *
+ * A transfer id is picked by a rotating cursor among the free slots, so
+ * that an id is reused as late as possible.
+ */
 static Array m_tranfer_files;
 static pthread_mutex_t m_tranfer_mutex;
+static uint16_t m_transfer_cursor;
+
+/* Expiration de chaque transfert, armee tant qu'il attend des paquets */
+static Timer m_transfer_timers[ID_MAX + 1];
+
+/*
+ * Envoi publie dont l'id reste reserve FT_TIMEOUT_SEC : un FIN en retard,
+ * dont toutes les copies de l'acquittement final se sont perdues, recoit
+ * encore cet acquittement.
+ */
+typedef struct
+{
+	uint32_t token;               /* Jeton de l'envoi, 0 si libre */
+	time_t until;
+	FTransferAck ack;
+} Tombstone;
+
+/* Indexees par id de transfert, sous le verrou des transferts */
+static Tombstone m_tombstones[ID_MAX + 1];
 
+/* Envoi termine, publie hors du verrou des transferts */
+typedef struct
+{
+	uint8_t done;
+	uint16_t owner;
+	uint16_t feed_number;
+	int fd;
+	size_t size;
+	char file_name[MAX_DATALEN];
+	char tmp_path[MAX_DATALEN];
+} Upload;
+
+/**
+ * @brief Array of pointers to the subscriptions infos,
+ * 	  allocated one by one so that 'Feed.notif' stays valid.
+ */
 static Array m_suscribe;
+static pthread_mutex_t m_suscribe_mutex;
 
 /* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
 
@@ -60,6 +143,16 @@ static void unlock_feeds(void)
 	pthread_mutex_unlock(&m_feeds_mutex);
 }
 
+static void lock_suscribe(void)
+{
+	pthread_mutex_lock(&m_suscribe_mutex);
+}
+
+static void unlock_suscribe(void)
+{
+	pthread_mutex_unlock(&m_suscribe_mutex);
+}
+
 static void lock_transfer(void)
 {
 	pthread_mutex_lock(&m_tranfer_mutex);
@@ -71,23 +164,221 @@ static void unlock_transfer(void)
 }
 
 
-static int8_t exist_id(uint16_t id)
+/*
+ * Retire un id libre au hasard, en O(1) : le dernier prend sa place.
+ * Must be called with the users lock held.
+ */
+static uint16_t generate_new_id(void)
+{
+	if (m_free_count == 0)
+		return 0;
+
+	size_t i = (size_t) random() % m_free_count;
+	uint16_t id = m_free_ids[i];
+	m_free_ids[i] = m_free_ids[--m_free_count];
+
+	return id;
+}
+
+/* Must be called with the users lock held. */
+static void user_insert(uint16_t id, pseudo_t pseudo)
+{
+	/* L'utilisateur est complet avant d'etre visible des lecteurs */
+	memcpy(m_pseudos[id], pseudo, PSEUDO_LEN);
+	atomic_store_explicit(&m_registered[id], 1, memory_order_release);
+	atomic_fetch_add(&m_user_count, 1);
+}
+
+/*
+ * Prepare le fil d'indice 'index', sans le rendre visible.
+ * Must be called with the feeds lock held.
+ */
+static Feed *feed_init(size_t index, uint16_t creator)
+{
+	Feed **segment = &m_feed_segments[index / FEED_SEGMENT_SIZE];
+	if (*segment == NULL)
+		*segment = calloc(FEED_SEGMENT_SIZE, sizeof(Feed));
+	if (*segment == NULL)
+		return NULL;
+
+	Feed *feed = *segment + index % FEED_SEGMENT_SIZE;
+	if (record_log_new(&feed->posts))
+		return NULL;
+
+	feed->creator = creator;
+	feed->notif = NULL;
+	pthread_rwlock_init(&feed->lock, NULL);
+
+	return feed;
+}
+
+/* Must be called with the feeds lock held. */
+static void feed_publish(size_t index)
 {
-	int8_t found = 0;
-	if (id == 0)
+	/* Le fil est complet avant d'etre visible des lecteurs */
+	atomic_store_explicit(&m_feed_count, index + 1, memory_order_release);
+}
+
+static uint8_t feed_mkdir(uint16_t feed_number)
+{
+	char feed_path[MAX_DATALEN];
+	memset(feed_path, 0, MAX_DATALEN);
+	snprintf(feed_path, MAX_DATALEN, "%s/%u", UPLOAD_FILES_PATH,
+		 feed_number);
+
+	struct stat st;
+	if (stat(feed_path, &st) == -1) {
+		if (mkdir(feed_path, S_IRWXU) < 0)
+			return 1;
+
+		return 0;
+	}
+
+	return 0;
+}
+
+/* Must be called with the write lock of the feed held. */
+static uint8_t post_insert(Feed *feed, uint16_t author, uint8_t datalen,
+			   const char *data)
+{
+	Post *post = feed->posts.append(&feed->posts,
+					offsetof(Post, data) + datalen);
+	if (post == NULL)
 		return 1;
 
-	lock_users();
-	User *users = m_known_users.data;
-	for (size_t i = 0; i < m_known_users.length; i++) {
-		if (users[i].id == id) {
-			found = 1;
-			break;
-		}
+	/* Le billet est ecrit en place, a la suite des precedents */
+	post->author = author;
+	post->datalen = datalen;
+	memcpy(post->data, data, datalen);
+
+	return 0;
+}
+
+static uint8_t replay_user(const char *data, size_t len)
+{
+	uint16_t id;
+	pseudo_t pseudo;
+	if (len != sizeof(id) + PSEUDO_LEN)
+		return 1;
+
+	memcpy(&id, data, sizeof(id));
+	memcpy(pseudo, data + sizeof(id), PSEUDO_LEN);
+	if (id == 0 || id > ID_MAX || m_registered[id])
+		return 1;
+
+	user_insert(id, pseudo);
+	return 0;
+}
+
+static uint8_t replay_feed(const char *data, size_t len)
+{
+	uint16_t number;
+	uint16_t creator;
+	if (len != sizeof(number) + sizeof(creator))
+		return 1;
+
+	memcpy(&number, data, sizeof(number));
+	memcpy(&creator, data + sizeof(number), sizeof(creator));
+
+	size_t index = atomic_load(&m_feed_count);
+	if (index >= FEED_NB_MAX || number != index + 1 ||
+	    feed_init(index, creator) == NULL)
+		return 1;
+
+	feed_publish(index);
+	return feed_mkdir(number);
+}
+
+static uint8_t replay_post(const char *data, size_t len)
+{
+	uint16_t number;
+	uint16_t author;
+	if (len < WAL_POST_HEADER ||
+	    len != (size_t) WAL_POST_HEADER + (uint8_t) data[4])
+		return 1;
+
+	memcpy(&number, data, sizeof(number));
+	memcpy(&author, data + sizeof(number), sizeof(author));
+
+	Feed *feed = get_feeds((size_t) number - 1);
+	if (number == 0 || feed == NULL)
+		return 1;
+
+	return post_insert(feed, author, (uint8_t) data[4],
+			   data + WAL_POST_HEADER);
+}
+
+/*
+ * Rejoue un enregistrement du journal au demarrage, avant les threads : il
+ * n'est pas journalise une seconde fois.
+ */
+static void apply_record(uint8_t type, const char *data, size_t len)
+{
+	uint8_t err = 1;
+	if (type == WAL_USER)
+		err = replay_user(data, len);
+	else if (type == WAL_FEED)
+		err = replay_feed(data, len);
+	else if (type == WAL_POST)
+		err = replay_post(data, len);
+
+	if (err)
+		logerror("journal: record of type %u ignored", type);
+}
+
+/* Must be called with the transfers lock held. */
+static void clear_transfer(uint16_t transfer, FileTransferInfos *infos)
+{
+	timer_service_cancel(m_transfer_timers + transfer);
+	transfer_clear(infos);
+}
+
+/*
+ * Un envoi interrompu garde son fichier partiel et la liste de ses blocs :
+ * une nouvelle demande avec son jeton le reprend.
+ */
+static void suspend_upload(FileTransferInfos *infos)
+{
+	if (infos->fd < 0)
+		return;
+
+	char map_path[MAX_DATALEN + sizeof(FT_CHECKPOINT_EXT)];
+	snprintf(map_path, sizeof(map_path), "%s%s", infos->tmp_path,
+		 FT_CHECKPOINT_EXT);
+
+	if (transfer_suspend(infos, map_path))
+		logerror("upload of %s not kept", infos->file_path);
+}
+
+/*
+ * Le timer n'est pas deplace a chaque paquet : a son echeance, le
+ * transfert est suspendu s'il est reste muet, sinon le timer est rearme
+ * a partir de son dernier paquet.
+ */
+static void expire_transfer(void *data)
+{
+	uint16_t transfer = (uint16_t) (uintptr_t) data;
+
+	lock_transfer();
+	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files,
+						       transfer);
+
+	/* Le moteur d'envoi surveille lui-meme ses telechargements */
+	if (infos == NULL || !infos->active || infos->sending) {
+		unlock_transfer();
+		return;
 	}
-	unlock_users();
 
-	return found;
+	time_t now = time(NULL);
+	double idle = difftime(now, infos->activity);
+	if (idle > FT_TIMEOUT_SEC) {
+		suspend_upload(infos);
+		transfer_clear(infos);
+	} else {
+		uint64_t delay = (uint64_t) (FT_TIMEOUT_SEC + 1 - idle) * 1000;
+		timer_service_mod(m_transfer_timers + transfer, delay);
+	}
+	unlock_transfer();
 }
 
 
@@ -98,21 +389,30 @@ void data_init(void)
 	atexit(data_free);
 
 	pthread_mutex_init(&m_users_mutex, NULL);
-	if (array_new(&m_known_users, sizeof(User), 0))
+	pthread_mutex_init(&m_feeds_mutex, NULL);
+
+	if (mkdir(UPLOAD_FILES_PATH, S_IRWXU) < 0 && errno != EEXIST)
 		exit(EXIT_FAILURE);
 
-	pthread_mutex_init(&m_feeds_mutex, NULL);
-	if (array_new(&m_feeds, sizeof(Feed), 0))
+	/* Utilisateurs, fils et billets d'avant l'arret du serveur */
+	if (wal_open(DATA_WAL_PATH, apply_record))
 		exit(EXIT_FAILURE);
 
+	for (uint16_t id = 1; id <= ID_MAX; id++) {
+		if (!m_registered[id])
+			m_free_ids[m_free_count++] = id;
+	}
+
 	pthread_mutex_init(&m_tranfer_mutex, NULL);
 	if (array_new(&m_tranfer_files, sizeof(FileTransferInfos), ID_MAX + 1))
 		exit(EXIT_FAILURE);
+	m_transfer_cursor = 0;
+	for (uint16_t i = 0; i <= ID_MAX; i++)
+		timer_init(m_transfer_timers + i, expire_transfer,
+			   (void *) (uintptr_t) i);
 
-	if (array_new(&m_suscribe, sizeof(NotificationsInfos), 0))
-		exit(EXIT_FAILURE);
-
-	if (mkdir(UPLOAD_FILES_PATH, S_IRWXU) < 0 && errno != EEXIST)
+	pthread_mutex_init(&m_suscribe_mutex, NULL);
+	if (array_new(&m_suscribe, sizeof(NotificationsInfos *), 0))
 		exit(EXIT_FAILURE);
 
 	srandom((unsigned int) time(NULL));
@@ -121,339 +421,646 @@ void data_init(void)
 
 void data_free(void)
 {
-	array_free(&m_known_users);
+	wal_close();
+
 	pthread_mutex_destroy(&m_users_mutex);
 
-	Feed *feeds = m_feeds.data;
-	for (size_t i = 0; i < m_feeds.length; i++)
-		array_free(&feeds[i].posts);
+	size_t feed_count = atomic_exchange(&m_feed_count, 0);
+	for (size_t i = 0; i < feed_count; i++) {
+		Feed *feed = m_feed_segments[i / FEED_SEGMENT_SIZE] +
+			     i % FEED_SEGMENT_SIZE;
+		record_log_free(&feed->posts);
+		pthread_rwlock_destroy(&feed->lock);
+	}
 
-	array_free(&m_feeds);
+	for (size_t i = 0; i < FEED_SEGMENTS; i++) {
+		free(m_feed_segments[i]);
+		m_feed_segments[i] = NULL;
+	}
 	pthread_mutex_destroy(&m_feeds_mutex);
 
 	FileTransferInfos *infos = m_tranfer_files.data;
-	for (size_t i = 0; i < m_tranfer_files.length; i++)
-		array_free(&infos[i].file_data);
+	for (size_t i = 0; i < m_tranfer_files.length; i++) {
+		if (infos[i].active && !infos[i].sending)
+			suspend_upload(&infos[i]);
+		transfer_clear(&infos[i]);
+	}
 
 	array_free(&m_tranfer_files);
 	pthread_mutex_destroy(&m_tranfer_mutex);
 
+	NotificationsInfos **notifs = m_suscribe.data;
+	for (size_t i = 0; i < m_suscribe.length; i++)
+		free(notifs[i]);
+
 	array_free(&m_suscribe);
+	pthread_mutex_destroy(&m_suscribe_mutex);
 }
 
 /* ----------- Users ------------- */
 
-int user_new(uint16_t id, pseudo_t pseudo)
+uint16_t user_new(pseudo_t pseudo)
 {
-	User user = user_init(id, pseudo);
-
 	lock_users();
-	int err = m_known_users.append(&m_known_users, &user);
+	uint16_t id = 0;
+	if (atomic_load(&m_user_count) < USER_MAX)
+		id = generate_new_id();
+
+	if (id == 0) {
+		unlock_users();
+		return 0;
+	}
+
+	char record[2 + PSEUDO_LEN];
+	memcpy(record, &id, sizeof(id));
+	memcpy(record + 2, pseudo, PSEUDO_LEN);
+	if (wal_append(WAL_USER, record, sizeof(record)) == 0) {
+		m_free_ids[m_free_count++] = id;
+		unlock_users();
+		return 0;
+	}
+
+	user_insert(id, pseudo);
 	unlock_users();
 
-	return err;
+	return id;
 }
 
 size_t get_nb_user(void)
 {
-	lock_users();
-	size_t len = m_known_users.length;
-	unlock_users();
-
-	return len;
+	return atomic_load(&m_user_count);
 }
 
 pseudo_t *get_pseudo(uint16_t id)
 {
-	lock_users();
-	for (size_t i = 0; i < m_known_users.length; i++) {
-		User *user = m_known_users.get(&m_known_users, i);
-		if (user->id == id) {
-			unlock_users();
-			return &user->pseudo;
-		}
-	}
-	unlock_users();
+	if (id == 0 || id > ID_MAX ||
+	    !atomic_load_explicit(&m_registered[id], memory_order_acquire))
+		return NULL;
 
-	return NULL;
+	return &m_pseudos[id];
 }
 
-uint16_t generate_new_id(void)
+pseudo_t *get_author(uint16_t id)
 {
-	uint16_t id;
-	do {
-		id = (uint16_t) random() % ID_MAX + 1;
-	} while (exist_id(id));
+	/* Auteur d'un billet dont l'utilisateur n'a pas ete rejoue */
+	static pseudo_t unknown = { 'u', 'n', 'k', 'n', 'o', 'w', 'n',
+				    '#', '#', '#' };
 
-	return id;
+	pseudo_t *pseudo = get_pseudo(id);
+	return pseudo != NULL ? pseudo : &unknown;
 }
 
 /* ------------------------------- */
 
 /* ----------- Feeds ------------- */
 
-int post_new(pseudo_t pseudo, uint8_t datalen,
+int post_new(uint16_t author, uint8_t datalen,
 	     char *data, size_t feed_number)
 {
-	Post post;
-	int err;
+	/* feed indices = feed number - 1 */
+	Feed *feed = get_feeds(feed_number - 1);
+	if (feed == NULL)
+		return 1;
 
-	memcpy(post.pseudo, pseudo, PSEUDO_LEN);
-	memcpy(post.data, data, datalen);
-	post.datalen = datalen;
+	char record[WAL_POST_HEADER + UINT8_MAX];
+	uint16_t number = (uint16_t) feed_number;
+	memcpy(record, &number, sizeof(number));
+	memcpy(record + 2, &author, sizeof(author));
+	record[4] = (char) datalen;
+	memcpy(record + WAL_POST_HEADER, data, datalen);
 
-	/* feed indices = feed number - 1 */
-	lock_feeds();
-	Feed *feed = m_feeds.get(&m_feeds, feed_number - 1);
-	err = feed->posts.append(&feed->posts, &post);
-	unlock_feeds();
+	/*
+	 * Seuls les lecteurs de ce fil attendent, l'ordre des billets du
+	 * journal est celui du fil. Le billet n'est journalise qu'une fois
+	 * insere : un journal qui refuse l'ajout le retire du fil.
+	 */
+	pthread_rwlock_wrlock(&feed->lock);
+	if (post_insert(feed, author, datalen, data)) {
+		pthread_rwlock_unlock(&feed->lock);
+		return 1;
+	}
 
-	return err;
+	if (wal_append(WAL_POST, record, WAL_POST_HEADER + datalen) == 0) {
+		feed->posts.drop(&feed->posts);
+		pthread_rwlock_unlock(&feed->lock);
+		return 1;
+	}
+
+	/* Les billets s'accumulent jusqu'a l'echeance deja prevue */
+	if (feed->notif != NULL)
+		timer_service_add(&feed->notif->flush, NOTIF_FLUSH_SEC * 1000);
+	pthread_rwlock_unlock(&feed->lock);
+
+	return 0;
 }
 
-uint8_t feed_new(pseudo_t creator)
+uint8_t feed_new(uint16_t creator, uint16_t *feed_number)
 {
-	Feed new_feed;
+	lock_feeds();
+	size_t index = atomic_load(&m_feed_count);
+	if (index >= FEED_NB_MAX) {
+		unlock_feeds();
+		return 1;
+	}
 
-	memcpy(new_feed.creator, creator, PSEUDO_LEN);
-	if (array_new(&new_feed.posts, sizeof(Post), 0))
+	Feed *feed = feed_init(index, creator);
+	if (feed == NULL) {
+		unlock_feeds();
 		return 1;
+	}
 
-	lock_feeds();
-	if (m_feeds.append(&m_feeds, &new_feed)) {
+	/* Les numeros du journal se suivent, comme ceux des fils */
+	char record[4];
+	uint16_t number = (uint16_t) (index + 1);
+	memcpy(record, &number, sizeof(number));
+	memcpy(record + 2, &creator, sizeof(creator));
+	if (wal_append(WAL_FEED, record, sizeof(record)) == 0) {
+		record_log_free(&feed->posts);
+		pthread_rwlock_destroy(&feed->lock);
 		unlock_feeds();
 		return 1;
 	}
+
+	feed_publish(index);
+	*feed_number = number;
 	unlock_feeds();
 
-	new_feed.notif = NULL;
+	return feed_mkdir(number);
+}
 
-	char feed_path[MAX_DATALEN];
-	memset(feed_path, 0, MAX_DATALEN);
-	snprintf(feed_path, MAX_DATALEN, "%s/%zu", UPLOAD_FILES_PATH,
-		 m_feeds.length);
+uint8_t notif_new(size_t feed_number, Mult *mult)
+{
+	Feed *feed = get_feeds(feed_number - 1);
+	if (feed == NULL)
+		return 1;
 
-	struct stat st;
-	if (stat(feed_path, &st) == -1) {
-		if (mkdir(feed_path, S_IRWXU) < 0)
-			return 1;
+	lock_suscribe();
 
+	/* Un autre client s'est abonne en meme temps, on garde le premier. */
+	if (feed->notif != NULL) {
+		unlock_suscribe();
+		close(mult->sock_fd);
 		return 0;
 	}
 
-	return 0;
-}
-
-uint8_t notif_new(size_t nbfeed, char *addr, uint16_t port, int fd, SA_IN6 sock_addr)
-{
-	NotificationsInfos notif;
-	Mult mult;
+	NotificationsInfos *notif = malloc(sizeof(*notif));
+	if (notif == NULL) {
+		unlock_suscribe();
+		return 1;
+	}
 
-	mult.port = port;
-	mult.sock_fd = fd;
-	memcpy(mult.addr, addr, 16);
+	mult->port = (uint16_t) (TCP_PORT + m_suscribe.length + 2);
+	mult->sock_addr.sin6_port = htons(mult->port);
 
-	notif.nbfeed = nbfeed;
-	notif.last_send_post = 0;
-	notif.mult_infos = mult;
-	notif.mult_infos.sock_addr = sock_addr;
+	notif->nbfeed = feed_number;
+	notif->last_send_post = 0;
+	notif->mult_infos = *mult;
+	timer_init(&notif->flush, notifications_flush, notif);
 
-	if (m_suscribe.append(&m_suscribe, &notif))
+	if (m_suscribe.append(&m_suscribe, &notif)) {
+		unlock_suscribe();
+		free(notif);
 		return 1;
+	}
+
+	pthread_rwlock_wrlock(&feed->lock);
+	feed->notif = notif;
+	pthread_rwlock_unlock(&feed->lock);
+	unlock_suscribe();
 
-	Feed *feed = get_feeds(nbfeed);
-	feed->notif = m_suscribe.get(&m_suscribe, m_suscribe.length - 1);
+	/* Les billets deja postes partent au premier envoi */
+	timer_service_add(&notif->flush, NOTIF_FLUSH_SEC * 1000);
 
 	return 0;
 }
 
-Feed *get_feeds(size_t feed_number)
+void feed_rdlock(Feed *feed)
 {
-	lock_feeds();
-	Feed *feed = m_feeds.get(&m_feeds, feed_number);
-	unlock_feeds();
-
-	return feed;
+	pthread_rwlock_rdlock(&feed->lock);
 }
-NotificationsInfos *get_notif_info(size_t index)
+
+void feed_unlock(Feed *feed)
 {
-	return m_suscribe.get(&m_suscribe, index);
+	pthread_rwlock_unlock(&feed->lock);
 }
 
-NotificationsInfos *get_feed_notif_info(uint16_t nbfeed)
+Feed *get_feeds(size_t feed_index)
 {
-	for (size_t i = 0; i < m_suscribe.length; i++) {
-		NotificationsInfos *infos = m_suscribe.get(&m_suscribe, i);
-		if (infos->nbfeed == nbfeed)
-			return infos;
-	}
-	return NULL;
+	size_t count = atomic_load_explicit(&m_feed_count,
+					    memory_order_acquire);
+	if (feed_index >= count)
+		return NULL;
+
+	return m_feed_segments[feed_index / FEED_SEGMENT_SIZE] +
+	       feed_index % FEED_SEGMENT_SIZE;
 }
 
+NotificationsInfos *get_notif_info(size_t index)
+{
+	lock_suscribe();
+	NotificationsInfos **infos = m_suscribe.get(&m_suscribe, index);
+	unlock_suscribe();
+
+	return *infos;
+}
 
 size_t get_feeds_count(void)
 {
-	lock_feeds();
-	size_t len = m_feeds.length;
-	unlock_feeds();
-
-	return len;
+	return atomic_load(&m_feed_count);
 }
 
 size_t get_subscribe_count(void)
 {
-	return m_suscribe.length;
+	lock_suscribe();
+	size_t len = m_suscribe.length;
+	unlock_suscribe();
+
+	return len;
 }
 
 /* ------------------------------- */
 
 /* ---------- Transfers ---------- */
 
-uint8_t transfer_new(uint16_t id, uint16_t feed_number, const char *file_name)
+/* Must be called with the transfers lock held. */
+static FileTransferInfos *get_transfer(uint16_t transfer)
+{
+	if (transfer == 0 || transfer > ID_MAX)
+		return NULL;
+
+	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files,
+						       transfer);
+	if (infos == NULL || !infos->active)
+		return NULL;
+
+	return infos;
+}
+
+/* Must be called with the transfers lock held. */
+static Tombstone *get_tombstone(uint16_t transfer)
 {
-	uint8_t err;
+	if (transfer == 0 || transfer > ID_MAX)
+		return NULL;
+
+	Tombstone *tomb = m_tombstones + transfer;
+	if (tomb->token == 0 || difftime(tomb->until, time(NULL)) < 0)
+		return NULL;
+
+	return tomb;
+}
+
+/*
+ * Le fichier partiel d'un envoi est range dans le dossier de son fil, ou a
+ * la racine pour un nouveau fil, sous le nom de son jeton.
+ */
+static void upload_path(FileTransferInfos *infos)
+{
+	if (infos->feed_number == 0)
+		snprintf(infos->tmp_path, MAX_DATALEN, "%s/.upload-%08x",
+			 UPLOAD_FILES_PATH, infos->token);
+	else
+		snprintf(infos->tmp_path, MAX_DATALEN, "%s/%u/.upload-%08x",
+			 UPLOAD_FILES_PATH, infos->feed_number, infos->token);
+}
+
+/*
+ * Le point de reprise doit venir du meme utilisateur, pour le meme fichier
+ * du meme fil et avec la meme taille de bloc.
+ */
+static uint8_t checkpoint_match(FileTransferInfos *infos,
+				FileTransferInfos *saved)
+{
+	return saved->owner == infos->owner &&
+	       saved->feed_number == infos->feed_number &&
+	       saved->blocks.block_size == infos->blocks.block_size &&
+	       strncmp(saved->file_path, infos->file_path, MAX_DATALEN) == 0;
+}
+
+uint16_t transfer_new(uint16_t owner, uint16_t feed_number,
+		      const char *file_name, size_t chunk)
+{
+	uint16_t transfer = 0;
 
 	lock_transfer();
-	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files, id);
-	if (infos != NULL && infos->active)
-		transfer_clear(infos);
+	for (uint16_t i = 0; i < ID_MAX && transfer == 0; i++) {
+		uint16_t id = (uint16_t) (m_transfer_cursor++ % ID_MAX + 1);
+		if (get_transfer(id) == NULL && get_tombstone(id) == NULL)
+			transfer = id;
+	}
+
+	if (transfer == 0) {
+		unlock_transfer();
+		return 0;
+	}
+
+	FileTransferInfos new_infos = transfer_init(file_name, feed_number,
+						    chunk, 0);
+	new_infos.owner = owner;
+	new_infos.token = transfer_token_new();
+	upload_path(&new_infos);
+	if (m_tranfer_files.set(&m_tranfer_files, transfer, &new_infos)) {
+		transfer_clear(&new_infos);
+		unlock_transfer();
+		return 0;
+	}
 
-	FileTransferInfos new_infos = transfer_init(file_name, feed_number);
-	err = (uint8_t) m_tranfer_files.set(&m_tranfer_files, id, &new_infos);
+	timer_service_mod(m_transfer_timers + transfer,
+			  (FT_TIMEOUT_SEC + 1) * 1000);
 	unlock_transfer();
 
-	return err;
+	return transfer;
 }
 
-char *get_tranfer_file_path(uint16_t id)
+uint8_t transfer_resume(uint16_t transfer, uint32_t *token, uint32_t *first,
+			uint8_t *held)
 {
 	lock_transfer();
-	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files, id);
+	FileTransferInfos *infos = get_transfer(transfer);
+	if (infos == NULL) {
+		unlock_transfer();
+		return 1;
+	}
+
+	*first = 1;
+	memset(held, 0, FT_ACK_BITS / 8);
+	if (*token == 0) {
+		*token = infos->token;
+		unlock_transfer();
+		return 0;
+	}
+
+	FileTransferInfos saved = transfer_init(infos->file_path,
+						infos->feed_number, 1, 0);
+	saved.token = *token;
+	upload_path(&saved);
+
+	char map_path[MAX_DATALEN + sizeof(FT_CHECKPOINT_EXT)];
+	snprintf(map_path, sizeof(map_path), "%s%s", saved.tmp_path,
+		 FT_CHECKPOINT_EXT);
+
+	uint8_t resumed = !transfer_checkpoint_load(&saved, map_path) &&
+			  saved.token == *token &&
+			  checkpoint_match(infos, &saved);
+	if (resumed) {
+		saved.fd = open(saved.tmp_path, O_WRONLY | O_CLOEXEC);
+		resumed = saved.fd >= 0;
+	}
+
+	/* Un seul transfert reprend le point, il ne sert plus */
+	if (resumed) {
+		unlink(map_path);
+		saved.owner = infos->owner;
+		saved.activity = time(NULL);
+
+		transfer_clear(infos);
+		*infos = saved;
+
+		FTransferAck ack;
+		transfer_ack_new(infos, 0, &ack);
+		*first = ack.base;
+		memcpy(held, ack.bitmap, sizeof(ack.bitmap));
+	} else {
+		transfer_clear(&saved);
+	}
+
+	*token = infos->token;
 	unlock_transfer();
 
-	return infos->file_path;
+	return 0;
 }
 
-void id_clear_transfer(uint16_t id)
+uint8_t transfer_send(uint16_t transfer, OutboundInfos *outbound)
 {
 	lock_transfer();
-	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files, id);
-	transfer_clear(infos);
+	FileTransferInfos *infos = get_transfer(transfer);
+	if (infos == NULL) {
+		unlock_transfer();
+		return 1;
+	}
+
+	outbound->owner = infos->owner;
+	outbound->chunk = infos->blocks.block_size;
+	memcpy(outbound->file_path, infos->file_path, MAX_DATALEN);
+
+	/* L'id reste reserve jusqu'a la fin de l'envoi */
+	infos->sending = 1;
+	timer_service_cancel(m_transfer_timers + transfer);
 	unlock_transfer();
+
+	return 0;
 }
 
-void check_transfers_timeout(void)
+void id_clear_transfer(uint16_t transfer)
 {
-	uint8_t timeout;
-	time_t now = time(NULL);
-	FileTransferInfos *tfs = m_tranfer_files.data;
-
-	for (size_t i = 0; i < m_tranfer_files.length; i++) {
-		timeout = difftime(now, tfs[i].begin) > FT_TIMEOUT_SEC;
+	lock_transfer();
+	FileTransferInfos *infos = get_transfer(transfer);
+	if (infos != NULL)
+		clear_transfer(transfer, infos);
+	unlock_transfer();
+}
 
-		if (tfs[i].active && timeout) {
-			close(tfs[i].sfd);
-			transfer_clear(tfs + i);
-		}
+/* Le fichier partiel est cree au premier paquet recu */
+static uint8_t open_upload(FileTransferInfos *infos)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	infos->fd = open(infos->tmp_path, flags, S_IRUSR | S_IWUSR);
+	if (infos->fd < 0) {
+		perror("open");
+		return 1;
 	}
+
+	return 0;
 }
 
-static uint8_t write_file(FileTransferInfos *infos)
+/*
+ * Tous les blocs sont sur le disque : le fichier prend sa place dans le
+ * fil par un seul rename, puis le post qui l'annonce est cree. Appele sans
+ * le verrou des transferts, le journal peut attendre.
+ */
+static uint8_t finish_upload(Upload *upload)
 {
+	uint8_t err = get_pseudo(upload->owner) == NULL ||
+		      (upload->feed_number == 0 &&
+		       feed_new(upload->owner, &upload->feed_number));
+
 	char file_path[MAX_DATALEN];
 	memset(file_path, 0, MAX_DATALEN);
-	if (snprintf(file_path, MAX_DATALEN, "%s/%u/%s", UPLOAD_FILES_PATH,
-		     infos->feed_number, infos->file_path) < 0)
+	if (close(upload->fd) < 0 || err ||
+	    snprintf(file_path, MAX_DATALEN, "%s/%u/%s", UPLOAD_FILES_PATH,
+		     upload->feed_number, upload->file_name) < 0 ||
+	    rename(upload->tmp_path, file_path) < 0) {
+		if (!err)
+			perror("rename");
+		unlink(upload->tmp_path);
 		return 1;
+	}
 
-	int fd = open(file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		perror("open");
+	char file_name[MAX_DATALEN];
+	memset(file_name, 0, MAX_DATALEN);
+	if (snprintf(file_name, MAX_DATALEN, "%s %zu", upload->file_name,
+		     upload->size) < 0)
 		return 1;
-	}
 
-	if (ftruncate(fd, infos->file_size) < 0) {
-		perror("ftruncate");
+	if (post_new(upload->owner, (uint8_t) strlen(file_name), file_name,
+		     upload->feed_number))
 		return 1;
-	}
 
-	int prot = PROT_READ | PROT_WRITE;
-	char *file = mmap(NULL, (size_t) infos->file_size, prot, MAP_SHARED, fd, 0);
-	if (file == NULL) {
-		perror("mmap");
+	return 0;
+}
+
+/* Ecrit un bloc a sa place dans le fichier, retourne 1 si l'envoi echoue */
+static uint8_t write_packet(FileTransferInfos *infos, uint32_t numblock,
+			    char *data, size_t nbytes)
+{
+	if (numblock == 0)
+		return 0;
+
+	if (infos->fd < 0 && open_upload(infos))
+		return 1;
+
+	/* Seul le suivi est en memoire, les donnees vont sur le disque */
+	size_t chunk = infos->blocks.block_size;
+	int fresh = infos->blocks.insert(&infos->blocks, numblock - 1, data,
+					 nbytes, nbytes < chunk);
+	if (fresh < 0)
+		return 1;
+
+	/* Doublon ou bloc incoherent : rien a ecrire */
+	if (fresh == 0)
+		return 0;
+
+	off_t offset = (off_t) (numblock - 1) * (off_t) chunk;
+	if (nbytes > 0 && pwrite(infos->fd, data, nbytes, offset) < 0) {
+		perror("pwrite");
 		return 1;
 	}
 
-	char *file_content = infos->file_data.data;
-	memcpy(file, file_content, (size_t) infos->file_size);
-	munmap(file, (size_t) infos->file_size);
-	close(fd);
 	return 0;
 }
 
-uint8_t add_packet(uint16_t id, uint16_t numblock, char *data, size_t nbytes)
+/*
+ * Prepare l'acquittement du paquet recu s'il est du. Un envoi dont le FIN
+ * est recu et auquel il ne manque aucun bloc est retire des transferts :
+ * 'upload' garde de quoi le publier une fois le verrou rendu, et son id
+ * reste reserve par sa pierre tombale.
+ */
+static uint8_t acknowledge(uint16_t transfer, FileTransferInfos *infos,
+			   uint8_t fin, FTransferAck *ack, Upload *upload)
+{
+	uint8_t copies = transfer_ack_due(infos, fin);
+	if (copies == 0)
+		return 0;
+
+	header_t header = (header_t) (FTACK | transfer << CODERQ_BITSLEN);
+	transfer_ack_new(infos, header, ack);
+	if (!transfer_done(infos))
+		return copies;
+
+	upload->done = 1;
+	upload->owner = infos->owner;
+	upload->feed_number = infos->feed_number;
+	upload->fd = infos->fd;
+	upload->size = infos->blocks.size;
+	memcpy(upload->file_name, infos->file_path, MAX_DATALEN);
+	memcpy(upload->tmp_path, infos->tmp_path, MAX_DATALEN);
+
+	Tombstone *tomb = m_tombstones + transfer;
+	tomb->token = infos->token;
+	tomb->until = time(NULL) + FT_TIMEOUT_SEC;
+	tomb->ack = *ack;
+
+	/* Le fichier partiel appartient maintenant a 'upload' */
+	infos->fd = -1;
+	clear_transfer(transfer, infos);
+
+	return copies;
+}
+
+/*
+ * Publie l'envoi termine retire par acknowledge(). En cas d'echec,
+ * l'acquittement final ne part pas : l'envoyeur abandonne faute de
+ * reponse.
+ */
+static uint8_t publish_upload(uint16_t transfer, Upload *upload,
+			      uint8_t copies)
+{
+	if (!upload->done || finish_upload(upload) == 0)
+		return copies;
+
+	logerror("upload %u of user %u failed", transfer, upload->owner);
+
+	lock_transfer();
+	m_tombstones[transfer].token = 0;
+	unlock_transfer();
+
+	return 0;
+}
+
+/* Paquet d'un envoi deja publie : l'acquittement final repart une fois */
+static uint8_t acknowledge_late(uint16_t transfer, FTransferAck *ack)
+{
+	Tombstone *tomb = get_tombstone(transfer);
+	if (tomb == NULL)
+		return 0;
+
+	*ack = tomb->ack;
+	return 1;
+}
+
+uint8_t add_packet(uint16_t transfer, uint32_t numblock, char *data,
+		   size_t nbytes, FTransferAck *ack)
 {
 	lock_transfer();
-	FileTransferInfos *infos = m_tranfer_files.get(&m_tranfer_files, id);
-	if (infos == NULL) {
-		unlock_transfer();
-		return 1;
-	}
+	FileTransferInfos *infos = get_transfer(transfer);
 
 	/* Pas de demande de Upload au préalable, paquet non traité. */
-	if (!infos->active) {
+	if (infos == NULL || infos->sending) {
+		uint8_t copies = infos == NULL ?
+				 acknowledge_late(transfer, ack) : 0;
 		unlock_transfer();
-		return 0;
+		return copies;
 	}
 
-	/*
-	 * Dernier numero de paquet, enregistrement pour savoir quand est
-	 * ce qu'on a tous les paquets.
-	 */
-	if (nbytes < FILE_PACKET_SIZE)
-		infos->last_packet = numblock;
-
-	if (infos->file_data.set(&infos->file_data, numblock - 1, data)) {
+	/* Une erreur n'abandonne que cet envoi, le serveur UDP continue */
+	if (write_packet(infos, numblock, data, nbytes)) {
+		logerror("upload %u of user %u failed", transfer, infos->owner);
+		clear_transfer(transfer, infos);
 		unlock_transfer();
-		return 1;
+		return 0;
 	}
-	infos->file_size += (off_t) nbytes;
-
-	/* Tous les paquets sont recus, ecriture du fichier sur le disque. */
-	if (infos->file_data.length == infos->last_packet) {
-		pseudo_t *pseudo = get_pseudo(id);
-		if (infos->feed_number == 0 && feed_new(*pseudo)) {
-			unlock_transfer();
-			return 1;
-		}
-
-		if (infos->feed_number == 0)
-			infos->feed_number = (uint16_t) (m_feeds.length);
 
-		char file_name[MAX_DATALEN];
-		memset(file_name, 0, MAX_DATALEN);
-
-		if (snprintf(file_name, MAX_DATALEN, "%s %ld", infos->file_path, infos->file_size) < 0) {
-			unlock_transfer();
-			return 1;
-		}
+	Upload upload = { .done = 0 };
+	uint8_t copies = acknowledge(transfer, infos, 0, ack, &upload);
+	unlock_transfer();
 
-		if (post_new(*pseudo, (uint8_t) strlen(file_name),
-			     file_name, infos->feed_number)) {
-			unlock_transfer();
-			return 1;
-		}
+	return publish_upload(transfer, &upload, copies);
+}
 
-		if (write_file(infos)) {
-			unlock_transfer();
-			return 1;
-		}
+uint8_t end_transfer(uint16_t transfer, uint32_t count, FTransferAck *ack)
+{
+	lock_transfer();
+	FileTransferInfos *infos = get_transfer(transfer);
+	if (infos == NULL || infos->sending) {
+		uint8_t copies = infos == NULL ?
+				 acknowledge_late(transfer, ack) : 0;
+		unlock_transfer();
+		return copies;
+	}
 
-		transfer_clear(infos);
+	/* Le nombre annonce contredit les blocs recus : envoi abandonne */
+	if (infos->blocks.expect(&infos->blocks, count)) {
+		logerror("upload %u of user %u failed", transfer, infos->owner);
+		clear_transfer(transfer, infos);
+		unlock_transfer();
+		return 0;
 	}
 
+	infos->fin = 1;
+	Upload upload = { .done = 0 };
+	uint8_t copies = acknowledge(transfer, infos, 1, ack, &upload);
 	unlock_transfer();
-	return 0;
+
+	return publish_upload(transfer, &upload, copies);
 }
 
 /* ------------------------------- */
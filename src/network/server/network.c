@@ -5,270 +5,213 @@
 
 #include "network/server/network.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 
+#include "network/codec.h"
+#include "network/datagram.h"
 #include "network/network_macros.h"
+#include "network/server/data.h"
 #include "system/logger.h"
 
-/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
-
-
-static BytesRQ hton_serverrqcl(ServerRQ_Cl *rq)
-{
-	BytesRQ b_rq;
-	header_t hd = htons(rq->header);
-	uint16_t feed_number = htons(rq->feed_number);
-	uint16_t count = htons(rq->count);
-
-	memset(&b_rq, 0, sizeof(b_rq));
-	appendbuf(b_rq.buf, &b_rq.size, &hd, sizeof(hd));
-	appendbuf(b_rq.buf, &b_rq.size, &feed_number, sizeof(feed_number));
-	appendbuf(b_rq.buf, &b_rq.size, &count, sizeof(count));
-
-	return b_rq;
-}
-
-
-static BytesRQ hton_serverrqlp(ServerRQ_Lp *rq)
-{
-	BytesRQ b_rq;
-	uint16_t feed_number = htons(rq->feed_number);
 
-	memset(&b_rq, 0, sizeof(b_rq));
-	appendbuf(b_rq.buf, &b_rq.size, &feed_number, sizeof(feed_number));
-	appendbuf(b_rq.buf, &b_rq.size, rq->creator, PSEUDO_LEN);
-	appendbuf(b_rq.buf, &b_rq.size, rq->pseudo, PSEUDO_LEN);
-	appendbuf(b_rq.buf, &b_rq.size, &rq->datalen, sizeof(rq->datalen));
-	appendbuf(b_rq.buf, &b_rq.size, rq->data, rq->datalen);
+/* Billets de LASTPOSTS affiches en mode debug */
+#define DEBUG_POSTS_MAX 10
 
-	return b_rq;
-}
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
 
-static BytesRQ hton_serverrqft(FTransferRQ *rq)
+/*
+ * Encode un message et sa delimitation directement dans la file de sortie,
+ * l'envoi est fait plus tard par le reacteur quand la socket est prete.
+ */
+static uint8_t queue_message(OutputQueue *out, MessageKind kind, void *msg,
+			     uint8_t framed)
 {
-	BytesRQ b_rq;
-	memset(&b_rq, 0, sizeof(b_rq));
-
-	header_t hd = htons(rq->header);
-	uint16_t numbloc = htons(rq->numblock);
+	size_t size = codec_frame_size(kind, msg, framed);
+	char *dst = out->reserve(out, size);
+	if (dst == NULL) {
+		logerror("reserve: output queue");
+		return 1;
+	}
 
-	appendbuf(b_rq.buf, &b_rq.size, &hd, sizeof(hd));
-	appendbuf(b_rq.buf, &b_rq.size, &numbloc, sizeof(numbloc));
-	appendbuf(b_rq.buf, &b_rq.size, rq->data, FILE_PACKET_SIZE);
+	if (codec_encode_frame(kind, msg, dst, size, framed) == 0)
+		return 1;
 
-	return b_rq;
-}
-static BytesRQ hton_serverrqsb(ServerRQ_Sb *rq)
-{
-	BytesRQ b_rq;
-	header_t hd = htons(rq->header);
-	uint16_t feed_number = htons(rq->feed_number);
-	uint16_t count = htons(rq->count);
-
-	memset(&b_rq, 0, sizeof(b_rq));
-	appendbuf(b_rq.buf, &b_rq.size, &hd, sizeof(hd));
-	appendbuf(b_rq.buf, &b_rq.size, &feed_number, sizeof(feed_number));
-	appendbuf(b_rq.buf, &b_rq.size, &count, sizeof(count));
-	appendbuf(b_rq.buf, &b_rq.size, rq->addr, sizeof(rq->addr));
-
-	return b_rq;
+	out->commit(out, size);
+	return 0;
 }
 
-static BytesRQ hton_serverrqnt(ServerRQ_Nt *rq)
+/*
+ * Un billet de LASTPOSTS ne porte que des ids : les pseudos sont lus dans
+ * la table des utilisateurs au moment de l'encoder.
+ */
+static void resolve_post(ServerRQ_Ref *ref, ServerRQ_Lp *lp)
 {
-	BytesRQ b_rq;
-	header_t hd = htons(rq->header);
-	uint16_t feed_number = htons(rq->feed_number);
-
-	memset(&b_rq, 0, sizeof(b_rq));
-	appendbuf(b_rq.buf, &b_rq.size, &hd, sizeof(hd));
-	appendbuf(b_rq.buf, &b_rq.size, &feed_number, sizeof(feed_number));
-	appendbuf(b_rq.buf, &b_rq.size, rq->pseudo, PSEUDO_LEN);
-	appendbuf(b_rq.buf, &b_rq.size, rq->data, NT_DATA_LEN);
-
-	return b_rq;
+	lp->feed_number = ref->feed_number;
+	memcpy(lp->creator, get_author(ref->creator), PSEUDO_LEN);
+	memcpy(lp->pseudo, get_author(ref->author), PSEUDO_LEN);
+	lp->datalen = ref->datalen;
+	memcpy(lp->data, ref->data, ref->datalen);
 }
 
-static ClientRQ_Rg ntoh_clientrqrg(BytesRQ *b_rq)
+/*
+ * Une reponse LASTPOSTS est encodee d'un bloc, en-tete et billets, dans un
+ * seul espace contigu de la file : elle part en quelques appels systeme.
+ */
+static uint8_t queue_lastposts(OutputQueue *out, ServerRQ *serverrq,
+			       uint8_t framed)
 {
-	ClientRQ_Rg rq;
-	uint16_t hd;
-
-	size_t size = 0;
-	extractbuf(b_rq->buf, &size, &hd, sizeof(hd));
-	extractbuf(b_rq->buf, &size, rq.pseudo, PSEUDO_LEN);
-
-	rq.header = ntohs(hd);
-	return rq;
-}
-
+	uint16_t count = serverrq->cl.count;
+
+	/* La taille d'un billet ne depend que de datalen, pas des pseudos */
+	ServerRQ_Lp lp;
+	size_t total = codec_frame_size(MSG_SERVER_CL, &serverrq->cl, framed);
+	for (uint16_t i = 0; i < count; i++) {
+		lp.datalen = serverrq[i + 1].ref.datalen;
+		total += codec_frame_size(MSG_SERVER_LP, &lp, framed);
+	}
 
-static ClientRQ_Cl ntoh_clientrqcl(BytesRQ *b_rq)
-{
-	ClientRQ_Cl rq;
-	memset(&rq, 0, sizeof(rq));
-	header_t header;
-	uint16_t feed_number;
-	uint16_t count;
-
-	size_t size = 0;
-	extractbuf(b_rq->buf, &size, &header, sizeof(header));
-	extractbuf(b_rq->buf, &size, &feed_number, sizeof(feed_number));
-	extractbuf(b_rq->buf, &size, &count, sizeof(count));
-	extractbuf(b_rq->buf, &size, &rq.datalen, sizeof(rq.datalen));
-	extractbuf(b_rq->buf, &size, rq.data, rq.datalen);
-
-	rq.header = ntohs(header);
-	rq.feed_number = ntohs(feed_number);
-	rq.count = ntohs(count);
-	return rq;
-}
+	char *dst = out->reserve(out, total);
+	if (dst == NULL) {
+		logerror("reserve: output queue");
+		return 1;
+	}
 
-static FTransferRQ ntoh_clientrqup(BytesRQ *bytes_rq)
-{
-	FTransferRQ rq;
-	header_t header;
-	uint16_t numblock;
+	size_t size = codec_encode_frame(MSG_SERVER_CL, &serverrq->cl, dst,
+					 total, framed);
+	for (uint16_t i = 0; i < count; i++) {
+		resolve_post(&serverrq[i + 1].ref, &lp);
+		if (i < DEBUG_POSTS_MAX)
+			debug_serverrq_lp(&lp);
 
-	size_t size = 0;
-	extractbuf(bytes_rq->buf, &size, &header, sizeof(header));
-	extractbuf(bytes_rq->buf, &size, &numblock, sizeof(numblock));
-	extractbuf(bytes_rq->buf, &size, rq.data, bytes_rq->size - size);
+		size_t len = codec_encode_frame(MSG_SERVER_LP, &lp, dst + size,
+						total - size, framed);
+		if (len == 0)
+			return 1;
 
-	rq.header = ntohs(header);
-	rq.numblock = ntohs(numblock);
+		size += len;
+	}
 
-	return rq;
+	out->commit(out, size);
+	return 0;
 }
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
-uint8_t send_server_request(int sfd, ServerRQ *serverrq)
+uint8_t write_server_request(OutputQueue *out, ServerRQ *serverrq,
+			     uint8_t framed)
 {
-        BytesRQ bytes_rq;
 	coderq_t type = serverrq->type;
 
-	if (type == REGISTRATION || type == NEWPOST || type == UPLOAD ||
-	    type == DOWNLOAD || is_error(type)) {
-		bytes_rq = hton_serverrqcl(&serverrq->cl);
-		appendbuf(bytes_rq.buf, &bytes_rq.size, CRLF, strlen(CRLF));
-		if (send(sfd, bytes_rq.buf, bytes_rq.size, 0) < 0) {
-			perror("send");
-	                return 1;
-		}
-	} else if (type == LASTPOSTS) {
-		bytes_rq = hton_serverrqcl(&serverrq->cl);
-		appendbuf(bytes_rq.buf, &bytes_rq.size, CRLF, strlen(CRLF));
-		if (send(sfd, bytes_rq.buf, bytes_rq.size, 0) < 0) {
-			perror("send");
-			return 1;
-		}
-		for (uint16_t i = 0; i < serverrq->cl.count; i++) {
-			memset(&bytes_rq, 0, BUFSIZ);
-			bytes_rq = hton_serverrqlp(&serverrq[i + 1].lp);
-			appendbuf(bytes_rq.buf, &bytes_rq.size, CRLF, strlen(CRLF));
-			if (send(sfd, bytes_rq.buf, bytes_rq.size, 0) < 0) {
-				perror("send");
-				return 1;
-			}
-		}
-	} else if (type == SUBSCRIBE) {
-		bytes_rq = hton_serverrqsb(&serverrq->sb);
-		appendbuf(bytes_rq.buf, &bytes_rq.size, CRLF, strlen(CRLF));
-		if (send(sfd, bytes_rq.buf, bytes_rq.size, 0) < 0) {
-			perror("send");
-	                return 1;
-		}
-	} else {
-		logerror("NOT IMPLEMENTED");
-		return 1;
-	}
-
-	return 0;
-}
+	if (type == REGISTRATION || type == NEWPOST || type == CONNOPT ||
+	    is_error(type))
+		return queue_message(out, MSG_SERVER_CL, &serverrq->cl, framed);
 
-uint8_t recv_client_request(int sockfd, ClientRQ *clientrq, BytesRQ *rb_rq)
-{
-	BytesRQ b_rq;
+	/* Le jeton de reprise suit, un client qui l'ignore s'arrete avant */
+	if (type == UPLOAD || type == DOWNLOAD)
+		return queue_message(out, MSG_SERVER_RS, &serverrq->cl, framed);
 
-	if (recv_request(sockfd, &b_rq, rb_rq))
-                return 1;
+	if (type == LASTPOSTS)
+		return queue_lastposts(out, serverrq, framed);
 
-	header_t hd;
-	extractbuf(b_rq.buf, NULL, &hd, sizeof(hd));
-	clientrq->type = get_rq_type(ntohs(hd));
+	if (type == SUBSCRIBE)
+		return queue_message(out, MSG_SERVER_SB, &serverrq->sb, framed);
 
-	if (clientrq->type == REGISTRATION)
-		clientrq->rg = ntoh_clientrqrg(&b_rq);
-	else
-		clientrq->cl = ntoh_clientrqcl(&b_rq);
-
-        return 0;
+	logerror("NOT IMPLEMENTED");
+	return 1;
 }
 
-ssize_t recv_datagrams(int sfd, ClientRQ *clientrq)
+int8_t recv_client_request(int sockfd, ClientRQ *clientrq, RingBuffer *ring,
+			   uint8_t framed)
 {
-	BytesRQ bytes_rq;
-	memset(&bytes_rq, 0, sizeof(bytes_rq));
-
-	ssize_t nbytes = recvfrom(sfd, bytes_rq.buf, sizeof(FTransferRQ), 0,
-				  NULL, NULL);
-	if (nbytes < 0)
-		return nbytes;
+	char *msg;
+	size_t size;
+
+	int8_t err = recv_request(sockfd, ring, framed, &msg, &size);
+	if (err != 0)
+                return err;
+
+	clientrq->type = get_rq_type(codec_header(msg, size));
+
+	size_t len = 0;
+	clientrq->cl.chunk = 0;
+	clientrq->cl.resume = 0;
+	clientrq->cl.first = 0;
+	memset(clientrq->cl.held, 0, sizeof(clientrq->cl.held));
+	if (clientrq->type == REGISTRATION) {
+		len = codec_decode(MSG_CLIENT_RG, msg, size, &clientrq->rg);
+	} else if ((clientrq->type == UPLOAD || clientrq->type == DOWNLOAD) &&
+		   framed) {
+		/* Les champs binaires d'un transfert peuvent contenir CR : il
+		 * ne se negocie que sur une connexion a trames */
+		len = codec_decode(MSG_CLIENT_RS, msg, size, &clientrq->cl);
+
+		/* Sans jeton de reprise, le transfert part du debut */
+		if (len == 0) {
+			clientrq->cl.resume = 0;
+			clientrq->cl.first = 0;
+			memset(clientrq->cl.held, 0, sizeof(clientrq->cl.held));
+			len = codec_decode(MSG_CLIENT_FT, msg, size,
+					   &clientrq->cl);
+		}
+	}
 
-	bytes_rq.size = (size_t) nbytes;
+	/* Un transfert sans trame ou sans taille de bloc proposee est une
+	 * requete invalide */
+	if (len == 0 && clientrq->type != REGISTRATION &&
+	    clientrq->type != UPLOAD && clientrq->type != DOWNLOAD) {
+		clientrq->cl.chunk = 0;
+		len = codec_decode(MSG_CLIENT_CL, msg, size, &clientrq->cl);
+	}
 
-	header_t hd;
-	extractbuf(bytes_rq.buf, NULL, &hd, sizeof(hd));
-	clientrq->type = get_rq_type(ntohs(hd));
-	clientrq->ft = ntoh_clientrqup(&bytes_rq);
+	/* Requete tronquee : le type invalide produit une reponse d'erreur */
+	if (len == 0)
+		clientrq->type = 0;
 
-	return nbytes;
+        return 0;
 }
 
-static uint8_t send_datagrams(int sfd, SA_IN6 *addr, FTransferRQ *ftrq, size_t blen)
+uint8_t send_notif(int sockfd, ServerRQ *serverrq, int nb_rq, SA_IN6 *sock_addr)
 {
-	BytesRQ bytes_rq = hton_serverrqft(ftrq);
-	socklen_t len = sizeof(*addr);
-
-	bytes_rq.size -= (FILE_PACKET_SIZE - blen);
-	if (sendto(sfd, bytes_rq.buf, bytes_rq.size, 0, (SA *) addr, len) < 0)
+	if (nb_rq <= 0)
+		return 0;
+
+	size_t count = (size_t) nb_rq;
+	size_t size = codec_size(MSG_SERVER_NT, &serverrq[0].nt);
+
+	/* Toutes les notifications du fil partent en un lot */
+	char *buf = malloc(count * size);
+	struct iovec *iov = malloc(count * sizeof(*iov));
+	struct mmsghdr *msgs = calloc(count, sizeof(*msgs));
+	if (buf == NULL || iov == NULL || msgs == NULL) {
+		free(buf);
+		free(iov);
+		free(msgs);
 		return 1;
+	}
 
-	return 0;
-}
-
+	for (size_t i = 0; i < count; i++) {
+		codec_encode(MSG_SERVER_NT, &serverrq[i].nt, buf + i * size, size);
 
-uint8_t send_ftransfer_requests(int sfd, SA_IN6 *addr, Array *a_ftrq, size_t f_size)
-{
-	FTransferRQ *ftrq = a_ftrq->data;
-	for (size_t i = 0; i < a_ftrq->length; i++) {
-		size_t len = FILE_PACKET_SIZE;
-		if (i == a_ftrq->length - 1)
-			len = (size_t) (f_size % FILE_PACKET_SIZE);
+		iov[i].iov_base = buf + i * size;
+		iov[i].iov_len = size;
 
-		if (send_datagrams(sfd, addr, ftrq + i, len))
-			return 1;
+		msgs[i].msg_hdr.msg_name = sock_addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(*sock_addr);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	return 0;
-}
+	uint8_t err = dgram_send(sockfd, msgs, count, NULL);
+	if (err)
+		perror("sendmmsg");
 
-uint8_t send_notif(int sockfd, ServerRQ *serverrq, int nb_rq, SA_IN6 *sock_addr)
-{
-        BytesRQ bytes_rq;
-	socklen_t len = sizeof(*sock_addr);
-
-	for (int i = 0; i < nb_rq; i++) {
-		memset(&bytes_rq, 0, sizeof(bytes_rq));
-		bytes_rq = hton_serverrqnt(&serverrq[i].nt);
-		if (sendto(sockfd, bytes_rq.buf, bytes_rq.size, 0, (SA *) sock_addr, len) < 0) {
-			perror("send");
-			return 1;
-		}
-	}
-	return 0;
+	free(buf);
+	free(iov);
+	free(msgs);
+	return err;
 }
 
 /* -------------------------------------------------------------------------- */
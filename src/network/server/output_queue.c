@@ -0,0 +1,367 @@
+/**
+ * @file output_queue.c
+ * @brief Implementation of the per-connection output buffer chain.
+ */
+
+#include "network/server/output_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include "network/network_macros.h"
+
+
+/* Nombre maximum de blocs envoyes par appel a sendmsg */
+#define FLUSH_IOV_MAX 64
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static OutBlock *block_new(size_t capacity)
+{
+	OutBlock *block = malloc(sizeof(*block) + capacity);
+	if (block == NULL)
+		return NULL;
+
+	block->next = NULL;
+	block->capacity = capacity;
+	block->start = 0;
+	block->end = 0;
+	block->zc_pending = 0;
+	block->zc_seq = 0;
+
+	return block;
+}
+
+/**
+ * @brief Tells whether the kernel may still read a block sent with
+ * MSG_ZEROCOPY, in which case it must not be freed nor rewritten.
+ */
+static uint8_t zc_busy(OutputQueue *queue, OutBlock *block)
+{
+	return block->zc_pending &&
+	       (int32_t) (block->zc_seq - queue->zc_completed) >= 0;
+}
+
+static void release_completed(OutputQueue *queue)
+{
+	while (queue->zc_head != NULL && !zc_busy(queue, queue->zc_head)) {
+		OutBlock *block = queue->zc_head;
+		queue->zc_head = block->next;
+		free(block);
+	}
+
+	if (queue->zc_head == NULL)
+		queue->zc_tail = NULL;
+}
+
+/*
+ * Les notifications peuvent arriver dans le desordre, par exemple quand le
+ * noyau copie les donnees pour une socket locale : un envoi n'est compte
+ * termine qu'une fois tous ceux d'avant termines.
+ */
+static void zc_done(OutputQueue *queue, uint32_t seq)
+{
+	uint32_t offset = seq - queue->zc_completed;
+	if ((int32_t) offset < 0 || offset >= OUTPUT_ZEROCOPY_MAX)
+		return;
+
+	queue->zc_ahead |= (uint64_t) 1 << offset;
+	while (queue->zc_ahead & 1) {
+		queue->zc_ahead >>= 1;
+		queue->zc_completed++;
+	}
+}
+
+static void zc_defer(OutputQueue *queue, OutBlock *block)
+{
+	block->next = NULL;
+	if (queue->zc_tail == NULL)
+		queue->zc_head = block;
+	else
+		queue->zc_tail->next = block;
+	queue->zc_tail = block;
+}
+
+/**
+ * @brief Returns a pointer to at least len contiguous free bytes at the end
+ * of the queue. Nothing is queued before commit is called.
+ *
+ * @return The reserved space, NULL on failure to allocate memory.
+ */
+static char *reserve(OutputQueue *queue, size_t len)
+{
+	OutBlock *tail = queue->tail;
+	if (tail != NULL && tail->capacity - tail->end >= len)
+		return tail->data + tail->end;
+
+	/* Un bloc vide peut etre reutilise depuis le debut */
+	if (tail != NULL && tail->start == tail->end && tail->capacity >= len &&
+	    !zc_busy(queue, tail)) {
+		tail->start = 0;
+		tail->end = 0;
+		return tail->data;
+	}
+
+	size_t capacity = (len > OUTPUT_BLOCK_SIZE) ? len : OUTPUT_BLOCK_SIZE;
+	OutBlock *block = block_new(capacity);
+	if (block == NULL)
+		return NULL;
+
+	if (tail == NULL)
+		queue->head = block;
+	else
+		tail->next = block;
+	queue->tail = block;
+
+	return block->data;
+}
+
+/**
+ * @brief Queues the first len bytes of the last reserved space.
+ */
+static void commit(OutputQueue *queue, size_t len)
+{
+	queue->tail->end += len;
+	queue->pending += len;
+}
+
+/**
+ * @brief Copies len bytes at the end of the queue.
+ *
+ * @return 0 on success, 1 on failure to allocate memory.
+ */
+static int append(OutputQueue *queue, const void *data, size_t len)
+{
+	char *dst = reserve(queue, len);
+	if (dst == NULL)
+		return 1;
+
+	memcpy(dst, data, len);
+	commit(queue, len);
+	return 0;
+}
+
+/**
+ * @brief Drops the first n bytes of the queue, they were written.
+ * If the send used MSG_ZEROCOPY, the blocks it read are kept until
+ * its completion is notified.
+ */
+static void consume(OutputQueue *queue, size_t n, uint8_t zc, uint32_t seq)
+{
+	queue->pending -= n;
+
+	while (n > 0) {
+		OutBlock *block = queue->head;
+		size_t len = block->end - block->start;
+
+		if (zc) {
+			block->zc_pending = 1;
+			block->zc_seq = seq;
+		}
+
+		if (n < len) {
+			block->start += n;
+			return;
+		}
+
+		n -= len;
+		block->start = block->end;
+
+		if (zc_busy(queue, block)) {
+			queue->head = block->next;
+			if (block == queue->tail)
+				queue->tail = NULL;
+			zc_defer(queue, block);
+			continue;
+		}
+
+		/* On garde le dernier bloc pour les prochaines reponses */
+		if (block == queue->tail)
+			return;
+
+		queue->head = block->next;
+		free(block);
+	}
+}
+
+/**
+ * @brief Writes as much of the queue as the socket accepts.
+ *
+ * @return 0 if the queue is empty, 1 if the socket would block,
+ *         -1 if the connection failed.
+ */
+static int8_t flush(OutputQueue *queue, int sfd)
+{
+	struct iovec iov[FLUSH_IOV_MAX];
+	struct msghdr msg;
+	uint8_t zc_allowed = queue->zerocopy;
+
+	while (queue->pending > 0) {
+		int iovcnt = 0;
+		for (OutBlock *b = queue->head; b != NULL && iovcnt < FLUSH_IOV_MAX;
+		     b = b->next) {
+			if (b->start == b->end)
+				continue;
+
+			iov[iovcnt].iov_base = b->data + b->start;
+			iov[iovcnt].iov_len = b->end - b->start;
+			iovcnt++;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (size_t) iovcnt;
+
+		/* MSG_NOSIGNAL : un client parti ne doit pas tuer le serveur */
+		int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+		uint8_t zc = zc_allowed && queue->pending >= OUTPUT_ZEROCOPY_MIN &&
+			     queue->zc_next - queue->zc_completed <
+			     OUTPUT_ZEROCOPY_MAX;
+		if (zc)
+			flags |= MSG_ZEROCOPY;
+
+		ssize_t n = sendmsg(sfd, &msg, flags);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		/* Plus de memoire pour epingler les pages : on copie */
+		if (n < 0 && zc && errno == ENOBUFS) {
+			zc_allowed = 0;
+			continue;
+		}
+
+		if (n < 0 && SBLOCK)
+			return 1;
+
+		if (n < 0)
+			return -1;
+
+		uint32_t seq = queue->zc_next;
+		if (zc)
+			queue->zc_next++;
+
+		consume(queue, (size_t) n, zc, seq);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reads the MSG_ZEROCOPY notifications of the socket error queue
+ * and frees the blocks whose sends are completed.
+ *
+ * @return 0 on success, -1 if the error queue could not be read.
+ */
+static int8_t complete(OutputQueue *queue, int sfd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct msghdr msg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (SBLOCK)
+				break;
+			return -1;
+		}
+
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			struct sock_extended_err *err = (void *) CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* Le noyau a du copier les donnees, autant copier nous-meme */
+			if (err->ee_code == SO_EE_CODE_ZEROCOPY_COPIED)
+				queue->zerocopy = 0;
+
+			/* Envois [ee_info, ee_data] */
+			uint32_t seq = err->ee_info;
+			do {
+				zc_done(queue, seq);
+			} while (seq++ != err->ee_data);
+		}
+	}
+
+	release_completed(queue);
+	return 0;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+OutputQueue output_queue_init(void)
+{
+	OutputQueue queue;
+
+	queue.head = NULL;
+	queue.tail = NULL;
+	queue.pending = 0;
+
+	queue.zc_head = NULL;
+	queue.zc_tail = NULL;
+	queue.zerocopy = 0;
+	queue.zc_next = 0;
+	queue.zc_completed = 0;
+	queue.zc_ahead = 0;
+
+	queue.reserve = reserve;
+	queue.commit = commit;
+	queue.append = append;
+	queue.flush = flush;
+	queue.complete = complete;
+
+	return queue;
+}
+
+uint8_t output_queue_zerocopy(OutputQueue *queue, int sfd)
+{
+	int one = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+		return 1;
+
+	queue->zerocopy = 1;
+	return 0;
+}
+
+uint8_t output_queue_busy(const OutputQueue *queue)
+{
+	/* Un bloc en partie envoye reste en tete de chaine, pas dans
+	 * 'zc_head' : seuls les numeros des envois disent tout */
+	return queue->zc_next != queue->zc_completed;
+}
+
+void output_queue_free(OutputQueue *queue)
+{
+	OutBlock *tmp = NULL;
+	while (queue->head != NULL) {
+		tmp = queue->head;
+		queue->head = queue->head->next;
+		free(tmp);
+	}
+
+	while (queue->zc_head != NULL) {
+		tmp = queue->zc_head;
+		queue->zc_head = queue->zc_head->next;
+		free(tmp);
+	}
+
+	queue->tail = NULL;
+	queue->zc_tail = NULL;
+	queue->pending = 0;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -12,9 +12,9 @@
 #include <sys/stat.h>
 
 #include "network/server/data.h"
+#include "network/codec.h"
 #include "network/request.h"
 #include "system/logger.h"
-#include <sys/mman.h>
 /*---------------------------- PRIVATE FUNCTIONS --------------------------- */
 
 /**
@@ -30,10 +30,11 @@ static uint8_t registration_request(Array *a_serverrq, ClientRQ *clientrq)
 		return 1;
 	}
 
-	uint16_t id = generate_new_id();
-
-	if (user_new(id, clientrq->rg.pseudo))
+	uint16_t id = user_new(clientrq->rg.pseudo);
+	if (id == 0) {
+		d_errno = ERR_IDMAX;
 		return 1;
+	}
 
 	header_t header = (header_t) (REGISTRATION | id << CODERQ_BITSLEN);
 
@@ -69,22 +70,23 @@ static uint8_t post_request(Array *a_serverrq, ClientRQ *clientrq)
 		return 1;
 	}
 
-	pseudo_t *pseudo = get_pseudo(get_id(clientrq->cl.header));
+	uint16_t author = get_id(clientrq->cl.header);
 	/* ID doesn't exist */
-	if (pseudo == NULL) {
+	if (get_pseudo(author) == NULL) {
 		d_errno = ERR_NOID;
 		return 1;
 	}
 
 	if (feed_number == 0) {
 		/* new post on a new feed */
-		feed_number = (uint16_t) feed_count + 1;
-		if (feed_new(*pseudo))
+		if (feed_new(author, &feed_number)) {
+			d_errno = ERR_FEEDMAX;
 			return 1;
+		}
 	}
 
 	char *data = clientrq->cl.data;
-	if (post_new(*pseudo, clientrq->cl.datalen, data, feed_number))
+	if (post_new(author, clientrq->cl.datalen, data, feed_number))
 		return 1;
 
 	ServerRQ serverrq;
@@ -129,9 +131,11 @@ static uint8_t last_posts_request(Array *a_serverrq, ClientRQ *clientrq)
 	for (size_t i = 0; i < feed_count; i++) {
 		size_t i_feed = i + start_feed;
 
+		/* L'index du log ne doit pas grandir pendant qu'on le lit,
+		 * seul ce fil est verrouille */
 		Feed *feed = get_feeds(i_feed);
-		Array *posts = &feed->posts;
-		pseudo_t *creator = &feed->creator;
+		feed_rdlock(feed);
+		RecordLog *posts = &feed->posts;
 
 		/* nb of posts to treat */
 		uint8_t all_post = (count == 0 || count > posts->length);
@@ -142,14 +146,21 @@ static uint8_t last_posts_request(Array *a_serverrq, ClientRQ *clientrq)
 			size_t j_post = start_post + j;
 			Post *post = posts->get(posts, j_post);
 
+			/* Les donnees restent dans le journal, qui ne bouge
+			 * pas : les pseudos sont lus a l'encodage */
 			ServerRQ serverrq;
-			serverrq.lp = serverrq_lp_new(
-				(uint16_t) (i_feed + 1), creator,
-				&post->pseudo, post->datalen, post->data);
-
-			if (a_serverrq->append(a_serverrq, &serverrq))
+			serverrq.ref.feed_number = (uint16_t) (i_feed + 1);
+			serverrq.ref.creator = feed->creator;
+			serverrq.ref.author = post->author;
+			serverrq.ref.datalen = post->datalen;
+			serverrq.ref.data = post->data;
+
+			if (a_serverrq->append(a_serverrq, &serverrq)) {
+				feed_unlock(feed);
 				return 1;
+			}
 		}
+		feed_unlock(feed);
 	}
 
 	ServerRQ *serverrq = a_serverrq->data;
@@ -171,15 +182,15 @@ static uint8_t set_mult(Mult *mult)
 	memset(&grsock, 0, sizeof(grsock));
 	grsock.sin6_family = AF_INET6;
 	inet_pton(AF_INET6, ADDR_MULT, &grsock.sin6_addr);
-	uint16_t port = 6226 + (uint16_t) get_subscribe_count() + 2;
-	grsock.sin6_port = htons(port);
 	int ifindex = 0;
 	if(setsockopt(mult_sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex))) {
 		perror("erreur initialisation de l interface locale");
+		close(mult_sock);
 		return 1;
 	}
-	memcpy(mult->addr, ADDR_MULT, 16);
-	mult->port = port;
+	/* Le port est attribue par notif_new */
+	memset(mult->addr, 0, sizeof(mult->addr));
+	memcpy(mult->addr, ADDR_MULT, sizeof(ADDR_MULT));
 	mult->sock_fd = mult_sock;
 	mult->sock_addr = grsock;
 	return 0;
@@ -202,18 +213,27 @@ static uint8_t subscriptions_request(Array *a_serverrq, ClientRQ *clientrq)
 		return 1;
 	}
 
-	Feed *feed = get_feeds(feed_number);
-	if (feed->notif == NULL) {
-		NotificationsInfos notif;
-		set_mult(&notif.mult_infos);
-		notif_new(feed_number, notif.mult_infos.addr, notif.mult_infos.port, notif.mult_infos.sock_fd, notif.mult_infos.sock_addr);
+	Feed *feed = get_feeds(feed_number - 1);
+	feed_rdlock(feed);
+	NotificationsInfos *notif = feed->notif;
+	feed_unlock(feed);
+
+	/* Le groupe n'est jamais retire une fois cree */
+	if (notif == NULL) {
+		Mult mult;
+		if (set_mult(&mult) || notif_new(feed_number, &mult))
+			return 1;
+
+		feed_rdlock(feed);
+		notif = feed->notif;
+		feed_unlock(feed);
 	}
 
 	ServerRQ serverrq;
 	serverrq.sb.header = clientrq->cl.header;
 	serverrq.sb.feed_number = feed_number;
-	serverrq.sb.count = feed->notif->mult_infos.port;
-	memcpy(serverrq.sb.addr, feed->notif->mult_infos.addr, 16);
+	serverrq.sb.count = notif->mult_infos.port;
+	memcpy(serverrq.sb.addr, notif->mult_infos.addr, 16);
 
 	if (a_serverrq->append(a_serverrq, &serverrq))
 		return 1;
@@ -221,6 +241,39 @@ static uint8_t subscriptions_request(Array *a_serverrq, ClientRQ *clientrq)
 	return 0;
 }
 
+/*
+ * Reserve l'id du transfert et l'ajoute a la reponse, le client s'en sert
+ * pour distinguer ses transferts en parallele.
+ */
+static uint8_t open_transfer(Array *a_serverrq, ServerRQ *serverrq,
+			     ClientRQ *clientrq, const char *file_name)
+{
+	uint16_t owner = get_id(serverrq->cl.header);
+	serverrq->cl.transfer = transfer_new(owner, serverrq->cl.feed_number,
+					     file_name, serverrq->cl.chunk);
+	if (serverrq->cl.transfer == 0) {
+		d_errno = ERR_IDMAX;
+		return 1;
+	}
+
+	/* Un envoi reprend la ou le point de reprise du jeton s'est arrete */
+	if (clientrq->type == UPLOAD) {
+		serverrq->cl.resume = clientrq->cl.resume;
+		if (transfer_resume(serverrq->cl.transfer, &serverrq->cl.resume,
+				    &serverrq->cl.first, serverrq->cl.held)) {
+			d_errno = ERR_IDMAX;
+			return 1;
+		}
+	}
+
+	if (a_serverrq->append(a_serverrq, serverrq)) {
+		id_clear_transfer(serverrq->cl.transfer);
+		return 1;
+	}
+
+	return 0;
+}
+
 static uint8_t prepare_upload_request(Array *a_serverrq, ClientRQ *clientrq)
 {
 	uint16_t feed_number = clientrq->cl.feed_number;
@@ -243,12 +296,10 @@ static uint8_t prepare_upload_request(Array *a_serverrq, ClientRQ *clientrq)
 	serverrq.cl.header = clientrq->cl.header;
 	serverrq.cl.feed_number = feed_number;
 	serverrq.cl.count = UDP_PORT;
+	serverrq.cl.chunk = file_chunk_negotiate(clientrq->cl.chunk);
 
-	if (a_serverrq->append(a_serverrq, &serverrq))
-		return 1;
-
-	uint16_t id = get_id(clientrq->cl.header);
-	return transfer_new(id, feed_number, clientrq->cl.data);
+	return open_transfer(a_serverrq, &serverrq, clientrq,
+			     clientrq->cl.data);
 }
 
 static uint8_t prepare_download_request(Array *a_serverrq, ClientRQ *clientrq)
@@ -268,10 +319,11 @@ static uint8_t prepare_download_request(Array *a_serverrq, ClientRQ *clientrq)
 		d_errno = ERR_FEEDNB;
 		return 1;
 	}
-	/* file doesn't exist*/
+	/* file doesn't exist, les fichiers partiels des envois sont caches */
 	char file_path[MAX_DATALEN];
 	strcpy(file_path, clientrq->cl.data);
-	if (!file_exist(file_path, clientrq->cl.feed_number)) {
+	if (file_path[0] == '.' ||
+	    !file_exist(file_path, clientrq->cl.feed_number)) {
 		d_errno = ERR_NOFILE;
 		return 1;
 	}
@@ -280,46 +332,44 @@ static uint8_t prepare_download_request(Array *a_serverrq, ClientRQ *clientrq)
 	serverrq.cl.header = clientrq->cl.header;
 	serverrq.cl.feed_number = feed_number;
 	serverrq.cl.count = clientrq->cl.count;
-	if (a_serverrq->append(a_serverrq, &serverrq))
-		return 1;
-
-	uint16_t id = get_id(clientrq->cl.header);
-	return transfer_new(id, feed_number, file_path);
-}
-
-uint8_t create_ftransfer_requests(Array *a_ftrq, size_t *f_size, uint16_t id) {
-	/* Récuperation du path complet du fichier enregistré
-	 * lors du traitement de la requête TCP. */
-	char *file_path = get_tranfer_file_path(id);
-
-	int fd;
-	if ((fd = open(file_path, O_RDONLY)) < 0) {
-		perror("open");
-		return 1;
+	serverrq.cl.chunk = file_chunk_negotiate(clientrq->cl.chunk);
+
+	/* Le client reprend s'il a des blocs de cette version du fichier */
+	serverrq.cl.resume = file_token(file_path);
+	serverrq.cl.first = 1;
+	memset(serverrq.cl.held, 0, sizeof(serverrq.cl.held));
+	if (clientrq->cl.resume != 0 &&
+	    clientrq->cl.resume == serverrq.cl.resume &&
+	    clientrq->cl.chunk == serverrq.cl.chunk &&
+	    clientrq->cl.first > 1) {
+		serverrq.cl.first = clientrq->cl.first;
+		memcpy(serverrq.cl.held, clientrq->cl.held,
+		       sizeof(serverrq.cl.held));
 	}
 
-	struct stat st;
-	if (fstat(fd, &st) < 0) {
-		perror("stat");
-		return 1;
-	}
-
-	*f_size = (size_t) st.st_size;
+	return open_transfer(a_serverrq, &serverrq, clientrq, file_path);
+}
 
-	char *file = NULL;
-	file = mmap(NULL, *f_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (file == NULL) {
-		perror("mmap");
-		return 1;
-	}
+/**
+ * @brief Handles a connection options request from a client
+ *
+ * The accepted options are sent back in the 'count' field, the TCP server
+ * applies them to the connection once the answer has been sent.
+ *
+ * @param clientrq The client request
+ * @return 0 on success, 1 if an error occured
+ */
+static uint8_t connection_options_request(Array *a_serverrq, ClientRQ *clientrq)
+{
+	ServerRQ serverrq;
+	serverrq.cl.header = clientrq->cl.header;
+	serverrq.cl.feed_number = 0;
+	/* Le serveur accepte toutes les options qu'il connait */
+	serverrq.cl.count = clientrq->cl.count & (CONNOPT_KEEPALIVE | CONNOPT_FRAMED);
 
-	uint16_t header = (uint16_t) (DOWNLOAD | (id << CODERQ_BITSLEN));
-	*a_ftrq = ftransferrqs_new(header, file, st.st_size);
-	if (a_ftrq->data == NULL)
+	if (a_serverrq->append(a_serverrq, &serverrq))
 		return 1;
 
-	munmap(file, *f_size);
-	close(fd);
 	return 0;
 }
 
@@ -332,7 +382,8 @@ static uint8_t (*requests[]) (Array *a_serverrq, ClientRQ *clientrq) = {
 	last_posts_request,
 	subscriptions_request,
 	prepare_upload_request,
-	prepare_download_request
+	prepare_download_request,
+	connection_options_request
 };
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
@@ -341,7 +392,18 @@ uint8_t handle_tcp_request(Array *a_serverrq, ClientRQ *clientrq)
 {
 	d_errno = NOERROR;
 	ServerRQ *serverrq = a_serverrq->data;
+
+	/* Type de requete inconnu, la requete est incomplete ou corrompue */
+	if (clientrq->type < REGISTRATION || clientrq->type > CONNOPT) {
+		d_errno = ERR_NOTCOMPLET;
+		serverrq->cl = serverrq_error();
+		serverrq->type = (coderq_t) d_errno;
+		return 0;
+	}
+
 	if (requests[clientrq->type - 1](a_serverrq, clientrq) == 0) {
+		/* Le gestionnaire a pu agrandir (et deplacer) le tableau */
+		serverrq = a_serverrq->data;
 		d_errno = NOERROR;
 		serverrq->type = clientrq->type;
 		return 0;
@@ -351,22 +413,35 @@ uint8_t handle_tcp_request(Array *a_serverrq, ClientRQ *clientrq)
 	if (errno == ENOMEM)
 		return 1;
 
+	serverrq = a_serverrq->data;
 	serverrq->cl = serverrq_error();
 	serverrq->type = (coderq_t) d_errno;
 	return 0;
 }
 
-uint8_t handle_upload_packet(ClientRQ *clientrq, size_t nbytes)
+uint8_t handle_upload_packet(char *packet, size_t len, FTransferAck *ack)
 {
-	if (clientrq->type != UPLOAD) {
+	coderq_t type = get_rq_type(codec_header(packet, len));
+	if (type == FTFIN) {
+		FTransferFin fin;
+		if (codec_decode(MSG_FT_FIN, packet, len, &fin) == 0) {
+			logerror("Invalid Packets");
+			return 0;
+		}
+
+		return end_transfer(get_id(fin.header), fin.count, ack);
+	}
+
+	/* Seul l'en-tete est decode, les donnees restent dans le datagramme */
+	FTransferRQ ftrq;
+	size_t hdlen = codec_decode(MSG_FT_HEADER, packet, len, &ftrq);
+	if (hdlen == 0 || type != UPLOAD) {
 		logerror("Invalid Packets");
 		return 0;
 	}
 
-	uint16_t id = get_id(clientrq->ft.header);
-	uint16_t numblock = clientrq->ft.numblock;
-	nbytes -= (sizeof(id) + sizeof(numblock));
-	return add_packet(id, numblock, clientrq->ft.data, nbytes);
+	return add_packet(get_id(ftrq.header), ftrq.numblock, packet + hdlen,
+			  len - hdlen, ack);
 }
 
 /* -------------------------------------------------------------------------- */
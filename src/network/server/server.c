@@ -58,6 +58,23 @@ static uint8_t set_non_blocking(int sockfd)
 	return 0;
 }
 
+/**
+ * @brief Lets several sockets bind the same TCP port.
+ *
+ * The kernel then spreads the incoming connections between
+ * the listening sockets of the reactor threads.
+ */
+static uint8_t sockopt_reuseport(int sockfd)
+{
+	int optv = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optv, sizeof(optv)) < 0) {
+		perror("setsockopt: SO_REUSEPORT");
+		return 1;
+	}
+
+	return 0;
+}
+
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
 uint8_t create_tcp_server(Server *tcp_server, in_port_t port)
@@ -86,7 +103,7 @@ uint8_t create_tcp_server(Server *tcp_server, in_port_t port)
 	addr.sin6_addr = in6addr_any;
 
 	/* Changing socket options */
-	if (sockopt_init(tcp_server->sfd))
+	if (sockopt_init(tcp_server->sfd) || sockopt_reuseport(tcp_server->sfd))
 		return 1;
 
 	if (bind(tcp_server->sfd, (SA *) &addr, sizeof(addr)) < 0) {
@@ -95,7 +112,7 @@ uint8_t create_tcp_server(Server *tcp_server, in_port_t port)
 	}
 
 	tcp_server->addr = addr;
-	if (listen(tcp_server->sfd, 0) < 0) {
+	if (listen(tcp_server->sfd, SOMAXCONN) < 0) {
 		perror("listen");
 		return 1;
 	}
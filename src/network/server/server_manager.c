@@ -7,14 +7,20 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "network/datagram.h"
+#include "network/file_transfer.h"
 #include "network/network_macros.h"
+#include "network/pacer.h"
 
 #include "network/server/data.h"
 
 #include "network/server/tcp_server.h"
 #include "network/server/udp_server.h"
-#include "network/server/notifications_server.h"
+#include "network/server/timer_service.h"
+#include "network/server/transfer_engine.h"
+#include "network/server/wal.h"
 
 #include "system/logger.h"
 #include "system/thread_pool.h"
@@ -37,49 +43,104 @@ static uint8_t is_port(const char *portstr, uint16_t *port){
 	return 1;
 }
 
+static uint8_t is_count(const char *countstr, long min, long max,
+			long *count)
+{
+	char *endptr;
+	long l = strtol(countstr, &endptr, 10);
+	if (endptr == countstr || endptr[0] != 0 || l < min || l > max) {
+		logerror("The count must be an integer between %ld and %ld",
+			 min, max);
+		return 0;
+	}
+
+	*count = l;
+	return 1;
+}
+
+static void usage_error(void)
+{
+	logerror("format incorrect\n Please put -t before TCP port, -u before "
+		 "UDP port, -n before the number of TCP threads, -b before "
+		 "the number of datagrams per send, -r before the transfer "
+		 "rate cap in Mbit/s, -a before 0 or 1 for the adaptive rate, "
+		 "-c before the largest transfer block size in bytes, -g "
+		 "before 0 or 1 for the UDP segmentation offload and -d "
+		 "before 0, 1 or 2 for the durability of the journal");
+	exit(EXIT_FAILURE);
+}
+
 /*
  * -t port tcp
  * -u port udp
+ * -n nombre de threads TCP (reacteurs)
+ * -b datagrammes par appel a sendmmsg
+ * -r plafond du debit des envois de fichiers en Mbit/s, 0 sans plafond
+ * -a 1 pour adapter le debit aux pertes, 0 pour un debit fixe
+ * -c plus grande taille de bloc acceptee pour les transferts, en octets
+ * -g 1 pour envoyer et recevoir les fichiers en super-datagrammes (GSO/GRO)
+ * -d durabilite du journal : 0 sans fdatasync, 1 par lots, 2 par requete
 */
-static void parse(int argc, const char *argv[], uint16_t *port_tcp, uint16_t *port_udp)
+static void parse(int argc, const char *argv[], uint16_t *port_tcp,
+		  uint16_t *port_udp, uint8_t *reactor_count)
 {
-	if (argc == 1)
-		return;
-	if (argc == 3 && !strcmp(argv[1], "-t")) {
-		if (!is_port(argv[2], port_tcp))
-			exit(EXIT_FAILURE);
-		return;
+	long count;
+	for (int i = 1; i < argc; i += 2) {
+		if (i + 1 >= argc)
+			usage_error();
+
+		if (!strcmp(argv[i], "-t")) {
+			if (!is_port(argv[i + 1], port_tcp))
+				exit(EXIT_FAILURE);
+		} else if (!strcmp(argv[i], "-u")) {
+			if (!is_port(argv[i + 1], port_udp))
+				exit(EXIT_FAILURE);
+		} else if (!strcmp(argv[i], "-n")) {
+			if (!is_count(argv[i + 1], 1, TCP_REACTOR_MAX, &count))
+				exit(EXIT_FAILURE);
+			*reactor_count = (uint8_t) count;
+		} else if (!strcmp(argv[i], "-b")) {
+			if (!is_count(argv[i + 1], 1, DGRAM_BATCH_MAX, &count))
+				exit(EXIT_FAILURE);
+			dgram_set_batch((size_t) count);
+		} else if (!strcmp(argv[i], "-r")) {
+			if (!is_count(argv[i + 1], 0, PACER_RATE_MAX, &count))
+				exit(EXIT_FAILURE);
+			pacer_set_rate((size_t) count);
+		} else if (!strcmp(argv[i], "-a")) {
+			if (!is_count(argv[i + 1], 0, 1, &count))
+				exit(EXIT_FAILURE);
+			pacer_set_adaptive((uint8_t) count);
+		} else if (!strcmp(argv[i], "-c")) {
+			if (!is_count(argv[i + 1], FT_CHUNK_MIN, FT_CHUNK_MAX,
+				      &count))
+				exit(EXIT_FAILURE);
+			file_set_chunk_max((size_t) count);
+		} else if (!strcmp(argv[i], "-g")) {
+			if (!is_count(argv[i + 1], 0, 1, &count))
+				exit(EXIT_FAILURE);
+			dgram_set_offload((uint8_t) count);
+		} else if (!strcmp(argv[i], "-d")) {
+			if (!is_count(argv[i + 1], WAL_NONE, WAL_SYNC, &count))
+				exit(EXIT_FAILURE);
+			wal_set_mode((uint8_t) count);
+		} else {
+			usage_error();
+		}
 	}
+}
 
-	if (argc == 3 && !strcmp(argv[1], "-u")) {
-		if (!is_port(argv[2], port_udp))
-			exit(EXIT_FAILURE);
-		return;
-	}
+/* Par defaut, un reacteur TCP par coeur disponible */
+static uint8_t default_reactor_count(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return 1;
 
-	if (argc == 5) {
-		uint8_t id_t = 0;
-		uint8_t id_u = 0;
-		if(!strcmp(argv[1], "-t"))
-			id_t = 2;
-		if(!strcmp(argv[1], "-u"))
-			id_u = 2;
-		if(!strcmp(argv[3], "-t"))
-			id_t = 4;
-		if(!strcmp(argv[3], "-u"))
-			id_u = 4;
-
-		if (!is_port(argv[2], port_tcp))
-			exit(EXIT_FAILURE);
-
-		if (!is_port(argv[2], port_udp))
-			exit(EXIT_FAILURE);
-
-		if (id_t != 0 && id_u != 0)
-			return;
-	}
-	logerror("format incorrect\n Please put -t before TCP port and -u before UDP port");
-	exit(EXIT_FAILURE);
+	if (cpus > TCP_REACTOR_MAX)
+		return TCP_REACTOR_MAX;
+
+	return (uint8_t) cpus;
 }
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
@@ -87,35 +148,52 @@ static void parse(int argc, const char *argv[], uint16_t *port_tcp, uint16_t *po
 
 void launch_server(int argc, const char *argv[])
 {
-	const uint8_t thread_count = 3;
-
 	ThreadPool *thread_pool;
-	ThreadJob jobs[thread_count];
 
 	uint16_t tcp_port = TCP_PORT;
 	uint16_t udp_port = UDP_PORT;
+	uint8_t reactor_count = default_reactor_count();
 
 	/* ------ initialization ------ */
 	log_init();
-	data_init();
+	parse(argc, argv, &tcp_port, &udp_port, &reactor_count);
 
-	parse(argc, argv, &tcp_port, &udp_port);
-	if (tcp_server_init(tcp_port)) {
+	/* Le journal n'est rejoue qu'avec des arguments valides et les reglages
+	 * deja appliques */
+	data_init();
+	/* Le timerfd est surveille par le premier reacteur */
+	if (timer_service_init()) {
+		exit(EXIT_FAILURE);
+	}
+	if (tcp_server_init(tcp_port, reactor_count)) {
 		exit(EXIT_FAILURE);
 	}
 	if (udp_server_init(udp_port)) {
 		exit(EXIT_FAILURE);
 	}
+	if (transfer_engine_init()) {
+		exit(EXIT_FAILURE);
+	}
 	/* ---------------------------- */
 
+	/* Les reacteurs TCP, le serveur UDP, les envois et le journal */
+	const uint8_t thread_count =
+		(uint8_t) (reactor_count + 2 + TRANSFER_WORKERS);
+	ThreadJob jobs[thread_count];
+
 	thread_pool = thread_pool_init(thread_count);
 	if (thread_pool == NULL)
 		exit(EXIT_FAILURE);
 
 	memset(jobs, 0, sizeof(jobs));
-	jobs[0].job = tcp_server_loop;
-	jobs[1].job = udp_server_loop;
-	jobs[2].job = notifications_loop;
+	for (uint8_t i = 0; i < reactor_count; i++) {
+		jobs[i].job = tcp_server_loop;
+		jobs[i].arg = tcp_server_reactor(i);
+	}
+	jobs[reactor_count].job = udp_server_loop;
+	for (uint8_t i = 0; i < TRANSFER_WORKERS; i++)
+		jobs[reactor_count + 1 + i].job = transfer_engine_loop;
+	jobs[thread_count - 1].job = wal_loop;
 
 	for (int i = 0; i < thread_count; i++)
 		thread_pool->add_job(thread_pool, &jobs[i]);
@@ -1,265 +1,726 @@
 #include "network/server/tcp_server.h"
 
-#include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "data_structures/timer_wheel.h"
 
 #include "network/server/data.h"
 #include "network/server/server.h"
 #include "network/server/network.h"
 #include "network/server/request_manager.h"
+#include "network/server/timer_service.h"
+#include "network/server/transfer_engine.h"
+#include "network/server/wal.h"
 
 #include "system/logger.h"
 
 
-static Server m_server;
-static Array  m_fds;
+#define MAX_EVENTS 64
 
+/*
+ * Un reacteur par thread TCP : sa propre socket d'ecoute (SO_REUSEPORT),
+ * son propre ensemble epoll et sa roue pour l'inactivite de ses
+ * connexions. Les donnees de data.c sont partagees.
+ */
 typedef struct
 {
+	uint8_t index;
+
+	Server server;
+	int epfd;
+	int spare_fd;        /* Descripteur de reserve, voir refuse_connection */
+
+	TimerWheel wheel;
+	uint64_t now;        /* Heure du dernier reveil, en ms */
+
+	/* Mode WAL_SYNC : connexions dont les reponses attendent le journal,
+	 * reprises quand son thread ecrit dans 'wal_efd' */
+	int wal_efd;
+	struct connection_infos *held;
+} Reactor;
+
+static Reactor *m_reactors;
+static uint8_t  m_reactor_count;
+
+/* 'epoll_event.data.ptr' du timerfd des echeances partagees */
+static uint8_t m_timer_event;
+
+/*
+ * Etat d'une connexion, alloue a l'acceptation et stocke dans
+ * 'epoll_event.data.ptr'. Le serveur d'ecoute est enregistre avec NULL.
+ */
+typedef struct connection_infos
+{
+	int sfd;
 	SA_IN6 addr;
-	BytesRQ rb_rq;
+	RingBuffer in;
+	OutputQueue out;
+
+	Reactor *reactor;
+	Timer idle;          /* Rearme a son echeance, pas a chaque evenement */
+	uint64_t activity;   /* Dernier evenement, en ms */
+
+	uint8_t keep_alive;  /* La connexion reste ouverte entre les requetes */
+	uint8_t framed;      /* Messages precedes de leur taille, sans CRLF */
+	uint8_t readable;    /* Des donnees restent peut-etre a lire (ET) */
+	uint8_t paused;      /* Lecture suspendue, trop de reponses en attente */
+	uint8_t closing;     /* Fermer des que la file de sortie est vide */
+	uint8_t draining;    /* Fermee, attend ses notifications MSG_ZEROCOPY */
+
+	/* Telechargement confie au moteur une fois sa reponse envoyee */
+	uint16_t download;   /* Id du transfert, 0 sans */
+	uint32_t download_first;
+	uint8_t download_held[FT_ACK_BITS / 8];
+	SA_IN6 download_addr;
+
+	/* Les reponses partent une fois le journal ecrit jusqu'a 'wal_lsn' */
+	uint64_t wal_lsn;
+	uint8_t held;
+	struct connection_infos *held_prev;
+	struct connection_infos *held_next;
 } ConnectionInfos;
 
-static Array  m_connection_infos;
+static uint8_t server_callback(ConnectionInfos *infos, ClientRQ *clientrq,
+			       ServerRQ *serverrq)
+{
+	coderq_t type = serverrq->type;
+	/* La reponse CONNOPT est encore delimitee a l'ancienne */
+	if (type == CONNOPT) {
+		infos->keep_alive = (serverrq->cl.count & CONNOPT_KEEPALIVE) != 0;
+		infos->framed = (serverrq->cl.count & CONNOPT_FRAMED) != 0;
+	}
+
+	/*
+	 * L'envoi du fichier est confie au moteur de transferts une fois la
+	 * reponse partie, donc apres le journal qu'elle attend : le client
+	 * apprend l'id et la taille de bloc du transfert avant d'en recevoir
+	 * les paquets.
+	 */
+	if (type == DOWNLOAD) {
+		infos->download = serverrq->cl.transfer;
+		infos->download_first = serverrq->cl.first;
+		memcpy(infos->download_held, serverrq->cl.held,
+		       sizeof(infos->download_held));
+		memset(&infos->download_addr, 0, sizeof(infos->download_addr));
+		infos->download_addr.sin6_family = DOMAIN;
+		infos->download_addr.sin6_port = htons(clientrq->cl.count);
+		infos->download_addr.sin6_addr = infos->addr.sin6_addr;
+	}
 
+	return 0;
+}
 
-static uint8_t handle_file_dowload(uint16_t id, uint16_t port, SA_IN6 *addr)
+static void start_download(ConnectionInfos *infos)
 {
-	Array a_ftrq;
-	size_t file_size = 0;
-	if (create_ftransfer_requests(&a_ftrq, &file_size, id))
-		return 1;
+	uint16_t transfer = infos->download;
+	infos->download = 0;
 
-	int ft_sfd = socket(DOMAIN, SOCK_DGRAM, 0);
-	if (ft_sfd < 0)
-		return 0;
+	if (transfer_engine_submit(transfer, &infos->download_addr,
+				   infos->download_first, infos->download_held))
+		logerror("download %u not started", transfer);
+}
+
+static void hold_connection(ConnectionInfos *infos)
+{
+	if (infos->held)
+		return;
+
+	Reactor *reactor = infos->reactor;
+	infos->held = 1;
+	infos->held_prev = NULL;
+	infos->held_next = reactor->held;
+	if (reactor->held != NULL)
+		reactor->held->held_prev = infos;
+	reactor->held = infos;
+}
+
+static void release_connection(ConnectionInfos *infos)
+{
+	if (!infos->held)
+		return;
+
+	if (infos->held_prev != NULL)
+		infos->held_prev->held_next = infos->held_next;
+	else
+		infos->reactor->held = infos->held_next;
+
+	if (infos->held_next != NULL)
+		infos->held_next->held_prev = infos->held_prev;
 
-	SA_IN6 ft_addr;
-	memset(&ft_addr, 0, sizeof(ft_addr));
-	ft_addr.sin6_family = DOMAIN;
-	ft_addr.sin6_port = htons(port);
-	ft_addr.sin6_addr = addr->sin6_addr;
+	infos->held = 0;
+	infos->held_prev = NULL;
+	infos->held_next = NULL;
+}
 
-	if (send_ftransfer_requests(ft_sfd, &ft_addr, &a_ftrq, file_size)) {
-		debug_logerror("send_ftransfer_requests");
-		id_clear_transfer(id);
-		close(ft_sfd);
+/*
+ * Le noyau lit encore des blocs envoyes en MSG_ZEROCOPY : la socket reste
+ * ouverte, sans lecture ni envoi, jusqu'a leurs notifications. L'echeance
+ * d'inactivite borne l'attente.
+ */
+static uint8_t drain_connection(ConnectionInfos *infos)
+{
+	Reactor *reactor = infos->reactor;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	/* EPOLLERR, toujours surveille, signale les notifications */
+	ev.events = EPOLLET;
+	ev.data.ptr = infos;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, infos->sfd, &ev) < 0) {
+		perror("epoll_ctl: drain");
 		return 1;
 	}
 
-	id_clear_transfer(id);
-	array_free(&a_ftrq);
-	close(ft_sfd);
+	shutdown(infos->sfd, SHUT_WR);
+	infos->draining = 1;
+	infos->activity = reactor->now;
+	reactor->wheel.add(&reactor->wheel, &infos->idle,
+			   reactor->now + CONN_IDLE_SEC * 1000);
+
 	return 0;
 }
 
-static uint8_t server_callback(int sfd, ClientRQ *clientrq, ServerRQ *serverrq)
+static void close_connection(ConnectionInfos *infos)
 {
-	ConnectionInfos *infos;
-	coderq_t type = serverrq->type;
-	if (type == DOWNLOAD) {
-		infos = m_connection_infos.get(&m_connection_infos, (size_t) sfd);
-		if (infos == NULL)
-			return 1;
-
-		uint16_t id = get_id(serverrq->cl.header);
-		if (handle_file_dowload(id, clientrq->cl.count, &infos->addr))
-			return 1;
+	timer_cancel(&infos->idle);
+	release_connection(infos);
+
+	if (!infos->draining &&
+	    infos->out.complete(&infos->out, infos->sfd) == 0 &&
+	    output_queue_busy(&infos->out) && drain_connection(infos) == 0)
+		return;
+
+	/* Blocs encore lus par le noyau : le RST vide la file d'envoi avant
+	 * qu'ils soient liberes */
+	if (output_queue_busy(&infos->out)) {
+		struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(infos->sfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
 	}
 
-	return 0;
+	/* La fermeture retire aussi la socket de l'ensemble epoll */
+	close(infos->sfd);
+	if (infos->download != 0)
+		id_clear_transfer(infos->download);
+	ring_buffer_free(&infos->in);
+	output_queue_free(&infos->out);
+	free(infos);
 }
 
-static uint8_t handle_tcp_connection(int client_sfd, uint8_t *close_connection)
+/*
+ * Traite une requete deja recue et place sa reponse dans la file de sortie.
+ * Retourne 1 uniquement en cas d'erreur fatale pour le serveur, les erreurs
+ * propres au client se contentent de demander la fermeture de la connexion.
+ */
+static uint8_t handle_client_request(ConnectionInfos *infos, ClientRQ *clientrq,
+				     uint8_t *close_connection)
 {
+	debug_clientrq(clientrq);
+
 	Array a_serverrq;
-	memset(&a_serverrq, 0, sizeof(a_serverrq));
 	if (array_new(&a_serverrq, sizeof(ServerRQ), 0)) {
 		logerror("array_new: a_serverrq");
 		return 1;
 	}
 
+	uint64_t lsn = wal_last();
+	if (handle_tcp_request(&a_serverrq, clientrq)) {
+		debug_logerror("handle_tcp_request");
+		array_free(&a_serverrq);
+		return 1;
+	}
+
+	/* La requete a ete journalisee : sa reponse attendra le journal */
+	if (wal_last() != lsn)
+		infos->wal_lsn = wal_last();
+
+	/* Les billets de LASTPOSTS sont affiches a l'encodage, une fois leurs
+	 * pseudos resolus */
 	ServerRQ *serverrq = a_serverrq.data;
+	if (serverrq->type != LASTPOSTS)
+		debug_serverrq(serverrq);
+
+	if (write_server_request(&infos->out, serverrq, infos->framed)) {
+		debug_logerror("write_server_request");
+		array_free(&a_serverrq);
+		*close_connection = 1;
+		return 0;
+	}
 
+	uint16_t id = get_id(serverrq->cl.header);
+	coderq_t rqtype = serverrq->type;
+	log_to_file(LOG_REQUEST_FORMAT, strcoderq(rqtype), id, strerrno());
+
+	if (server_callback(infos, clientrq, serverrq))
+		debug_logerror("server_callback");
+
+	array_free(&a_serverrq);
+	return 0;
+}
+
+/*
+ * Traite les requetes disponibles sur une connexion, dans l'ordre de
+ * reception, tant que sa file de sortie n'est pas trop remplie et qu'aucun
+ * telechargement n'attend le depart de sa reponse.
+ * Sans keep-alive, la connexion est fermee apres la premiere qui n'est pas
+ * un CONNOPT : un client peut passer en mode a trames pour un transfert.
+ */
+static uint8_t handle_tcp_connection(ConnectionInfos *infos,
+				     uint8_t *close_connection)
+{
 	ClientRQ clientrq;
-	memset(&clientrq, 0, sizeof(clientrq));
 
-	ConnectionInfos *infos = m_connection_infos.get(&m_connection_infos,
-							(size_t) client_sfd);
-	if (infos == NULL) {
-		logerror("No connection infos");
-		return 1;
+	while (!*close_connection && !infos->closing && infos->download == 0) {
+		if (infos->out.pending >= OUTPUT_HIGH_WATER) {
+			infos->paused = 1;
+			return 0;
+		}
+
+		memset(&clientrq, 0, sizeof(clientrq));
+
+		/* En mode edge-triggered, on lit jusqu'a EAGAIN */
+		int8_t err = recv_client_request(infos->sfd, &clientrq,
+						 &infos->in, infos->framed);
+		if (err == 1) {
+			infos->readable = 0;
+			return 0;
+		}
+
+		/* Le client a pu fermer sa moitie : on envoie quand meme les
+		 * reponses deja en attente avant de fermer */
+		if (err < 0) {
+			debug_logerror("recv_client_request");
+			infos->readable = 0;
+			infos->closing = 1;
+			return 0;
+		}
+
+		if (handle_client_request(infos, &clientrq, close_connection))
+			return 1;
+
+		if (!infos->keep_alive && clientrq.type != CONNOPT)
+			infos->closing = 1;
 	}
 
+	return 0;
+}
 
-	if (recv_client_request(client_sfd, &clientrq, &infos->rb_rq)) {
-		debug_logerror("recv_client_request");
-		close(client_sfd);
+/*
+ * Envoie ce qui peut l'etre de la file de sortie et reprend la lecture
+ * une fois qu'elle est redescendue sous le seuil bas.
+ */
+static uint8_t flush_connection(ConnectionInfos *infos)
+{
+	/* Le reacteur ne bloque pas : la connexion est reprise plus tard.
+	 * Une reponse dont les ecritures sont perdues ne part pas. */
+	int8_t committed = wal_committed(infos->wal_lsn);
+	if (committed < 0) {
+		logerror("journal lost, reply dropped");
 		return 1;
 	}
+	if (committed == 0) {
+		hold_connection(infos);
+		return 0;
+	}
 
-	debug_clientrq(&clientrq);
+	/* Les blocs d'un envoi MSG_ZEROCOPY retarderaient la fermeture */
+	if (infos->closing)
+		infos->out.zerocopy = 0;
 
-	if (handle_tcp_request(&a_serverrq, &clientrq)) {
-		debug_logerror("handle_tcp_request");
-		close(client_sfd);
+	int8_t err = infos->out.flush(&infos->out, infos->sfd);
+	if (err < 0) {
+		debug_logerror("flush");
 		return 1;
 	}
 
-	debug_serverrq(serverrq);
+	/* La reponse au telechargement est partie jusqu'au dernier octet */
+	if (err == 0 && infos->download != 0)
+		start_download(infos);
 
-	if (send_server_request(client_sfd, serverrq)) {
-		debug_logerror("send_server_request");
-		array_free(&a_serverrq);
-		close(client_sfd);
+	if (infos->paused && infos->out.pending <= OUTPUT_LOW_WATER)
+		infos->paused = 0;
+
+	return 0;
+}
+
+static uint8_t handle_connection_event(ConnectionInfos *infos, uint32_t events,
+				       uint8_t *close_connection)
+{
+	/* EPOLLERR signale aussi les notifications MSG_ZEROCOPY */
+	if (events & EPOLLERR) {
+		int so_error = 0;
+		socklen_t len = sizeof(so_error);
+		getsockopt(infos->sfd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+
+		if (so_error || infos->out.complete(&infos->out, infos->sfd) < 0) {
+			*close_connection = 1;
+			return 0;
+		}
+	}
+
+	if (events & EPOLLHUP) {
+		*close_connection = 1;
+		return 0;
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP))
+		infos->readable = 1;
+
+	/*
+	 * Aucun nouvel evenement n'arrivera pour des donnees deja presentes :
+	 * on alterne envoi et lecture jusqu'a bloquer sur l'un des deux.
+	 */
+	while (1) {
+		if (flush_connection(infos)) {
+			*close_connection = 1;
+			return 0;
+		}
+
+		if (!infos->readable || infos->paused || infos->closing ||
+		    infos->download != 0)
+			break;
+
+		if (handle_tcp_connection(infos, close_connection))
+			return 1;
+
+		if (*close_connection)
+			return 0;
+	}
+
+	if (infos->closing && infos->out.pending == 0)
+		*close_connection = 1;
+
+	return 0;
+}
+
+/*
+ * Le journal a ete ecrit : les connexions en attente envoient leurs
+ * reponses, celles qui attendent encore se remettent dans la liste.
+ */
+static uint8_t resume_held_connections(Reactor *reactor)
+{
+	uint64_t count;
+	if (read(reactor->wal_efd, &count, sizeof(count)) < 0 &&
+	    errno != EAGAIN)
+		perror("read: eventfd");
+
+	ConnectionInfos *infos = reactor->held;
+	reactor->held = NULL;
+	while (infos != NULL) {
+		ConnectionInfos *next = infos->held_next;
+		infos->held = 0;
+		infos->held_prev = NULL;
+		infos->held_next = NULL;
+
+		uint8_t cl_con = 0;
+		if (handle_connection_event(infos, 0, &cl_con))
+			return 1;
+
+		if (cl_con)
+			close_connection(infos);
+		infos = next;
+	}
+
+	return 0;
+}
+
+/* Ferme la connexion restee muette, sinon repousse l'echeance */
+static void expire_connection(void *data)
+{
+	ConnectionInfos *infos = data;
+	Reactor *reactor = infos->reactor;
+	uint64_t deadline = infos->activity + CONN_IDLE_SEC * 1000;
+
+	if (deadline <= reactor->now) {
+		debug_log("idle connection closed");
+		close_connection(infos);
+		return;
+	}
+
+	reactor->wheel.add(&reactor->wheel, &infos->idle, deadline);
+}
+
+static uint8_t add_new_connection(Reactor *reactor, int sfd, SA_IN6 *addr)
+{
+	ConnectionInfos *infos = calloc(1, sizeof(*infos));
+	if (infos == NULL) {
+		close(sfd);
 		return 1;
 	}
 
-	uint16_t id = get_id(serverrq->cl.header);
-	coderq_t rqtype = serverrq->type;
-	log_to_file(LOG_REQUEST_FORMAT, strcoderq(rqtype), id, strerrno());
+	infos->sfd = sfd;
+	infos->addr = *addr;
+	infos->out = output_queue_init();
+	if (ring_buffer_new(&infos->in, RECV_RING_SIZE)) {
+		close(sfd);
+		free(infos);
+		return 1;
+	}
 
-	if (server_callback(client_sfd, &clientrq, serverrq)) {
-		debug_logerror("server_callback");
+	infos->reactor = reactor;
+	infos->activity = reactor->now;
+	timer_init(&infos->idle, expire_connection, infos);
+	reactor->wheel.add(&reactor->wheel, &infos->idle,
+			   reactor->now + CONN_IDLE_SEC * 1000);
+
+	/* Sans support du noyau, les gros envois sont simplement copies */
+	output_queue_zerocopy(&infos->out, sfd);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	/* EPOLLOUT signale qu'une file de sortie bloquee peut repartir */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = infos;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+		perror("epoll_ctl");
+		close_connection(infos);
 		return 1;
 	}
 
-	array_free(&a_serverrq);
-	*close_connection = 1;
 	return 0;
 }
 
-static void add_new_connections(int sfd, SA_IN6 *addr)
+/*
+ * Sans descripteur libre, accept echoue sans retirer la connexion de la
+ * file d'attente : en mode ET, l'ecoute ne serait plus signalee. Le
+ * descripteur de reserve est libere le temps de l'accepter et de la fermer.
+ */
+static uint8_t refuse_connection(Reactor *reactor)
 {
-	struct pollfd *fds = m_fds.data;
-	struct pollfd pfd = {.fd = sfd, .events = POLLIN };
-
-	ConnectionInfos infos;
-	memset(&infos, 0, sizeof(infos));
-
-	infos.addr = *addr;
-	m_connection_infos.set(&m_connection_infos, (size_t) sfd, &infos);
-	for (size_t i = 0; i < m_fds.length; i++) {
-		if (fds[i].fd == -1) {
-			fds[i] = pfd;
-			return;
-		}
-	}
+	if (reactor->spare_fd < 0)
+		return 1;
 
-	m_fds.append(&m_fds, &pfd);
+	close(reactor->spare_fd);
+	int sfd = accept4(reactor->server.sfd, NULL, NULL, SOCK_NONBLOCK);
+	if (sfd >= 0)
+		close(sfd);
+
+	reactor->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return sfd < 0;
 }
 
-static uint8_t accept_new_connections(void)
+static uint8_t accept_new_connections(Reactor *reactor)
 {
 	SA_IN6 addr;
-	memset(&addr, 0, sizeof(addr));
-
+	socklen_t addrlen;
 	int sfd;
-	socklen_t addrlen = sizeof(addr);
+
 	while (1) {
-		sfd = accept(m_server.sfd, (SA *) &addr, &addrlen);
+		memset(&addr, 0, sizeof(addr));
+		addrlen = sizeof(addr);
+
+		sfd = accept4(reactor->server.sfd, (SA *) &addr, &addrlen,
+			      SOCK_NONBLOCK);
 		if (sfd < 0 && SBLOCK)
 			break;
 
+		if (sfd < 0 && (errno == ECONNABORTED || errno == EINTR))
+			continue;
+
+		/* On vide la file jusqu'a EAGAIN, meme a court de descripteurs */
+		if (sfd < 0 && (errno == EMFILE || errno == ENFILE)) {
+			logerror("accept: no descriptor left, connection refused");
+			if (refuse_connection(reactor))
+				break;
+			continue;
+		}
+
 		if (sfd < 0) {
 			perror("accept");
 			return 1;
 		}
 
-		add_new_connections(sfd, &addr);
+		if (add_new_connection(reactor, sfd, &addr))
+			logerror("add_new_connection");
 	}
 
 	return 0;
 }
 
-static uint8_t handle_ready_fds(void)
+static uint8_t handle_ready_fds(Reactor *reactor, struct epoll_event *events,
+				int nfds)
 {
-	struct pollfd *fds = m_fds.data;
-	int current_size = (int) m_fds.length;
+	uint8_t wal_ready = 0;
 
-	for (int i = 0; i < current_size; i++) {
-		if (!(fds[i].revents & POLLIN))
+	for (int i = 0; i < nfds; i++) {
+		ConnectionInfos *infos = events[i].data.ptr;
+
+		/* Des echeances partagees sont arrivees */
+		if (events[i].data.ptr == &m_timer_event) {
+			timer_service_run();
 			continue;
+		}
 
-		uint8_t is_tcpserver = (fds[i].fd == m_server.sfd);
-		uint8_t is_tcpclient = (!is_tcpserver);
+		/* Traite apres le lot : une connexion reprise peut etre
+		 * liberee alors qu'un evenement suivant la designe encore */
+		if (events[i].data.ptr == &reactor->wal_efd) {
+			wal_ready = 1;
+			continue;
+		}
 
 		/* Cas ou il y'a des connections entrantes. */
-		if (is_tcpserver && accept_new_connections()) {
-			logerror("accept_new_connections");
-			return 1;
+		if (infos == NULL) {
+			if (accept_new_connections(reactor)) {
+				logerror("accept_new_connections");
+				return 1;
+			}
+			continue;
+		}
+
+		infos->activity = reactor->now;
+
+		/* La fermeture se termine une fois les notifications recues */
+		if (infos->draining) {
+			if (infos->out.complete(&infos->out, infos->sfd) < 0 ||
+			    !output_queue_busy(&infos->out))
+				close_connection(infos);
+			continue;
 		}
 
 		uint8_t cl_con = 0;
-		/* Une socket TCP est prete pour la reception. */
-		if (is_tcpclient && handle_tcp_connection(fds[i].fd, &cl_con)) {
-			logerror("handle_tcp_connection");
+		/* Une socket TCP est prete pour la reception ou l'envoi. */
+		if (handle_connection_event(infos, events[i].events, &cl_con)) {
+			logerror("handle_connection_event");
 			return 1;
 		}
 
-		ConnectionInfos *infos;
-		infos = m_connection_infos.get(&m_connection_infos,
-					       (size_t) fds[i].fd);
-		if (cl_con && infos != NULL) {
-			close(fds[i].fd);
-			fds[i].fd = -1;
-			memset(infos, 0, sizeof(ConnectionInfos));
-		}
+		if (cl_con)
+			close_connection(infos);
+	}
+
+	if (wal_ready && resume_held_connections(reactor)) {
+		logerror("resume_held_connections");
+		return 1;
 	}
 
 	return 0;
 }
 
-void *tcp_server_loop(__attribute__((unused)) void *args)
+void *tcp_server_loop(void *args)
 {
-	int timeout = 1000 * FT_TIMEOUT_SEC;
+	Reactor *reactor = args;
+	struct epoll_event events[MAX_EVENTS];
 	uint8_t active = 1;
 
 	while (active) {
-		check_transfers_timeout();
-		switch (poll(m_fds.data, (nfds_t) m_fds.length, timeout)) {
-		case -1:
-			perror("poll");
-			active = 0;
-			break;
+		/* Endormi jusqu'a la prochaine echeance de ses connexions */
+		int timeout = timer_wheel_timeout(&reactor->wheel,
+						  timer_clock_ms());
 
-		case 0:
-			break;
-
-		default:
-			active = !handle_ready_fds();
-			if (!active)
-				logerror("handle_ready_fds");
+		int nfds = epoll_wait(reactor->epfd, events, MAX_EVENTS, timeout);
+		if (nfds < 0 && errno == EINTR)
+			continue;
 
+		if (nfds < 0) {
+			perror("epoll_wait");
 			break;
 		}
+
+		reactor->now = timer_clock_ms();
+		active = !handle_ready_fds(reactor, events, nfds);
+		if (!active)
+			logerror("handle_ready_fds");
+
+		timer_wheel_run(&reactor->wheel, reactor->now);
 	}
 
 	return NULL;
 }
 
-uint8_t tcp_server_init(in_port_t port)
+static uint8_t reactor_init(Reactor *reactor, uint8_t index, in_port_t port)
 {
-	if (create_tcp_server(&m_server, port))
+	reactor->index = index;
+	if (create_tcp_server(&reactor->server, port))
+		return 1;
+
+	reactor->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (reactor->spare_fd < 0) {
+		perror("open: spare descriptor");
 		return 1;
+	}
 
-	if (array_new(&m_fds, sizeof(struct pollfd), ID_MAX))
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epfd < 0) {
+		perror("epoll_create1");
 		return 1;
+	}
 
-	if (array_new(&m_connection_infos, sizeof(ConnectionInfos), ID_MAX))
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->server.sfd, &ev) < 0) {
+		perror("epoll_ctl: tcp server");
 		return 1;
+	}
+
+	reactor->now = timer_clock_ms();
+	timer_wheel_new(&reactor->wheel, reactor->now);
 
-	struct pollfd pfd = { .fd = m_server.sfd, .events = POLLIN };
-	if (m_fds.append(&m_fds, &pfd)) {
-		logerror("append: m_fds");
+	/* Reveille par le thread du journal apres chaque ecriture */
+	reactor->held = NULL;
+	reactor->wal_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->wal_efd < 0) {
+		perror("eventfd");
 		return 1;
 	}
 
-	logsuccess("TCP Server Initialazed");
+	ev.events = EPOLLIN;
+	ev.data.ptr = &reactor->wal_efd;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wal_efd,
+		      &ev) < 0) {
+		perror("epoll_ctl: journal");
+		return 1;
+	}
+
+	if (wal_watch(reactor->wal_efd))
+		return 1;
+
+	/* Les echeances partagees sont servies par un seul reacteur */
+	if (index != 0)
+		return 0;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_timer_event;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, timer_service_fd(),
+		      &ev) < 0) {
+		perror("epoll_ctl: timer service");
+		return 1;
+	}
+
+	return 0;
+}
+
+void *tcp_server_reactor(uint8_t index)
+{
+	if (index >= m_reactor_count)
+		return NULL;
+
+	return m_reactors + index;
+}
+
+uint8_t tcp_server_init(in_port_t port, uint8_t reactor_count)
+{
+	m_reactors = calloc(reactor_count, sizeof(*m_reactors));
+	if (m_reactors == NULL)
+		return 1;
+
+	m_reactor_count = reactor_count;
+	for (uint8_t i = 0; i < reactor_count; i++) {
+		if (reactor_init(m_reactors + i, i, port))
+			return 1;
+	}
+
+	logsuccess("TCP Server Initialazed (%u reactors)", reactor_count);
 	return 0;
 }
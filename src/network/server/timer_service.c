@@ -0,0 +1,123 @@
+#include "network/server/timer_service.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+
+/*
+ * Echeances partagees : expiration des transferts et envoi des
+ * notifications. Le verrou est toujours pris en dernier.
+ */
+static TimerWheel m_wheel;
+static pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int m_tfd = -1;
+static uint64_t m_armed = UINT64_MAX;  /* Echeance programmee du timerfd */
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* Must be called with the lock held. */
+static void arm(uint64_t deadline)
+{
+	if (deadline == m_armed)
+		return;
+
+	/* Une valeur nulle desarme le timerfd */
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if (deadline != UINT64_MAX) {
+		if (deadline == 0)
+			deadline = 1;
+		spec.it_value.tv_sec = (time_t) (deadline / 1000);
+		spec.it_value.tv_nsec = (long) (deadline % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(m_tfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		perror("timerfd_settime");
+		return;
+	}
+	m_armed = deadline;
+}
+
+/* Must be called with the lock held. */
+static void schedule(Timer *timer, uint64_t delay)
+{
+	m_wheel.add(&m_wheel, timer, timer_clock_ms() + delay);
+
+	/* Le timerfd n'est avance que si besoin, une annulation ne le
+	 * retarde pas : au pire le reacteur se reveille pour rien */
+	if (timer->expires < m_armed)
+		arm(timer->expires);
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t timer_service_init(void)
+{
+	timer_wheel_new(&m_wheel, timer_clock_ms());
+
+	m_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_tfd < 0) {
+		perror("timerfd_create");
+		return 1;
+	}
+
+	return 0;
+}
+
+int timer_service_fd(void)
+{
+	return m_tfd;
+}
+
+void timer_service_mod(Timer *timer, uint64_t delay)
+{
+	pthread_mutex_lock(&m_mutex);
+	schedule(timer, delay);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void timer_service_add(Timer *timer, uint64_t delay)
+{
+	pthread_mutex_lock(&m_mutex);
+	if (!timer_pending(timer))
+		schedule(timer, delay);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void timer_service_cancel(Timer *timer)
+{
+	pthread_mutex_lock(&m_mutex);
+	timer_cancel(timer);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void timer_service_run(void)
+{
+	uint64_t expirations;
+	if (read(m_tfd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		perror("read: timerfd");
+
+	uint64_t now = timer_clock_ms();
+	while (1) {
+		pthread_mutex_lock(&m_mutex);
+		Timer *timer = m_wheel.expire(&m_wheel, now);
+		if (timer == NULL) {
+			/* Le timerfd a expire, il est desarme */
+			m_armed = UINT64_MAX;
+			arm(m_wheel.next(&m_wheel));
+			pthread_mutex_unlock(&m_mutex);
+			return;
+		}
+		pthread_mutex_unlock(&m_mutex);
+
+		timer->callback(timer->data);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
@@ -0,0 +1,277 @@
+#include "network/server/transfer_engine.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "data_structures/queue.h"
+
+#include "network/datagram.h"
+#include "network/file_transfer.h"
+#include "network/send_window.h"
+
+#include "network/server/data.h"
+#include "network/server/network.h"
+
+#include "system/logger.h"
+
+
+/*
+ * Un telechargement sortant. Le fichier n'est lu qu'au premier tour,
+ * par un thread du moteur, jamais par un reacteur TCP.
+ */
+typedef struct
+{
+	uint16_t id;
+	uint16_t owner;
+	char file_path[MAX_DATALEN];
+	SA_IN6 addr;
+	int sfd;
+	size_t chunk;       /* Taille de bloc negociee */
+	size_t first;       /* Premier bloc qui manque au client */
+	uint8_t held[FT_ACK_BITS / 8];  /* Blocs suivants qu'il a deja */
+
+	uint8_t loaded;
+	FileMap file;       /* Les paquets sont lus dans la projection */
+	SendWindow window;
+	uint8_t idle;       /* Dernier tour sans envoi ni acquittement */
+	int wait;           /* Puis delai avant d'avoir de quoi envoyer, en ms */
+} OutboundTransfer;
+
+/* Files de 'OutboundTransfer *' */
+static Queue m_running;  /* Transferts actifs, servis a tour de role */
+static Queue m_waiting;  /* Au dela de TRANSFER_ACTIVE_MAX */
+static size_t m_active;
+
+/* Tours consecutifs sans rien a faire, remis a zero par un tour utile */
+static size_t m_idle;
+static int m_wait;       /* Plus petit delai de ces tours */
+
+/* Sockets des transferts charges, les workers y attendent les ACK */
+static int m_epfd;
+
+static pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  m_cond  = PTHREAD_COND_INITIALIZER;
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+static OutboundTransfer *pop_transfer(Queue *queue)
+{
+	Node *node = queue->dequeue(queue);
+	if (node == NULL)
+		return NULL;
+
+	OutboundTransfer *transfer = *(OutboundTransfer **) node->data;
+	node_free(node);
+	return transfer;
+}
+
+static void transfer_free(OutboundTransfer *transfer)
+{
+	if (transfer->loaded)
+		file_unmap(&transfer->file);
+
+	if (transfer->sfd >= 0)
+		close(transfer->sfd);
+
+	id_clear_transfer(transfer->id);
+	free(transfer);
+}
+
+static uint8_t transfer_load(OutboundTransfer *transfer)
+{
+	if (file_map(&transfer->file, transfer->file_path))
+		return 1;
+
+	transfer->loaded = 1;
+	header_t header = (header_t) (DOWNLOAD | (transfer->id << CODERQ_BITSLEN));
+	header_t fin = (header_t) (FTFIN | (transfer->id << CODERQ_BITSLEN));
+	send_window_init(&transfer->window, &transfer->file, transfer->chunk,
+			 header, fin);
+	send_window_skip(&transfer->window, transfer->first, transfer->held);
+
+	transfer->sfd = socket(DOMAIN, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (transfer->sfd < 0)
+		return 1;
+
+	/* Retire de l'epoll a la fermeture de la socket */
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = transfer->sfd;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, transfer->sfd, &ev) < 0)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Applique les acquittements recus puis envoie au plus TRANSFER_QUANTUM
+ * paquets. Retourne 1 si le client a tout recu, 0 sinon, -1 en cas
+ * d'erreur ou si le client ne repond plus.
+ */
+static int8_t transfer_step(OutboundTransfer *transfer)
+{
+	if (!transfer->loaded && transfer_load(transfer))
+		return -1;
+
+	SendWindow *w = &transfer->window;
+	int acked = send_window_read_acks(w, transfer->sfd);
+	if (acked < 0)
+		return -1;
+
+	if (w->done)
+		return 1;
+
+	if (send_window_timeout(w))
+		return -1;
+
+	int sent = send_window_pump(w, transfer->sfd, &transfer->addr,
+				    TRANSFER_QUANTUM);
+	if (sent < 0)
+		return -1;
+
+	transfer->idle = acked == 0 && sent == 0;
+	if (transfer->idle)
+		transfer->wait = send_window_wait(w);
+
+	return 0;
+}
+
+/* Bloque jusqu'a ce qu'un transfert actif soit pret */
+static OutboundTransfer *next_transfer(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	while (m_running.length == 0)
+		pthread_cond_wait(&m_cond, &m_mutex);
+
+	OutboundTransfer *transfer = pop_transfer(&m_running);
+	pthread_mutex_unlock(&m_mutex);
+
+	return transfer;
+}
+
+/*
+ * Remet un transfert inacheve en fin de file. Un transfert termine libere
+ * sa place pour le premier en attente.
+ * Si tous les transferts actifs attendent un acquittement ou leurs jetons,
+ * retourne le delai a attendre en ms, -1 sinon.
+ */
+static int reschedule(OutboundTransfer *transfer, uint8_t done)
+{
+	pthread_mutex_lock(&m_mutex);
+	if (!done && transfer->idle) {
+		if (m_idle == 0 || transfer->wait < m_wait)
+			m_wait = transfer->wait;
+		m_idle++;
+	} else {
+		m_idle = 0;
+	}
+
+	if (!done && m_running.enqueue(&m_running, &transfer) == 0) {
+		int wait = m_idle >= m_running.length ? m_wait : -1;
+		pthread_cond_signal(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+		return wait;
+	}
+
+	OutboundTransfer *waiting = pop_transfer(&m_waiting);
+	if (waiting == NULL || m_running.enqueue(&m_running, &waiting))
+		m_active--;
+	else
+		pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	DgramStats *stats = &transfer->window.stats;
+	log_to_file(LOG_TRANSFER_FORMAT, transfer->id, transfer->owner,
+		    stats->packets,
+		    stats->messages, stats->syscalls,
+		    dgram_segments_per_call(stats));
+	transfer_free(transfer);
+	return -1;
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t transfer_engine_init(void)
+{
+	m_running = queue_init(sizeof(OutboundTransfer *));
+	m_waiting = queue_init(sizeof(OutboundTransfer *));
+	m_active = 0;
+	m_idle = 0;
+
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0)
+		return 1;
+
+	return 0;
+}
+
+uint8_t transfer_engine_submit(uint16_t id, SA_IN6 *addr, uint32_t first,
+			       const uint8_t *held)
+{
+	OutboundInfos infos;
+	if (transfer_send(id, &infos))
+		return 1;
+
+	OutboundTransfer *transfer = calloc(1, sizeof(*transfer));
+	if (transfer == NULL) {
+		id_clear_transfer(id);
+		return 1;
+	}
+
+	transfer->id = id;
+	transfer->owner = infos.owner;
+	transfer->addr = *addr;
+	transfer->sfd = -1;
+	transfer->chunk = infos.chunk;
+	transfer->first = first;
+	memcpy(transfer->held, held, sizeof(transfer->held));
+	memcpy(transfer->file_path, infos.file_path, MAX_DATALEN);
+
+	pthread_mutex_lock(&m_mutex);
+	int err;
+	if (m_active < TRANSFER_ACTIVE_MAX) {
+		err = m_running.enqueue(&m_running, &transfer);
+		if (err == 0) {
+			m_active++;
+			pthread_cond_signal(&m_cond);
+		}
+	} else {
+		err = m_waiting.enqueue(&m_waiting, &transfer);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	if (err) {
+		transfer_free(transfer);
+		return 1;
+	}
+
+	return 0;
+}
+
+void *transfer_engine_loop(__attribute__((unused)) void *args)
+{
+	while (1) {
+		OutboundTransfer *transfer = next_transfer();
+
+		int8_t err = transfer_step(transfer);
+		if (err < 0)
+			logerror("download %u of user %u failed", transfer->id,
+				 transfer->owner);
+
+		/* Rien a envoyer nulle part : attente d'un ACK, de jetons ou du RTO */
+		int wait = reschedule(transfer, err != 0);
+		if (wait > TRANSFER_IDLE_MS)
+			wait = TRANSFER_IDLE_MS;
+		if (wait > 0) {
+			struct epoll_event ev;
+			epoll_wait(m_epfd, &ev, 1, wait);
+		}
+	}
+
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
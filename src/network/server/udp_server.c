@@ -1,31 +1,178 @@
 #include "network/server/udp_server.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "data_structures/array.h"
+
+#include "network/datagram.h"
+#include "network/file_transfer.h"
 
 #include "network/server/server.h"
 #include "network/server/network.h"
 #include "network/server/request_manager.h"
+#include "network/server/wal.h"
 
 #include "system/logger.h"
 
+/* Acquittement final d'un envoi, retenu jusqu'a l'ecriture de son billet */
+typedef struct
+{
+	FTransferAck ack;
+	SA_IN6 addr;
+	uint64_t lsn;
+	uint8_t copies;
+} HeldAck;
+
 static Server m_server;
+static DgramSlots m_slots;
+
+/* Ecrit par le thread du journal, surveille tant que 'm_held' n'est pas
+ * vide */
+static int m_wal_efd = -1;
+static Array m_held;
+
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/*
+ * Envoie l'acquittement, ou le retient si ce qu'il annonce n'est pas encore
+ * dans le journal : le thread UDP ne bloque pas sur le fdatasync.
+ */
+static void send_ack(SA_IN6 *addr, FTransferAck *ack, uint8_t copies,
+		     uint64_t lsn)
+{
+	int8_t committed = wal_committed(lsn);
+	if (committed < 0) {
+		logerror("journal lost, acknowledgement dropped");
+		return;
+	}
+
+	if (committed == 0) {
+		HeldAck held = { *ack, *addr, lsn, copies };
+		if (m_held.append(&m_held, &held))
+			logerror("held acknowledgement dropped");
+		return;
+	}
+
+	if (dgram_send_ack(m_server.sfd, addr, ack, copies))
+		perror("sendto");
+}
 
+/* Le journal a ete ecrit : les acquittements retenus partent dans l'ordre */
+static void release_acks(void)
+{
+	uint64_t count;
+	if (read(m_wal_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("read: eventfd");
+
+	HeldAck *held = m_held.data;
+	size_t kept = 0;
+	for (size_t i = 0; i < m_held.length; i++) {
+		if (wal_committed(held[i].lsn) == 0) {
+			held[kept++] = held[i];
+			continue;
+		}
+
+		send_ack(&held[i].addr, &held[i].ack, held[i].copies,
+			 held[i].lsn);
+	}
+
+	m_held.length = kept;
+}
+
+/*
+ * Sans acquittement retenu, le thread attend directement les paquets ;
+ * sinon il attend aussi le journal.
+ * Retourne 1 si des paquets sont a lire, -1 en cas d'erreur.
+ */
+static int wait_packets(void)
+{
+	if (m_held.length == 0)
+		return 1;
+
+	struct pollfd fds[2] = {
+		{ .fd = m_server.sfd, .events = POLLIN },
+		{ .fd = m_wal_efd, .events = POLLIN }
+	};
+	if (poll(fds, 2, -1) < 0)
+		return -1;
+
+	if (fds[1].revents & POLLIN)
+		release_acks();
+
+	return (fds[0].revents & POLLIN) != 0;
+}
+
+/*
+ * Traite les paquets d'un emplacement, plusieurs si le noyau les a
+ * coalesces. Les compteurs de reception sont notes a chaque envoi termine.
+ */
+static void handle_slot(size_t i)
+{
+	size_t len;
+	size_t segment;
+	SA_IN6 *from;
+	char *packets = dgram_slot(&m_slots, i, &len, &segment, &from);
+
+	/* Datagramme plus grand qu'un emplacement : ignore */
+	if (packets == NULL)
+		return;
+
+	for (size_t offset = 0; offset < len; offset += segment) {
+		size_t size = len - offset < segment ? len - offset : segment;
+
+		/* L'acquittement repart vers le port d'envoi du client. Le
+		 * billet d'un envoi termine a ete journalise par ce thread :
+		 * l'acquittement final attend ses ecritures. */
+		FTransferAck ack;
+		uint8_t copies = handle_upload_packet(packets + offset, size,
+						      &ack);
+		if (copies > 0)
+			send_ack(from, &ack, copies,
+				 ack.flags & FTACK_COMPLETE ? wal_last() : 0);
+
+		if (copies == FT_ACK_REPEAT) {
+			DgramStats *stats = &m_slots.stats;
+			log_to_file(LOG_RECEIVE_FORMAT, stats->packets,
+				    stats->messages, stats->syscalls,
+				    dgram_segments_per_call(stats));
+		}
+	}
+}
 
 /* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
 
 void *udp_server_loop(__attribute__((unused)) void *args)
 {
-	ClientRQ clientrq;
-	ssize_t nbytes;
-
-	memset(&clientrq, 0, sizeof(clientrq));
 	while (1) {
-		nbytes = recv_datagrams(m_server.sfd, &clientrq);
-		if (nbytes < 0)
+		int ready = wait_packets();
+		if (ready < 0 && errno == EINTR)
+			continue;
+
+		if (ready < 0)
 			break;
 
-		if (handle_upload_packet(&clientrq, (size_t) nbytes))
+		if (ready == 0)
+			continue;
+
+		uint32_t dropped;
+		int count = dgram_recv(m_server.sfd, &m_slots, &dropped);
+		if (count < 0 && errno == EINTR)
+			continue;
+
+		if (count < 0)
 			break;
+
+		if (dropped > 0)
+			logerror("UDP receive queue full, %u datagrams dropped",
+				 dropped);
+
+		for (int i = 0; i < count; i++)
+			handle_slot((size_t) i);
 	}
 
 	return NULL;
@@ -36,6 +183,35 @@ uint8_t udp_server_init(in_port_t port)
 	if (create_udp_server(&m_server, port))
 		return 1;
 
+	/* Un emplacement par datagramme d'un lot, comme pour les envois */
+	size_t slot_size = DGRAM_PACKET_SIZE(file_chunk_max());
+	if (dgram_slots_new(&m_slots, dgram_batch(), slot_size)) {
+		logerror("UDP receive slots allocation");
+		return 1;
+	}
+
+	if (dgram_enable_drop_count(m_server.sfd))
+		perror("setsockopt: SO_RXQ_OVFL");
+
+	if (dgram_enable_gro(m_server.sfd))
+		perror("setsockopt: UDP_GRO");
+
+	if (array_new(&m_held, sizeof(HeldAck), 0)) {
+		logerror("array_new: m_held");
+		return 1;
+	}
+
+	m_wal_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wal_efd < 0) {
+		perror("eventfd");
+		return 1;
+	}
+
+	if (wal_watch(m_wal_efd)) {
+		logerror("wal_watch: UDP server");
+		return 1;
+	}
+
 	logsuccess("UDP Server Initialazed");
 	return 0;
 }
@@ -0,0 +1,410 @@
+#include "network/server/wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "data_structures/timer_wheel.h"
+
+#include "network/server/tcp_server.h"
+
+#include "system/logger.h"
+
+
+/* En-tete d'un enregistrement : somme (4), taille des donnees (2), type */
+#define HEADER_LEN   7
+
+/* Un par reacteur TCP, plus le serveur UDP */
+#define WATCH_MAX    (TCP_REACTOR_MAX + 1)
+
+#define BUFFER_INIT  4096
+
+typedef struct
+{
+	char *data;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static int m_fd = -1;
+static uint8_t m_mode = WAL_BATCH;
+
+/*
+ * Les ajouts sont copies dans 'm_pending' sous le verrou. Le thread du
+ * journal echange les deux tampons et ecrit 'm_writing' sans le verrou :
+ * tout ce qui est ajoute pendant son fdatasync part avec le suivant.
+ */
+static Buffer m_pending;
+static Buffer m_writing;
+static uint64_t m_appended;           /* Fin du dernier ajout */
+static atomic_uint_fast64_t m_durable; /* Fin de ce qui est ecrit */
+static uint8_t m_busy;                /* 'm_writing' est en cours d'ecriture */
+static uint8_t m_closed;
+static atomic_uchar m_failed;         /* Une ecriture a echoue */
+
+static pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_append_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t m_durable_cond = PTHREAD_COND_INITIALIZER;
+
+/* Reacteurs et serveur UDP reveilles apres chaque ecriture, enregistres au
+ * demarrage */
+static int m_watchers[WATCH_MAX];
+static size_t m_watcher_count;
+
+static _Thread_local uint64_t m_last;
+
+/* ---------------------------- PRIVATE FUNCTIONS --------------------------- */
+
+/* FNV-1a sur la taille, le type et les donnees */
+static uint32_t checksum(uint16_t len, uint8_t type, const char *data)
+{
+	uint8_t fields[3] = { (uint8_t) (len & 0xFF), (uint8_t) (len >> 8),
+			      type };
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(fields); i++) {
+		hash ^= fields[i];
+		hash *= 16777619u;
+	}
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t) data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint8_t buffer_reserve(Buffer *buf, size_t len)
+{
+	if (buf->length + len <= buf->capacity)
+		return 0;
+
+	size_t capacity = buf->capacity ? buf->capacity : BUFFER_INIT;
+	while (capacity < buf->length + len)
+		capacity *= 2;
+
+	char *data = realloc(buf->data, capacity);
+	if (data == NULL)
+		return 1;
+
+	buf->data = data;
+	buf->capacity = capacity;
+	return 0;
+}
+
+/*
+ * Rejoue les enregistrements complets et retourne la taille du journal
+ * valide : la suite, ecrite en partie avant un arret, est ignoree.
+ */
+static size_t replay(const char *log, size_t size,
+		     void (*apply) (uint8_t type, const char *data, size_t len))
+{
+	size_t pos = 0;
+	while (size - pos >= HEADER_LEN) {
+		uint32_t sum;
+		uint16_t len;
+		memcpy(&sum, log + pos, sizeof(sum));
+		memcpy(&len, log + pos + 4, sizeof(len));
+		uint8_t type = (uint8_t) log[pos + 6];
+
+		const char *data = log + pos + HEADER_LEN;
+		if (len > size - pos - HEADER_LEN ||
+		    checksum(len, type, data) != sum)
+			break;
+
+		apply(type, data, len);
+		pos += HEADER_LEN + len;
+	}
+
+	return pos;
+}
+
+static uint8_t write_records(const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(m_fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			perror("write: journal");
+			return 1;
+		}
+
+		data += n;
+		len -= (size_t) n;
+	}
+
+	return 0;
+}
+
+/* Ecrit et synchronise selon le mode, 1 si le disque a refuse */
+static uint8_t write_durable(const char *data, size_t len)
+{
+	if (write_records(data, len))
+		return 1;
+
+	if (m_mode != WAL_NONE && fdatasync(m_fd) < 0) {
+		perror("fdatasync: journal");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Retire du fichier ce qui suit 'start' : le journal garde une fin valide
+ * et le rejeu s'arrete au dernier enregistrement durable.
+ */
+static void fail(uint64_t start)
+{
+	logerror("journal: write failed, changes are refused from now on");
+	if (ftruncate(m_fd, (off_t) start) < 0)
+		perror("ftruncate: journal");
+	if (lseek(m_fd, (off_t) start, SEEK_SET) < 0)
+		perror("lseek: journal");
+
+	atomic_store(&m_failed, 1);
+}
+
+static void notify_watchers(void)
+{
+	uint64_t one = 1;
+	for (size_t i = 0; i < m_watcher_count; i++) {
+		if (write(m_watchers[i], &one, sizeof(one)) < 0 &&
+		    errno != EAGAIN)
+			perror("write: eventfd");
+	}
+}
+
+/*
+ * Ecrit le tampon pris par le thread du journal jusqu'a la position 'end'.
+ * Apres une erreur, 'm_durable' n'avance plus : les reponses en attente
+ * sont abandonnees et les ajouts suivants refuses.
+ */
+static void flush(uint64_t end)
+{
+	uint64_t start = atomic_load(&m_durable);
+	uint8_t err = write_durable(m_writing.data, m_writing.length);
+	m_writing.length = 0;
+
+	if (err)
+		fail(start);
+
+	pthread_mutex_lock(&m_mutex);
+	if (err)
+		m_pending.length = 0;
+	else
+		atomic_store_explicit(&m_durable, end, memory_order_release);
+	m_busy = 0;
+	pthread_cond_broadcast(&m_durable_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	if (m_mode == WAL_SYNC || err)
+		notify_watchers();
+}
+
+/* ---------------------------- PUBLIC FUNCTIONS ---------------------------- */
+
+uint8_t wal_open(const char *path,
+		 void (*apply) (uint8_t type, const char *data, size_t len))
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("open: journal");
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat: journal");
+		close(fd);
+		return 1;
+	}
+
+	size_t size = (size_t) st.st_size;
+	size_t valid = 0;
+	if (size > 0) {
+		char *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (log == MAP_FAILED) {
+			perror("mmap: journal");
+			close(fd);
+			return 1;
+		}
+
+		valid = replay(log, size, apply);
+		munmap(log, size);
+	}
+
+	/* Un enregistrement coupe par un arret est retire du journal */
+	if (valid < size) {
+		logerror("journal: %zu bytes dropped after the last record",
+			 size - valid);
+		if (ftruncate(fd, (off_t) valid) < 0) {
+			perror("ftruncate: journal");
+			close(fd);
+			return 1;
+		}
+	}
+
+	if (lseek(fd, (off_t) valid, SEEK_SET) < 0) {
+		perror("lseek: journal");
+		close(fd);
+		return 1;
+	}
+
+	m_fd = fd;
+	m_appended = valid;
+	atomic_store(&m_durable, valid);
+
+	return 0;
+}
+
+void wal_close(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	if (m_fd < 0) {
+		pthread_mutex_unlock(&m_mutex);
+		return;
+	}
+
+	m_closed = 1;
+	pthread_cond_signal(&m_append_cond);
+	while (m_busy)
+		pthread_cond_wait(&m_durable_cond, &m_mutex);
+
+	/* Le thread du journal s'est arrete, le reste est ecrit ici */
+	if (!atomic_load(&m_failed)) {
+		if (write_durable(m_pending.data, m_pending.length))
+			fail(atomic_load(&m_durable));
+		else
+			atomic_store(&m_durable, m_appended);
+	}
+
+	close(m_fd);
+	m_fd = -1;
+	pthread_cond_broadcast(&m_durable_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	free(m_pending.data);
+	free(m_writing.data);
+	memset(&m_pending, 0, sizeof(m_pending));
+	memset(&m_writing, 0, sizeof(m_writing));
+}
+
+void wal_set_mode(uint8_t mode)
+{
+	m_mode = mode;
+}
+
+uint64_t wal_append(uint8_t type, const void *data, size_t len)
+{
+	if (len > WAL_RECORD_MAX - HEADER_LEN)
+		return 0;
+
+	/* L'en-tete est calcule avant de prendre le verrou */
+	char header[HEADER_LEN];
+	uint16_t size = (uint16_t) len;
+	uint32_t sum = checksum(size, type, data);
+	memcpy(header, &sum, sizeof(sum));
+	memcpy(header + 4, &size, sizeof(size));
+	header[6] = (char) type;
+
+	pthread_mutex_lock(&m_mutex);
+	if (m_fd < 0 || m_closed || atomic_load(&m_failed) ||
+	    buffer_reserve(&m_pending, HEADER_LEN + len)) {
+		pthread_mutex_unlock(&m_mutex);
+		return 0;
+	}
+
+	char *dst = m_pending.data + m_pending.length;
+	memcpy(dst, header, HEADER_LEN);
+	memcpy(dst + HEADER_LEN, data, len);
+	m_pending.length += HEADER_LEN + len;
+	m_appended += HEADER_LEN + len;
+
+	uint64_t lsn = m_appended;
+	pthread_cond_signal(&m_append_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	m_last = lsn;
+	return lsn;
+}
+
+uint64_t wal_last(void)
+{
+	return m_last;
+}
+
+int8_t wal_committed(uint64_t lsn)
+{
+	if (atomic_load_explicit(&m_durable, memory_order_acquire) >= lsn)
+		return 1;
+
+	/* Ces enregistrements ne seront jamais ecrits */
+	if (atomic_load(&m_failed))
+		return -1;
+
+	return m_mode != WAL_SYNC;
+}
+
+uint8_t wal_watch(int efd)
+{
+	if (m_watcher_count >= WATCH_MAX)
+		return 1;
+
+	m_watchers[m_watcher_count++] = efd;
+	return 0;
+}
+
+void *wal_loop(void *args)
+{
+	(void) args;
+	uint64_t last_flush = 0;
+
+	pthread_mutex_lock(&m_mutex);
+	while (!m_closed) {
+		if (m_pending.length == 0) {
+			pthread_cond_wait(&m_append_cond, &m_mutex);
+			continue;
+		}
+
+		/* WAL_BATCH : les ajouts s'accumulent jusqu'a l'echeance */
+		uint64_t now = timer_clock_ms();
+		if (m_mode == WAL_BATCH && now < last_flush + WAL_BATCH_MS) {
+			pthread_mutex_unlock(&m_mutex);
+			uint64_t delay = last_flush + WAL_BATCH_MS - now;
+			struct timespec ts = { 0, (long) delay * 1000000 };
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&m_mutex);
+			continue;
+		}
+
+		Buffer buf = m_writing;
+		m_writing = m_pending;
+		m_pending = buf;
+		m_pending.length = 0;
+
+		uint64_t end = m_appended;
+		m_busy = 1;
+		pthread_mutex_unlock(&m_mutex);
+
+		flush(end);
+		last_flush = timer_clock_ms();
+
+		pthread_mutex_lock(&m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
@@ -9,7 +9,7 @@
 #define GREEN  "\001\033[0;92m\002"
 #define YELLOW "\001\033[0;93m\002"
 
-uint16_t d_errno = NOERROR;
+_Thread_local uint16_t d_errno = NOERROR;
 
 /* ---------------------------- PUBLIC FUNCTIONS --------------------------- */
 
@@ -151,24 +151,31 @@ void log_init(void)
 void log_to_file(const char *format, ...)
 {
 	const uint8_t st_buflen = 32;
+	char line[512];
 
 	time_t timestamp = time(NULL);
-	struct tm *tm_info = localtime(&timestamp);
+	struct tm tm_info;
+	localtime_r(&timestamp, &tm_info);
 	char strdatestamp[st_buflen];
 	char strtimestamp[st_buflen];
 
-	strftime(strdatestamp, st_buflen, "%H:%M:%S", tm_info);
-	strftime(strtimestamp, st_buflen, "%F (%a)", tm_info);
+	strftime(strdatestamp, st_buflen, "%H:%M:%S", &tm_info);
+	strftime(strtimestamp, st_buflen, "%F (%a)", &tm_info);
 
-	dprintf(logfd, "%s, ", strdatestamp);
-    	dprintf(logfd, "%s, ", strtimestamp);
+	int len = snprintf(line, sizeof(line), "%s, %s, ",
+			   strdatestamp, strtimestamp);
 
 	va_list args;
 	va_start(args, format);
 
-	vdprintf(logfd, format, args);
+	len += vsnprintf(line + len, sizeof(line) - (size_t) len, format, args);
 
 	va_end(args);
+
+	/* Une seule ecriture par ligne, plusieurs threads journalisent */
+	if (len > (int) sizeof(line) - 1)
+		len = (int) sizeof(line) - 1;
+	write(logfd, line, (size_t) len);
 }
 
 /* -------------------------------------------------------------------------- */